@@ -0,0 +1,388 @@
+/*
+**	AUTHORS:
+**		Leopoldo Armesto
+**		Juan Dols
+**		Jaime Molina
+**
+**	MAGV Simulator by Leopoldo Armesto is licensed under a Creative Commons Attribution-NonCommercial-NoDerivatives 4.0 International License.
+**	To view a copy of this license, visit http://creativecommons.org/licenses/by-nc-nd/4.0/deed.en_GB.
+**
+**  EMAIL: larmesto@idf.upv.es
+**  URL: www.upv.es
+*/
+
+
+/// \cond PRIVATE
+
+/// \file
+/// Medida de rendimiento de la planificación de vehículos de nav_veh.cpp sobre el grafo real. \n
+/// Los vehículos se reparten por todo el grafo y avanzan cada frame hacia el nodo devuelto por nav::veh::Plan::Planify(), o por nav::veh::PlanifyAll()
+/// con 1 hilo y con tantos hilos como núcleos, y se comprueba que el resultado de nav::veh::PlanifyAll() no depende del número de hilos.
+/// También mide el cálculo de las tablas de rutas y de rutas con A*, y comprueba que los vehículos que siguen una ruta con nav::veh::Plan::Planify() llegan a su destino. \n
+/// No depende de PhysX ni de Ogre, se compila directamente con:
+/// \code
+///		g++ -O2 -I.. -I../shared nav_bench.cpp ../nav.cpp ../nav_veh.cpp ../nav_ped.cpp ../nav_sem.cpp -pthread -o nav_bench
+/// \endcode
+/// Opcionalmente recibe el fichero del grafo y el de tiempos de semáforos (por defecto los de data/).
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <thread>
+
+#include "main.hpp"
+#include "nav.hpp"
+
+
+static const float DT      = 0.05f;		///< Paso de simulación (segundos).
+static const float SPEED   = 12.0f;		///< Velocidad de los vehículos (metros/segundo).
+static const float LENGTH  = 4.5f;		///< Longitud de los vehículos (metros).
+static const float HORIZON = 5.0f;		///< Tiempo de planificación (segundos).
+static const float NEARBY  = 30.0f;		///< Distancia de búsqueda de vehículos cercanos (metros).
+static const int   FRAMES  = 400;
+static const int   REPEATS = 3;		///< Se muestra el mejor tiempo de varias repeticiones.
+static const int   WALK    = 1000;	///< Número máximo de nodos recorridos desde el nodo de nacimiento para repartir los vehículos.
+static const int   DESTINATIONS = 8;	///< Número de destinos de las tablas de rutas.
+static const int   ROUTED_FRAMES = 20000;	///< Número máximo de frames de la simulación con rutas, en la que los vehículos avanzan un nodo por frame.
+
+
+class Car : public nav::veh::Plan
+{
+	public:
+		Car() : x(0), y(0), met(0) { }
+		float x, y;
+		int   met;
+};
+
+
+static void CountNearby( nav::veh::Plan *plan, nav::veh::Plan *other )
+{
+	static_cast<Car*>( plan )->met++;
+}
+
+
+/// Reparte \a num vehículos por el grafo: hay pocos nodos de nacimiento, así que cada uno avanza algunos nodos desde el suyo,
+/// independientemente de la numeración de los nodos para poder comparar distintas ordenaciones del mismo grafo.
+static void Spread( const nav::veh::Graph *graph, nav::veh::Reservations *reservations, const int num, std::vector<Car> &cars, std::vector<nav::veh::Plan*> &plans, std::vector<nav::veh::Request> &requests )
+{
+	for( int i = 0; i < num; i++ ) {
+		Car &car = cars[i];
+		car.SetTurnBitsRandom( i );
+		car.Respawn( reservations, SPEED, i );
+		const int steps = ( i * 7919 ) % WALK;
+		for( int s = 0; s < steps; s++ ) {
+			const nav::veh::Node &node = graph->nodes[ car.curr ];
+			const unsigned int next = node.next[ node.next[1] ? ( i + s ) & 1 : 0 ];
+			if( !next ) break;
+			car.prev = car.curr;
+			car.curr = next;
+		}
+		car.x = graph->nodes[ car.prev ].x;
+		car.y = graph->nodes[ car.prev ].y;
+		plans[i] = &car;
+		requests[i].length = LENGTH;
+		requests[i].speed  = SPEED;
+		requests[i].time   = HORIZON;
+	}
+}
+
+
+/// Avanza cada vehículo hacia su nodo destino, parando detrás de las colisiones cercanas, y reaparece los que llegan al final de la carretera.
+static void Move( const int num, std::vector<Car> &cars, const std::vector<nav::veh::Plan::Info> &infos, const std::vector<const nav::veh::Node*> &targets, long &visited, long &collisions )
+{
+	for( int i = 0; i < num; i++ ) {
+		Car &car = cars[i];
+		const nav::veh::Plan::Info &info = infos[i];
+		const nav::veh::Node *target = targets[i];
+		if( !target ) {		// end of road
+			const nav::veh::Node *node = car.Respawn( SPEED );
+			car.x = node->x;
+			car.y = node->y;
+			continue;
+		}
+		visited += info.visited;
+		collisions += ( info.node != NULL );
+
+		const float dx = target->x - car.x;
+		const float dy = target->y - car.y;
+		const float d  = sqrtf( dx*dx + dy*dy );
+		const float s  = ( info.node && info.dist < 2.0f*LENGTH ? 0.0f : SPEED * DT );	// stop behind collisions
+		if( d > s ) {
+			car.x += dx * s / d;
+			car.y += dy * s / d;
+		}
+	}
+}
+
+
+/// Simula \a num vehículos durante ::FRAMES frames. Devuelve los tiempos totales de planificación y de búsqueda de vecinos.
+/// Con \a threads igual a 0 se planifica cada vehículo con nav::veh::Plan::Planify(), si no con nav::veh::PlanifyAll() y ese número de hilos.
+static void Simulate( const nav::veh::Graph *graph, const char *file_sem, const int num, const int threads, double &time_planify, double &time_nearby, long &visited, long &collisions, long &met )
+{
+	nav::veh::Reservations *reservations = nav::veh::CreateReservations( graph );
+	nav::veh::Planner *planner = ( threads ? nav::veh::CreatePlanner( reservations, threads ) : NULL );
+	std::vector<Car> cars( num );
+	std::vector<nav::veh::Plan*> plans( num );
+	std::vector<nav::veh::Request> requests( num );
+	std::vector<nav::veh::Plan::Info> infos( num );
+	std::vector<const nav::veh::Node*> targets( num );
+
+	time_planify = time_nearby = 0.0;
+	visited = collisions = met = 0;
+
+	nav::Initialize();
+	if( !nav::sem::Load( file_sem ) ) printf( "Can not load semaphore times '%s'\n", file_sem );
+
+	Spread( graph, reservations, num, cars, plans, requests );
+
+	for( int f = 0; f < FRAMES; f++ )
+	{
+		for( int i = 0; i < num; i++ ) {
+			requests[i].x = cars[i].x;
+			requests[i].y = cars[i].y;
+		}
+
+		double t0 = GetTime();
+		if( planner ) {
+			nav::veh::PlanifyAll( planner, &plans[0], &requests[0], &infos[0], &targets[0], num );
+		}
+		else {
+			for( int i = 0; i < num; i++ )
+				targets[i] = cars[i].Planify( requests[i].x, requests[i].y, LENGTH, SPEED, HORIZON, &infos[i] );
+		}
+		time_planify += GetTime() - t0;
+
+		Move( num, cars, infos, targets, visited, collisions );
+
+		t0 = GetTime();
+		for( int i = 0; i < num; i++ ) cars[i].Nearby( NEARBY, CountNearby );
+		time_nearby += GetTime() - t0;
+
+		nav::Update( DT );
+		nav::veh::UpdateReservations( reservations );
+	}
+
+	for( int i = 0; i < num; i++ ) met += cars[i].met;
+
+	nav::Finalize();
+	nav::veh::FreePlanner( planner );
+	nav::veh::FreeReservations( reservations );
+}
+
+
+/// Muestra el mejor tiempo de ::REPEATS simulaciones idénticas.
+static void Run( const nav::veh::Graph *graph, const char *file_sem, const int num, const int threads )
+{
+	double best_planify = 1e30, best_nearby = 1e30;
+	long visited, collisions, met;
+
+	for( int r = 0; r < REPEATS; r++ ) {
+		double time_planify, time_nearby;
+		Simulate( graph, file_sem, num, threads, time_planify, time_nearby, visited, collisions, met );
+		if( time_planify < best_planify ) best_planify = time_planify;
+		if( time_nearby  < best_nearby  ) best_nearby  = time_nearby;
+	}
+
+	const double steps = (double) num * FRAMES;
+	if( threads ) printf( "PlanifyAll %2d threads ", threads );
+	else          printf( "Planify               " );
+	printf( "%6d vehicles   planify %7.1f ns/veh   nearby %7.1f ns/veh   (%.1f visits/veh, %.1f%% collisions, %.2f nearby/veh)\n", num,
+		1e9 * best_planify / steps, 1e9 * best_nearby / steps, visited / steps, 100.0 * collisions / steps, met / steps );
+}
+
+
+/// Compara nav::veh::PlanifyAll() con 1 y con \a threads hilos sobre dos grupos idénticos de \a num vehículos durante ::FRAMES frames:
+/// el resultado no debe depender del número de hilos, así que cualquier diferencia en Plan::Info o en el destino de un vehículo es un fallo.
+static void CheckThreads( const nav::veh::Graph *graph, const char *file_sem, const int num, const int threads )
+{
+	nav::veh::Reservations *reservations[2];
+	nav::veh::Planner *planner[2];
+	std::vector<Car> cars[2];
+	std::vector<nav::veh::Plan*> plans[2];
+	std::vector<nav::veh::Request> requests[2];
+	std::vector<nav::veh::Plan::Info> infos[2];
+	std::vector<const nav::veh::Node*> targets[2];
+	long visited = 0, collisions = 0, mismatches = 0;
+
+	nav::Initialize();
+	if( !nav::sem::Load( file_sem ) ) printf( "Can not load semaphore times '%s'\n", file_sem );
+
+	for( int k = 0; k < 2; k++ ) {
+		reservations[k] = nav::veh::CreateReservations( graph );
+		planner[k] = nav::veh::CreatePlanner( reservations[k], ( k ? threads : 1 ) );
+		cars[k].resize( num );
+		plans[k].resize( num );
+		requests[k].resize( num );
+		infos[k].resize( num );
+		targets[k].resize( num );
+		Spread( graph, reservations[k], num, cars[k], plans[k], requests[k] );
+	}
+
+	for( int f = 0; f < FRAMES; f++ )
+	{
+		for( int k = 0; k < 2; k++ ) {
+			for( int i = 0; i < num; i++ ) {
+				requests[k][i].x = cars[k][i].x;
+				requests[k][i].y = cars[k][i].y;
+			}
+			nav::veh::PlanifyAll( planner[k], &plans[k][0], &requests[k][0], &infos[k][0], &targets[k][0], num );
+		}
+
+		for( int i = 0; i < num; i++ ) {
+			const nav::veh::Plan::Info &a = infos[0][i];
+			const nav::veh::Plan::Info &b = infos[1][i];
+			const long plan_a = ( a.plan ? static_cast<Car*>( a.plan ) - &cars[0][0] : -1 );
+			const long plan_b = ( b.plan ? static_cast<Car*>( b.plan ) - &cars[1][0] : -1 );
+			bool same = ( targets[0][i] == targets[1][i] && ( a.node == NULL ) == ( b.node == NULL ) && a.visited == b.visited &&
+				a.sign_dist == b.sign_dist && a.speed_limit == b.speed_limit && a.curvature == b.curvature );
+			if( same && a.node )
+				same = ( a.node == b.node && plan_a == plan_b && a.dist == b.dist && a.time == b.time && a.myway == b.myway && a.semaphore == b.semaphore );
+			mismatches += !same;
+		}
+
+		for( int k = 0; k < 2; k++ ) {
+			Move( num, cars[k], infos[k], targets[k], visited, collisions );
+			nav::veh::UpdateReservations( reservations[k] );
+		}
+		nav::Update( DT );
+	}
+
+	nav::Finalize();
+	for( int k = 0; k < 2; k++ ) {
+		nav::veh::FreePlanner( planner[k] );
+		nav::veh::FreeReservations( reservations[k] );
+	}
+
+	printf( "PlanifyAll 1 vs %d threads  %6d vehicles   %ld mismatches in %d frames   %s\n", threads, num, mismatches, FRAMES, ( mismatches ? "FAILED" : "ok" ) );
+}
+
+
+/// Conduce con nav::veh::Plan::Planify() un vehículo desde cada uno de \a num nodos de nacimiento, con una ruta hacia uno de los destinos de \a routes
+/// (ver nav::veh::Plan::SetRoute()), y comprueba que todos los que tienen el destino alcanzable llegan a él.
+/// Cada frame se coloca el vehículo justo después de su nodo actual, de modo que Planify() lo avanza un nodo por frame siguiendo la ruta.
+static void RunRouted( const nav::veh::Graph *graph, const char *file_sem, const nav::veh::Routes *routes, const unsigned int *destinations, const int num )
+{
+	nav::veh::Reservations *reservations = nav::veh::CreateReservations( graph );
+	std::vector<Car> cars( num );
+	std::vector<bool> driving( num );
+	int routed = 0, arrived = 0, lost = 0, frames = 0;
+
+	nav::Initialize();
+	if( !nav::sem::Load( file_sem ) ) printf( "Can not load semaphore times '%s'\n", file_sem );
+
+	for( int i = 0; i < num; i++ ) {
+		cars[i].SetTurnBitsRandom( i );
+		cars[i].Respawn( reservations, SPEED, i );
+		driving[i] = cars[i].SetRoute( routes, i % DESTINATIONS );
+		routed += driving[i];
+	}
+
+	const double t0 = GetTime();
+	for( int driven = routed; driven && frames < ROUTED_FRAMES; frames++ )
+	{
+		for( int i = 0; i < num; i++ ) {
+			if( !driving[i] ) continue;
+			Car &car = cars[i];
+			const nav::veh::Node &prev = graph->nodes[ car.prev ];
+			const nav::veh::Node &curr = graph->nodes[ car.curr ];
+			nav::veh::Plan::Info info;
+			const nav::veh::Node *target = car.Planify( curr.x + 0.01f*( curr.x - prev.x ), curr.y + 0.01f*( curr.y - prev.y ), LENGTH, SPEED, HORIZON, &info );
+			if( car.curr == destinations[ i % DESTINATIONS ] ) arrived++;
+			else if( !target || !car.curr ) lost++;		// end of road before the destination
+			else continue;
+			driving[i] = false;
+			driven--;
+		}
+		nav::Update( DT );
+		nav::veh::UpdateReservations( reservations );
+	}
+
+	nav::Finalize();
+	nav::veh::FreeReservations( reservations );
+
+	printf( "routed Planify   %d/%d vehicles arrived, %d lost, in %d frames (%.1f ms)   %s\n", arrived, routed, lost, frames, 1e3 * ( GetTime() - t0 ),
+		( arrived == routed ? "ok" : "FAILED" ) );
+}
+
+
+/// Muestra la localidad de la numeración de los nodos: distancia en memoria entre los dos nodos de cada arista.
+static void PrintLocality( const char *label, const nav::veh::Graph *graph )
+{
+	long edges = 0, near_line = 0, near_page = 0;
+	double jump = 0.0;
+	for( unsigned int i = 1; i < graph->num_nodes; i++ ) {
+		for( int k = 0; k < 2; k++ ) {
+			const unsigned int j = graph->nodes[i].next[k];
+			if( !j ) continue;
+			const long bytes = labs( (long) j - (long) i ) * sizeof(nav::veh::Node);
+			edges++;
+			near_line += ( bytes <= 64 );
+			near_page += ( bytes < 4096 );
+			jump += bytes;
+		}
+	}
+	printf( "edges (%s): %.1f%% within 64 B, %.1f%% within 4 KB, mean jump %.1f KB\n", label, 100.0 * near_line / edges, 100.0 * near_page / edges, jump / edges / 1024 );
+}
+
+
+int main( int argc, char **argv )
+{
+	const char *file_graph = ( argc > 1 ? argv[1] : "../../data/nav_veh_graph.dat" );
+	const char *file_sem   = ( argc > 2 ? argv[2] : "../../data/nav_sem_times.txt" );
+
+	double t0 = GetTime();
+	const nav::veh::Graph *graph = nav::veh::Load( file_graph );
+	if( !graph ) {
+		printf( "Can not load vehicle graph '%s'\n", file_graph );
+		return 1;
+	}
+	printf( "%s: %u nodes, %u spawns, loaded in %.2f ms\n", file_graph, graph->num_nodes, graph->num_spawns, 1e3 * ( GetTime() - t0 ) );
+
+	// the node order of the file and the renumbered order of veh::Load(), which only applies to version 1 files
+	const nav::veh::Graph *renumbered = nav::veh::Load( file_graph, true, true );
+	if( renumbered ) {
+		PrintLocality( "file order", graph );
+		PrintLocality( "renumbered", renumbered );
+		nav::veh::Free( renumbered );
+	}
+
+	// routing: next-hop tables for a few destinations and A* from every spawn node
+	unsigned int destinations[ DESTINATIONS ];
+	for( int d = 0; d < DESTINATIONS; d++ ) {
+		const nav::veh::Node &node = graph->nodes[ 1 + ( d * 104729u ) % ( graph->num_nodes - 1 ) ];
+		destinations[d] = nav::veh::FindNode( graph, node.x, node.y );
+	}
+	t0 = GetTime();
+	nav::veh::Routes *routes = nav::veh::CreateRoutes( graph, destinations, DESTINATIONS );
+	const double time_routes = GetTime() - t0;
+	int found = 0, junctions = 0;
+	t0 = GetTime();
+	for( unsigned int i = 0; i < graph->num_spawns; i++ ) {
+		const unsigned int spawn = 1 + i;
+		const nav::veh::Node &node = graph->nodes[ spawn ];
+		unsigned int bits;
+		const int j = nav::veh::FindRoute( graph, spawn, node.next[0], destinations[ i % DESTINATIONS ], &bits, NULL );
+		if( j >= 0 ) {
+			found++;
+			junctions += j;
+		}
+	}
+	printf( "routes: %d destinations in %.2f ms (%.1f KB), A* %.1f us/route (%d/%u found, %.1f junctions/route)\n", DESTINATIONS, 1e3 * time_routes,
+		DESTINATIONS * graph->num_nodes / 1024.0, 1e6 * ( GetTime() - t0 ) / graph->num_spawns, found, graph->num_spawns, found ? (double) junctions / found : 0.0 );
+	RunRouted( graph, file_sem, routes, destinations, graph->num_spawns );
+	nav::veh::FreeRoutes( routes );
+
+	const int sizes[] = { 100, 500, 2000 };
+	const int cores = std::thread::hardware_concurrency();
+	for( int s = 0; s < 3; s++ ) {
+		Run( graph, file_sem, sizes[s], 0 );
+		Run( graph, file_sem, sizes[s], 1 );
+		if( cores > 1 ) Run( graph, file_sem, sizes[s], cores );
+	}
+	CheckThreads( graph, file_sem, sizes[1], ( cores > 1 ? cores : 4 ) );	// also on a single core, the threads interleave anyway
+
+	nav::veh::Free( graph );
+	return 0;
+}
@@ -0,0 +1,706 @@
+/*
+**	AUTHORS:
+**		Leopoldo Armesto
+**		Juan Dols
+**		Jaime Molina
+**
+**	MAGV Simulator by Leopoldo Armesto is licensed under a Creative Commons Attribution-NonCommercial-NoDerivatives 4.0 International License.
+**	To view a copy of this license, visit http://creativecommons.org/licenses/by-nc-nd/4.0/deed.en_GB.
+**
+**  EMAIL: larmesto@idf.upv.es
+**  URL: www.upv.es
+*/
+
+
+/// \cond PRIVATE
+
+/// \file
+/// Medida de rendimiento de la cuadricula de world.cpp. \n
+/// No depende de PhysX ni de Ogre, se compila directamente con:
+/// \code
+///		g++ -O2 -pthread -I.. -I../shared world_bench.cpp ../world.cpp -o world_bench
+/// \endcode
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <sched.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+
+#include "main.hpp"
+#include "world.hpp"
+
+
+static const float AREA = 2000.0f;		///< Lado del área cuadrada donde se distribuyen las entidades (metros).
+static const float STEP = 1.5f;			///< Desplazamiento máximo de cada entidad por frame (metros).
+static const float QUERY_RADIUS = 20.0f;	///< Radio de las búsquedas, similar a sim::VEH_ENVIRONMENT_RADIUS.
+static const int   FRAMES = 20;
+
+static const float RAY_LENGTH = 30.0f;	///< Distancia de comprobación por delante del vehículo (metros).
+static const float RAY_RADIUS = 2.5f;	///< Semi-anchura del pasillo por delante del vehículo (metros).
+
+
+class Agent : public world::Entity
+{
+	public:
+		Agent( unsigned int type = 1 ) : Entity(type), x(0), y(0) { }
+		float x, y;
+};
+
+
+static void Run( const char *mode, const int num, const world::Config &config )
+{
+	std::vector<Agent> agents( num );
+
+	world::Initialize( config );
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+
+	double t0 = GetTime();
+	for( int f = 0; f < FRAMES; f++ ) {
+		for( int i = 0; i < num; i++ ) {
+			agents[i].x += RandF( -STEP, STEP, i, 2*f+2 );
+			agents[i].y += RandF( -STEP, STEP, i, 2*f+3 );
+			agents[i].WorldUpdate( agents[i].x, agents[i].y );
+		}
+	}
+	const double t_update = ( GetTime() - t0 ) / ( (double)FRAMES * num );
+
+	t0 = GetTime();
+	for( int f = 0; f < FRAMES; f++ ) {
+		for( int i = 0; i < num; i++ ) {
+			agents[i].x += RandF( -STEP, STEP, i, 2*f+FRAMES*2+2 );
+			agents[i].y += RandF( -STEP, STEP, i, 2*f+FRAMES*2+3 );
+			agents[i].WorldMove( agents[i].x, agents[i].y );
+		}
+		world::CommitUpdates();
+	}
+	const double t_batch = ( GetTime() - t0 ) / ( (double)FRAMES * num );
+
+	long found = 0;
+	t0 = GetTime();
+	for( int i = 0; i < num; i++ ) {
+		world::NearbyIterator nearby( agents[i].x, agents[i].y, QUERY_RADIUS );
+		while( nearby.Next() ) found++;
+	}
+	const double t_query = ( GetTime() - t0 ) / num;
+
+	// exact radius: caller-side distance test vs bulk query
+	long exact = 0, bulk = 0;
+	t0 = GetTime();
+	for( int i = 0; i < num; i++ ) {
+		world::NearbyIterator nearby( agents[i].x, agents[i].y, QUERY_RADIUS );
+		while( world::Entity *ent = nearby.Next() ) {
+			const Agent *a = (const Agent*) ent;
+			const float dx = a->x - agents[i].x;
+			const float dy = a->y - agents[i].y;
+			if( dx*dx + dy*dy <= QUERY_RADIUS*QUERY_RADIUS ) exact++;
+		}
+	}
+	const double t_exact = ( GetTime() - t0 ) / num;
+
+	std::vector<world::Entity*> out( num );
+	std::vector<float> dist( num );
+	t0 = GetTime();
+	for( int i = 0; i < num; i++ )
+		bulk += world::NearbyQuery( agents[i].x, agents[i].y, QUERY_RADIUS, world::ALL_TYPES, &out[0], &dist[0], num );
+	const double t_bulk = ( GetTime() - t0 ) / num;
+
+	printf( "%-6s %7d   update %6.1f ns/op   batched %6.1f ns/op   query %8.1f ns/op   (%.1f entities/query)\n",
+		mode, num, t_update*1e9, t_batch*1e9, t_query*1e9, found / (double)num );
+	printf( "%-6s %7d   exact radius: iterator %8.1f ns/op   bulk %8.1f ns/op   (%.1f / %.1f entities/query)\n",
+		mode, num, t_exact*1e9, t_bulk*1e9, exact / (double)num, bulk / (double)num );
+
+	// bulk queries between WorldMove() and CommitUpdates(), against brute force: every entity returned is inside at its notified position,
+	// and every entity inside both at its notified and at its committed position (so its cell is visited) is returned
+	std::vector<float> old_x( num ), old_y( num );
+	std::vector<char> returned( num );
+	for( int i = 0; i < num; i++ ) {
+		old_x[i] = agents[i].x;
+		old_y[i] = agents[i].y;
+		agents[i].x += RandF( -QUERY_RADIUS, QUERY_RADIUS, i, 4*FRAMES+2 );
+		agents[i].y += RandF( -QUERY_RADIUS, QUERY_RADIUS, i, 4*FRAMES+3 );
+		agents[i].WorldMove( agents[i].x, agents[i].y );
+	}
+	const float r2 = QUERY_RADIUS*QUERY_RADIUS;
+	long errors = 0;
+	for( int q = 0; q < 100; q++ ) {
+		const Agent &c = agents[ ( q * 7919 ) % num ];
+		for( int box = 0; box < 2; box++ ) {
+			const int n = ( box ? world::NearbyQueryBox( c.x - QUERY_RADIUS, c.y - QUERY_RADIUS, c.x + QUERY_RADIUS, c.y + QUERY_RADIUS, world::ALL_TYPES, &out[0], num )
+			                    : world::NearbyQuery( c.x, c.y, QUERY_RADIUS, world::ALL_TYPES, &out[0], &dist[0], num ) );
+			std::fill( returned.begin(), returned.end(), 0 );
+			for( int j = 0; j < n; j++ ) {
+				const Agent *a = (const Agent*) out[j];
+				const float dx = a->x - c.x;
+				const float dy = a->y - c.y;
+				returned[ a - &agents[0] ] = 1;
+				if( box ? fabsf( dx ) > QUERY_RADIUS || fabsf( dy ) > QUERY_RADIUS : dx*dx + dy*dy > r2 || fabsf( dist[j] - sqrtf( dx*dx + dy*dy ) ) > 1e-3f ) errors++;
+			}
+			for( int i = 0; i < num; i++ ) {
+				const float dx = agents[i].x - c.x, dy = agents[i].y - c.y;
+				const float ox = old_x[i] - c.x,    oy = old_y[i] - c.y;
+				const bool inside = ( box ? fabsf( dx ) <= QUERY_RADIUS && fabsf( dy ) <= QUERY_RADIUS && fabsf( ox ) <= QUERY_RADIUS && fabsf( oy ) <= QUERY_RADIUS
+				                          : dx*dx + dy*dy <= r2 && ox*ox + oy*oy <= r2 );
+				if( inside && !returned[i] ) errors++;
+			}
+		}
+	}
+	world::CommitUpdates();
+	printf( "%-6s %7d   bulk query with pending moves vs brute force: %ld errors   %s\n", mode, num, errors, ( errors ? "FAILED" : "ok" ) );
+
+	world::Finalize();
+}
+
+
+/// Compara world::NearbyRayIterator con un world::NearbyIterator que cubre toda la distancia de comprobación.
+/// También verifica que el iterador de rayo devuelve todas las entidades dentro del pasillo.
+static void RunRay( const int num )
+{
+	std::vector<Agent> agents( num );
+
+	world::Initialize();
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+
+	const int queries = 2000;
+	long box_cells = 0, box_found = 0, ray_cells = 0, ray_found = 0, missed = 0;
+	double t_box = 0.0, t_ray = 0.0;
+	
+	for( int q = 0; q < queries; q++ )
+	{
+		const float px  = RandF( -0.5f*AREA, 0.5f*AREA, q, 10 );
+		const float py  = RandF( -0.5f*AREA, 0.5f*AREA, q, 11 );
+		const float ang = RandF( 0.0f, 6.2831853f, q, 12 );
+		const float dx  = cosf( ang );
+		const float dy  = sinf( ang );
+		
+		double t0 = GetTime();
+		world::NearbyIterator box( px, py, RAY_LENGTH );
+		while( box.Next() ) box_found++;
+		t_box += GetTime() - t0;
+		box_cells += box.GetVisitedCells();
+		
+		t0 = GetTime();
+		world::NearbyRayIterator ray( px, py, dx, dy, RAY_RADIUS, RAY_LENGTH );
+		while( ray.Next() ) ray_found++;
+		t_ray += GetTime() - t0;
+		ray_cells += ray.GetVisitedCells();
+
+		// every entity inside the corridor must be returned
+		std::vector<world::Entity*> found;
+		ray.Reset();
+		while( world::Entity *ent = ray.Next() ) found.push_back( ent );
+		for( int i = 0; i < num; i++ ) {
+			const float rx = agents[i].x - px;
+			const float ry = agents[i].y - py;
+			float t = rx*dx + ry*dy;
+			t = ( t < 0.0f ? 0.0f : t > RAY_LENGTH ? RAY_LENGTH : t );
+			const float ex = rx - t*dx;
+			const float ey = ry - t*dy;
+			if( ex*ex + ey*ey > RAY_RADIUS*RAY_RADIUS ) continue;
+			bool ok = false;
+			for( size_t j = 0; j < found.size() && !ok; j++ ) ok = ( found[j] == &agents[i] );
+			if( !ok ) missed++;
+		}
+	}
+
+	printf( "ray    %7d   box %5.1f cells %6.1f entities %7.1f ns   ray %5.1f cells %6.1f entities %7.1f ns   missed %ld\n",
+		num, box_cells / (double)queries, box_found / (double)queries, t_box / queries * 1e9,
+		ray_cells / (double)queries, ray_found / (double)queries, t_ray / queries * 1e9, missed );
+
+	world::Finalize();
+}
+
+
+/// Mide world::NearestK() con tipos de entidad y valores de \a k variados, y compara cada resultado con la ordenación por fuerza bruta de todas las entidades.
+static void RunNearest( const char *mode, const int num, const world::Config &config )
+{
+	const int queries = 500;
+	const int ks[] = { 1, 4, 16, 100 };
+	std::vector<Agent*> agents( num );
+	std::vector<world::Entity*> out( 100 );
+	std::vector<float> dist( 100 ), ref;
+
+	world::Initialize( config );
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i] = new Agent( 1 + i % 3 );
+		agents[i]->SetExtent( 0.5f * ( i % 4 ) );
+		agents[i]->x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i]->y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i]->WorldUpdate( agents[i]->x, agents[i]->y );
+	}
+
+	long found = 0, mismatches = 0;
+	double t = 0.0;
+	for( int q = 0; q < queries; q++ ) {
+		const float px = RandF( -0.5f*AREA, 0.5f*AREA, q, 20 );
+		const float py = RandF( -0.5f*AREA, 0.5f*AREA, q, 21 );
+		const int   k  = ks[ q % 4 ];
+		const unsigned int mask = ( q % 3 ? world::TypeMask( 1 + q % 3 ) : world::ALL_TYPES );
+		const float max_radius = ( q % 5 == 4 ? 1e9f : q & 1 ? 256.0f : 40.0f );	// past the 16-bit cell coordinates
+
+		const double t0 = GetTime();
+		const int n = world::NearestK( px, py, k, mask, &out[0], &dist[0], max_radius );
+		t += GetTime() - t0;
+		found += n;
+
+		// the k smallest distances of the accepted types within the radius, in order
+		ref.clear();
+		for( int i = 0; i < num; i++ ) {
+			const float dx = agents[i]->x - px;
+			const float dy = agents[i]->y - py;
+			const float d  = sqrtf( dx*dx + dy*dy );
+			if( ( world::TypeMask( agents[i]->GetType() ) & mask ) && d <= max_radius ) ref.push_back( d );
+		}
+		std::sort( ref.begin(), ref.end() );
+		if( n != std::min( k, (int) ref.size() ) ) {
+			mismatches++;
+			continue;
+		}
+		for( int j = 0; j < n; j++ ) {
+			const Agent *a = (const Agent*) out[j];
+			const float dx = a->x - px;
+			const float dy = a->y - py;
+			if( fabsf( dist[j] - ref[j] ) > 1e-3f || fabsf( dist[j] - sqrtf( dx*dx + dy*dy ) ) > 1e-3f || !( world::TypeMask( a->GetType() ) & mask ) ) {
+				mismatches++;
+				break;
+			}
+		}
+	}
+
+	printf( "knn    %-6s %7d   NearestK %8.1f ns/query   (%.1f entities/query)   mismatches %ld   %s\n",
+		mode, num, t / queries * 1e9, found / (double)queries, mismatches, ( mismatches ? "FAILED" : "ok" ) );
+
+	world::Finalize();
+	for( int i = 0; i < num; i++ ) delete agents[i];
+}
+
+
+static void CountPairs( const world::Pair pairs[], const int count, void *user )
+{
+	*(long*)user += count;
+}
+
+
+/// Compara las interacciones por parejas mediante una búsqueda por entidad con world::ForEachPair().
+static void RunPairs( const int num )
+{
+	const float radius = 5.0f;
+	std::vector<Agent> agents( num );
+
+	world::Initialize();
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+
+	long visits = 0;
+	double t0 = GetTime();
+	for( int i = 0; i < num; i++ ) {
+		world::NearbyIterator nearby( agents[i].x, agents[i].y, radius );
+		while( world::Entity *ent = nearby.Next() ) {
+			const Agent *a = (const Agent*) ent;
+			const float dx = a->x - agents[i].x;
+			const float dy = a->y - agents[i].y;
+			if( a != &agents[i] && dx*dx + dy*dy <= radius*radius ) visits++;
+		}
+	}
+	const double t_nearby = GetTime() - t0;
+
+	long pairs = 0;
+	t0 = GetTime();
+	world::ForEachPair( radius, world::ALL_TYPES, CountPairs, &pairs );
+	const double t_pairs = GetTime() - t0;
+
+	// every pair is visited once from each of its two entities
+	printf( "pairs  %7d   per-entity queries %8.2f ms (%ld visits)   ForEachPair %8.2f ms (%ld pairs)   %s\n",
+		num, t_nearby*1e3, visits, t_pairs*1e3, pairs, ( 2*pairs == visits ? "ok" : "FAILED" ) );
+
+	world::Finalize();
+}
+
+
+/// Compara una búsqueda por entidad y frame con las listas de vecinos (world::NeighbourList) en tráfico estable.
+static void RunNeighbours( const int num )
+{
+	const float radius = 5.0f;
+	const float skin   = 2.0f;
+	const float speed  = 0.3f;		// ~10 m/s at 30 fps
+	std::vector<Agent> agents( num );
+	std::vector<float> vx( num ), vy( num );
+
+	world::Initialize();
+
+	for( int i = 0; i < num; i++ ) {
+		const float a = RandF( 0.0f, 2.0f*M_PI, i, 2 );
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		vx[i] = speed * cosf( a );
+		vy[i] = speed * sinf( a );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+
+	std::vector<world::NeighbourList*> lists( num );
+	for( int i = 0; i < num; i++ )
+		lists[i] = new world::NeighbourList( radius, skin );
+
+	long visits[2] = { 0, 0 };
+	double t[2] = { 0.0, 0.0 };
+	for( int f = 0; f < FRAMES; f++ ) {
+		for( int i = 0; i < num; i++ ) {
+			agents[i].x += vx[i];
+			agents[i].y += vy[i];
+			agents[i].WorldMove( agents[i].x, agents[i].y );
+		}
+		world::CommitUpdates();
+
+		double t0 = GetTime();
+		for( int i = 0; i < num; i++ ) {
+			world::NearbyIterator nearby( agents[i].x, agents[i].y, radius );
+			while( world::Entity *ent = nearby.Next() ) {
+				const Agent *a = (const Agent*) ent;
+				const float dx = a->x - agents[i].x;
+				const float dy = a->y - agents[i].y;
+				if( a != &agents[i] && dx*dx + dy*dy <= radius*radius ) visits[0]++;
+			}
+		}
+		t[0] += GetTime() - t0;
+
+		t0 = GetTime();
+		for( int i = 0; i < num; i++ ) {
+			lists[i]->Update( agents[i] );
+			world::NeighbourIterator neighbours( *lists[i] );
+			while( world::Entity *ent = neighbours.Next() ) {
+				const Agent *a = (const Agent*) ent;
+				const float dx = a->x - agents[i].x;
+				const float dy = a->y - agents[i].y;
+				if( dx*dx + dy*dy <= radius*radius ) visits[1]++;
+			}
+		}
+		t[1] += GetTime() - t0;
+	}
+
+	unsigned long hits = 0, misses = 0;
+	for( int i = 0; i < num; i++ ) {
+		hits   += lists[i]->GetHits();
+		misses += lists[i]->GetMisses();
+		delete lists[i];
+	}
+
+	// the cached lists must find exactly the same neighbours as the queries
+	printf( "neigh  %7d   per-frame queries %7.1f ns/agent (%ld visits)   cached lists %7.1f ns/agent (%ld visits)   hits %lu misses %lu   %s\n",
+		num, t[0]*1e9/( (double)FRAMES*num ), visits[0], t[1]*1e9/( (double)FRAMES*num ), visits[1], hits, misses, ( visits[0] == visits[1] ? "ok" : "FAILED" ) );
+
+	world::Finalize();
+}
+
+
+/// Compara la búsqueda completa del entorno de un autobús en movimiento con una región vigilada (world::Watch()) que recibe solo las diferencias.
+static void RunWatch( const int num )
+{
+	const int frames = 200;
+	const float speed = 0.4f;	// ~12 m/s at 30 fps
+	std::vector<Agent> agents( num );
+	std::vector<world::Entity*> out( num );
+
+	world::Initialize();
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+
+	float bus_x = agents[0].x, bus_y = agents[0].y;
+	const int watch = world::Watch( bus_x, bus_y, QUERY_RADIUS, world::ALL_TYPES, num );
+
+	long found = 0, events = 0;
+	double t_update = 0.0, t_query = 0.0, t_watch = 0.0;
+	for( int f = 0; f < frames; f++ ) {
+		world::WatchClear( watch );
+
+		double t0 = GetTime();
+		for( int i = 0; i < num; i++ ) {
+			agents[i].x += RandF( -0.1f*STEP, 0.1f*STEP, i, 2*f+2 );
+			agents[i].y += RandF( -0.1f*STEP, 0.1f*STEP, i, 2*f+3 );
+			agents[i].WorldMove( agents[i].x, agents[i].y );
+		}
+		world::CommitUpdates();
+		t_update += GetTime() - t0;
+
+		bus_x += speed;
+		bus_y += 0.5f * speed;
+
+		t0 = GetTime();
+		found += world::NearbyQuery( bus_x, bus_y, QUERY_RADIUS, world::ALL_TYPES, &out[0], NULL, num );
+		t_query += GetTime() - t0;
+
+		t0 = GetTime();
+		world::WatchMove( watch, bus_x, bus_y );
+		int count;
+		bool overflow;
+		world::WatchEvents( watch, count, overflow );
+		t_watch += GetTime() - t0;
+		events += count;
+	}
+
+	printf( "watch  %7d   update %6.1f ns/op   full query %8.1f ns/frame (%.1f entities)   watch move %8.1f ns/frame (%.1f events)\n",
+		num, t_update*1e9/( (double)frames*num ), t_query*1e9/frames, (double)found/frames, t_watch*1e9/frames, (double)events/frames );
+
+	world::Unwatch( watch );
+	world::Finalize();
+}
+
+
+/// Compara las búsquedas por área en la cuadricula real (una búsqueda en la tabla por celda, fila a fila)
+/// con las búsquedas en la copia publicada (world::SnapshotIterator), que recorre rangos contiguos de celdas y entidades.
+static void RunSnapshot( const int num, const float radius )
+{
+	const int queries = 2000;
+	std::vector<Agent> agents( num );
+
+	world::Initialize();
+
+	for( int i = 0; i < num; i++ ) {
+		agents[i].x = RandF( -0.5f*AREA, 0.5f*AREA, i, 0 );
+		agents[i].y = RandF( -0.5f*AREA, 0.5f*AREA, i, 1 );
+		agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	}
+	world::Publish();
+	const world::Snapshot *snapshot = world::SnapshotAcquire();
+
+	long found[2] = { 0, 0 };
+	double t0 = GetTime();
+	for( int q = 0; q < queries; q++ ) {
+		const Agent &a = agents[ ( q * 7919 ) % num ];
+		world::NearbyIterator nearby( a.x, a.y, radius );
+		while( nearby.Next() ) found[0]++;
+	}
+	const double t_live = ( GetTime() - t0 ) / queries;
+
+	t0 = GetTime();
+	for( int q = 0; q < queries; q++ ) {
+		const Agent &a = agents[ ( q * 7919 ) % num ];
+		world::SnapshotIterator nearby( snapshot, a.x, a.y, radius );
+		while( nearby.Next() ) found[1]++;
+	}
+	const double t_snap = ( GetTime() - t0 ) / queries;
+
+	printf( "area   %7d   %3.0f m   grid lookups %8.1f ns/query   snapshot scan %8.1f ns/query   (%.1f / %.1f entities/query)\n",
+		num, radius, t_live*1e9, t_snap*1e9, (double)found[0]/queries, (double)found[1]/queries );
+
+	// publishing never waits: with two old copies held it keeps the last one, and it resumes when a reader releases its copy
+	const bool second = world::Publish();
+	const world::Snapshot *held = world::SnapshotAcquire();
+	const bool third  = world::Publish();
+	const bool fourth = world::Publish();
+	world::SnapshotRelease( snapshot );
+	const bool fifth  = world::Publish();
+	const world::Snapshot *last = world::SnapshotAcquire();
+	const bool ok = ( second && third && !fourth && fifth && last->frame == 4 && held->frame == 2 );
+	printf( "area   %7d   publish with readers holding old copies: %d %d %d %d   %s\n", num, second, third, fourth, fifth, ( ok ? "ok" : "FAILED" ) );
+
+	world::SnapshotRelease( last );
+	world::SnapshotRelease( held );
+	world::Finalize();
+}
+
+
+/// Entidad de la prueba de la cola temporal: hilo productor y orden en el que se añadió.
+class Token : public world::Entity
+{
+	public:
+		Token() : Entity(1), producer(0), index(0) { }
+		int producer, index;
+};
+
+
+/// Prueba de carga de world::QueuePushBack() / world::QueuePopFront() con varios productores y consumidores simultáneos.
+/// Verifica que cada entidad se extrae una sola vez y que cada consumidor ve las entidades de cada productor en orden (FIFO). \n
+/// Las entidades están en el mundo y el hilo principal inserta otras mientras tanto, de modo que el pool crece mientras los productores marcan sus entradas.
+static void RunQueue( const int producers, const int consumers, const int per_producer )
+{
+	world::Config config;
+	config.queue_size = 1024;	// smaller than the number of entities: producers must wait while full
+	world::Initialize( config );
+
+	const int num = producers * per_producer;
+	std::vector<Token> tokens( num );
+	std::vector<Agent> spawned( num, Agent( 2 ) );
+	std::vector<std::atomic<int> > popped( num );
+	for( int i = 0; i < num; i++ ) {
+		tokens[i].producer = i / per_producer;
+		tokens[i].index    = i % per_producer;
+		tokens[i].WorldUpdate( 0.0f, 0.0f );
+		popped[i] = 0;
+	}
+
+	std::atomic<int> total( 0 ), disorder( 0 ), full( 0 );
+	std::vector<std::thread> threads;
+
+	const double t0 = GetTime();
+	for( int p = 0; p < producers; p++ )
+		threads.push_back( std::thread( [&, p]() {
+			for( int i = 0; i < per_producer; i++ )
+				while( !world::QueuePushBack( &tokens[ p * per_producer + i ] ) ) {
+					full++;
+					sched_yield();
+				}
+		} ) );
+	for( int c = 0; c < consumers; c++ )
+		threads.push_back( std::thread( [&]() {
+			std::vector<int> last( producers, -1 );
+			while( total < num ) {
+				const Token *t = (const Token*) world::QueuePopFront();
+				if( !t ) { sched_yield(); continue; }
+				if( t->index <= last[ t->producer ] ) disorder++;
+				last[ t->producer ] = t->index;
+				popped[ t - &tokens[0] ]++;
+				total++;
+			}
+		} ) );
+	for( int i = 0; i < num; i++ )
+		spawned[i].WorldUpdate( 1.0f, 1.0f );
+	for( size_t i = 0; i < threads.size(); i++ )
+		threads[i].join();
+	const double t = GetTime() - t0;
+	
+	// every token is queued, so searches no longer see them
+	int visible = 0;
+	world::NearbyIterator nearby( 0.0f, 0.0f, 1.0f, world::TypeMask( 1 ) );
+	while( nearby.Next() ) visible++;
+
+	int lost = 0, twice = 0;
+	for( int i = 0; i < num; i++ ) {
+		if( popped[i] == 0 ) lost++;
+		if( popped[i] > 1 ) twice++;
+	}
+
+	printf( "queue  %d producers %d consumers %7d entities   %6.1f ns/op   (%d full waits)   lost %d   twice %d   disorder %d   visible %d   %s\n",
+		producers, consumers, num, t / num * 1e9, (int)full, lost, twice, (int)disorder, visible,
+		( lost || twice || disorder || visible || world::QueuePopFront() ? "FAILED" : "ok" ) );
+
+	world::Finalize();
+}
+
+
+/// Mezcla de peatones, coches y autobuses con búsquedas cortas de peatones y largas de vehículos.
+/// Compara una cuadricula de un solo nivel con la jerárquica de 2, 8 y 32 metros.
+static void RunLevels( const char *mode, const world::Config &config )
+{
+	const int   num_ped = 100000, num_car = 5000, num_bus = 500;
+	const float ped_area = 300.0f;		// crowd in the city centre
+	const int   num = num_ped + num_car + num_bus;
+	std::vector<Agent*> agents( num );
+
+	world::Initialize( config );
+
+	for( int i = 0; i < num; i++ ) {
+		const bool ped = ( i < num_ped );
+		const bool car = ( !ped && i < num_ped + num_car );
+		agents[i] = new Agent( ped ? 1 : car ? 2 : 3 );
+		agents[i]->SetExtent( ped ? 0.35f : car ? 2.3f : 6.0f );
+		const float area = ( ped ? ped_area : AREA );
+		agents[i]->x = RandF( -0.5f*area, 0.5f*area, i, 0 );
+		agents[i]->y = RandF( -0.5f*area, 0.5f*area, i, 1 );
+		agents[i]->WorldUpdate( agents[i]->x, agents[i]->y );
+	}
+
+	const int queries = 20000;
+	long ped_found = 0, veh_found = 0, ped_cells = 0, veh_cells = 0;
+	const unsigned int veh_mask = world::TypeMask( 2 ) | world::TypeMask( 3 );
+
+	double t0 = GetTime();
+	for( int q = 0; q < queries; q++ ) {
+		const Agent *a = agents[ q % num_ped ];
+		world::NearbyIterator nearby( a->x, a->y, 1.5f, world::TypeMask( 1 ) );
+		while( nearby.Next() ) ped_found++;
+		ped_cells += nearby.GetVisitedCells();
+	}
+	const double t_ped = ( GetTime() - t0 ) / queries;
+
+	t0 = GetTime();
+	for( int q = 0; q < queries; q++ ) {
+		const Agent *a = agents[ num_ped + q % ( num_car + num_bus ) ];
+		world::NearbyIterator nearby( a->x, a->y, 60.0f, veh_mask );
+		while( nearby.Next() ) veh_found++;
+		veh_cells += nearby.GetVisitedCells();
+	}
+	const double t_veh = ( GetTime() - t0 ) / queries;
+
+	printf( "%-6s %7d   crowd 1.5 m %7.1f ns %6.1f cells %5.1f entities   vehicles 60 m %8.1f ns %6.1f cells %5.1f entities\n",
+		mode, num, t_ped*1e9, ped_cells / (double)queries, ped_found / (double)queries,
+		t_veh*1e9, veh_cells / (double)queries, veh_found / (double)queries );
+
+	world::Finalize();
+	for( int i = 0; i < num; i++ ) delete agents[i];
+}
+
+
+int main( int argc, char **argv )
+{
+	world::Config dense;
+	dense.dense_min_x = -0.5f*AREA - 100.0f;
+	dense.dense_min_y = -0.5f*AREA - 100.0f;
+	dense.dense_max_x = +0.5f*AREA + 100.0f;
+	dense.dense_max_y = +0.5f*AREA + 100.0f;
+
+	const int sizes[] = { 10000, 50000, 100000 };
+	for( int i = 0; i < 3; i++ ) {
+		Run( "hash",  sizes[i], world::Config() );
+		Run( "dense", sizes[i], dense );
+	}
+
+	for( int i = 0; i < 3; i++ )
+		RunRay( sizes[i] );
+
+	world::Config levels;
+	levels.num_levels   = 3;
+	levels.cell_size[0] = 2.0f;
+	levels.cell_size[1] = 8.0f;
+	levels.cell_size[2] = 32.0f;
+
+	for( int i = 0; i < 3; i++ ) {
+		RunNearest( "single", sizes[i], world::Config() );
+		RunNearest( "levels", sizes[i], levels );
+	}
+
+	for( int i = 0; i < 3; i++ )
+		RunPairs( sizes[i] );
+
+	for( int i = 0; i < 3; i++ )
+		RunNeighbours( sizes[i] );
+
+	for( int i = 0; i < 3; i++ )
+		RunWatch( sizes[i] );
+
+	for( int i = 0; i < 3; i++ ) {
+		RunSnapshot( sizes[i], 30.0f );
+		RunSnapshot( sizes[i], 100.0f );
+	}
+
+	RunQueue( 1, 1, 200000 );
+	RunQueue( 4, 1, 50000 );
+	RunQueue( 4, 4, 50000 );
+
+	RunLevels( "single", world::Config() );
+	RunLevels( "levels", levels );
+
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+**	AUTHORS:
+**		Leopoldo Armesto
+**		Juan Dols
+**		Jaime Molina
+**
+**	MAGV Simulator by Leopoldo Armesto is licensed under a Creative Commons Attribution-NonCommercial-NoDerivatives 4.0 International License.
+**	To view a copy of this license, visit http://creativecommons.org/licenses/by-nc-nd/4.0/deed.en_GB.
+**
+**  EMAIL: larmesto@idf.upv.es
+**  URL: www.upv.es
+*/
+
+
+/// \cond PRIVATE
+
+/// \file
+/// Batería de microbenchmarks de la cuadricula de world.cpp, para comprobar cada cambio en la cuadricula. \n
+/// Mide inserción, actualización, movimiento diferido, extracción y búsquedas con 1k, 10k y 100k entidades sintéticas
+/// en tres distribuciones: uniforme, agrupada (paradas de autobús y pasos de peatones) y alineada con calles. \n
+/// Para cada operación se muestra el tiempo medio, la mediana y el percentil 99 en ns por operación. Las operaciones
+/// baratas se miden en lotes de ::BATCH para que el coste del reloj no domine, de modo que sus percentiles son de lotes. \n
+/// No depende de PhysX ni de Ogre, se compila directamente con:
+/// \code
+///		g++ -O2 -I.. -I../shared world_suite.cpp ../world.cpp -o world_suite
+/// \endcode
+/// Opcionalmente recibe el número de entidades (p.ej. `./world_suite 10000`) para medir solo ese tamaño.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include <algorithm>
+
+#include "main.hpp"
+#include "world.hpp"
+
+
+static const float DENSITY_AREA = 100.0f;	///< Superficie media por entidad (m^2): el área crece con el número de entidades.
+static const float STEP         = 1.5f;		///< Desplazamiento máximo por actualización (metros).
+static const float QUERY_RADIUS = 20.0f;	///< Radio de las búsquedas, similar a sim::VEH_ENVIRONMENT_RADIUS.
+static const int   BATCH        = 32;		///< Operaciones por muestra en inserción, actualización y extracción.
+static const int   QUERIES      = 5000;		///< Búsquedas por prueba.
+
+enum Distribution { UNIFORM, CLUSTERED, ROAD, DISTRIBUTIONS };
+static const char *distribution_names[ DISTRIBUTIONS ] = { "uniform", "clustered", "road" };
+
+
+class Agent : public world::Entity
+{
+	public:
+		Agent() : Entity(1), x(0), y(0) { }
+		float x, y;
+};
+
+
+/// Genera las posiciones de las entidades.
+/// - Uniforme: en un cuadrado de lado sqrt( num * ::DENSITY_AREA ).
+/// - Agrupada: el 80% en grupos de 5 m de radio (una parada o paso de peatones cada 50 entidades), el resto uniforme.
+/// - Calles: sobre una malla de calles cada 100 m con 10 m de anchura, en ambas direcciones.
+static void Generate( const Distribution dist, std::vector<Agent> &agents, std::mt19937 &rng )
+{
+	const int   num  = agents.size();
+	const float side = sqrtf( num * DENSITY_AREA );
+	std::uniform_real_distribution<float> area( -0.5f*side, 0.5f*side );
+	std::uniform_real_distribution<float> unit( 0.0f, 1.0f );
+
+	std::vector<float> cx( num / 50 + 1 ), cy( num / 50 + 1 );
+	for( size_t c = 0; c < cx.size(); c++ ) {
+		cx[c] = area( rng );
+		cy[c] = area( rng );
+	}
+
+	const int roads = (int) ( side / 100.0f ) + 1;
+	for( int i = 0; i < num; i++ )
+	{
+		Agent &a = agents[i];
+		if( dist == CLUSTERED && unit( rng ) < 0.8f ) {
+			const int   c = rng() % cx.size();
+			const float r = 5.0f * sqrtf( unit( rng ) );
+			const float t = 6.2831853f * unit( rng );
+			a.x = cx[c] + r * cosf( t );
+			a.y = cy[c] + r * sinf( t );
+		}
+		else if( dist == ROAD ) {
+			const float along  = area( rng );
+			const float across = -0.5f*side + 100.0f * ( rng() % roads ) + 10.0f * ( unit( rng ) - 0.5f );
+			if( rng() & 1 ) { a.x = along;  a.y = across; }
+			else            { a.x = across; a.y = along;  }
+		}
+		else {
+			a.x = area( rng );
+			a.y = area( rng );
+		}
+	}
+}
+
+
+/// Muestra el tiempo medio, la mediana y el percentil 99 de las muestras (segundos por muestra de \a ops operaciones).
+static void Report( const char *dist, const int num, const char *op, std::vector<double> &samples, const int ops, const double extra = -1.0 )
+{
+	double total = 0.0;
+	for( size_t i = 0; i < samples.size(); i++ ) total += samples[i];
+	std::sort( samples.begin(), samples.end() );
+	const double scale = 1e9 / ops;
+	const double p50 = samples[ samples.size() / 2 ] * scale;
+	const double p99 = samples[ std::min( samples.size() - 1, samples.size() * 99 / 100 ) ] * scale;
+
+	printf( "%-9s %7d   %-14s %9.1f ns/op   p50 %9.1f   p99 %9.1f", dist, num, op, total * scale / samples.size(), p50, p99 );
+	if( extra >= 0.0 ) printf( "   (%.1f entities/query)", extra );
+	printf( "\n" );
+}
+
+
+static void Run( const Distribution dist, const int num )
+{
+	const char *name = distribution_names[ dist ];
+	std::mt19937 rng( 1234 + num * DISTRIBUTIONS + dist );
+	std::uniform_real_distribution<float> step( -STEP, STEP );
+	std::vector<Agent> agents( num );
+	std::vector<double> samples;
+	std::vector<world::Entity*> out( num );
+
+	Generate( dist, agents, rng );
+	world::Initialize();
+
+	// insert
+	samples.clear();
+	for( int i = 0; i + BATCH <= num; i += BATCH ) {
+		const double t0 = GetTime();
+		for( int j = i; j < i + BATCH; j++ ) agents[j].WorldUpdate( agents[j].x, agents[j].y );
+		samples.push_back( GetTime() - t0 );
+	}
+	for( int i = num - num % BATCH; i < num; i++ ) agents[i].WorldUpdate( agents[i].x, agents[i].y );
+	Report( name, num, "insert", samples, BATCH );
+
+	// immediate update
+	samples.clear();
+	for( int f = 0; f < 4; f++ ) {
+		for( int i = 0; i + BATCH <= num; i += BATCH ) {
+			for( int j = i; j < i + BATCH; j++ ) {
+				agents[j].x += step( rng );
+				agents[j].y += step( rng );
+			}
+			const double t0 = GetTime();
+			for( int j = i; j < i + BATCH; j++ ) agents[j].WorldUpdate( agents[j].x, agents[j].y );
+			samples.push_back( GetTime() - t0 );
+		}
+	}
+	Report( name, num, "update", samples, BATCH );
+
+	// deferred move + commit, one sample per frame
+	samples.clear();
+	for( int f = 0; f < 20; f++ ) {
+		for( int i = 0; i < num; i++ ) {
+			agents[i].x += step( rng );
+			agents[i].y += step( rng );
+		}
+		const double t0 = GetTime();
+		for( int i = 0; i < num; i++ ) agents[i].WorldMove( agents[i].x, agents[i].y );
+		world::CommitUpdates();
+		samples.push_back( GetTime() - t0 );
+	}
+	Report( name, num, "move+commit", samples, num );
+
+	// queries around random entities
+	long found = 0;
+	samples.clear();
+	for( int q = 0; q < QUERIES; q++ ) {
+		const Agent &a = agents[ rng() % num ];
+		const double t0 = GetTime();
+		world::NearbyIterator nearby( a.x, a.y, QUERY_RADIUS );
+		while( nearby.Next() ) found++;
+		samples.push_back( GetTime() - t0 );
+	}
+	Report( name, num, "query", samples, 1, (double)found / QUERIES );
+
+	found = 0;
+	samples.clear();
+	for( int q = 0; q < QUERIES; q++ ) {
+		const Agent &a = agents[ rng() % num ];
+		const double t0 = GetTime();
+		found += world::NearbyQuery( a.x, a.y, QUERY_RADIUS, world::ALL_TYPES, &out[0], NULL, num );
+		samples.push_back( GetTime() - t0 );
+	}
+	Report( name, num, "query exact", samples, 1, (double)found / QUERIES );
+
+	// delete, in random order
+	std::vector<int> order( num );
+	for( int i = 0; i < num; i++ ) order[i] = i;
+	std::shuffle( order.begin(), order.end(), rng );
+	samples.clear();
+	for( int i = 0; i + BATCH <= num; i += BATCH ) {
+		const double t0 = GetTime();
+		for( int j = i; j < i + BATCH; j++ ) agents[ order[j] ].WorldDelete();
+		samples.push_back( GetTime() - t0 );
+	}
+	Report( name, num, "delete", samples, BATCH );
+
+	world::Finalize();
+}
+
+
+int main( int argc, char **argv )
+{
+	const int sizes[] = { 1000, 10000, 100000 };
+	const int only = ( argc > 1 ? atoi( argv[1] ) : 0 );
+
+	for( int s = 0; s < 3; s++ ) {
+		if( only && sizes[s] != only ) continue;
+		for( int d = 0; d < DISTRIBUTIONS; d++ )
+			Run( (Distribution) d, sizes[s] );
+	}
+
+	return 0;
+}
@@ -15,9 +15,158 @@
 /// \cond PRIVATE
 
 
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "nav.hxx"
 
 
+/// Alineación de las secciones dentro del fichero (bytes).
+static const unsigned int SECTION_ALIGN = 64;
+
+
+/// Tabla del CRC-32 (polinomio reflejado 0xEDB88320) de nav::Crc32(), calculada en el constructor.
+struct Crc32Table {
+	unsigned int	entries[256];
+	
+	Crc32Table()
+	{
+		for( unsigned int i = 0; i < 256; i++ ) {
+			unsigned int c = i;
+			for( int k = 0; k < 8; k++ )
+				c = ( c & 1 ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1 );
+			this->entries[i] = c;
+		}
+	}
+};
+
+
+unsigned int nav::Crc32( const void *data, const size_t size, unsigned int crc )
+{
+	static const Crc32Table table;	// built once on the first call, even if several threads load files at the same time
+
+	const unsigned char *p = (const unsigned char*) data;
+	crc = ~crc;
+	for( size_t i = 0; i < size; i++ )
+		crc = table.entries[ ( crc ^ p[i] ) & 0xFF ] ^ ( crc >> 8 );
+	return ~crc;
+}
+
+
+const nav::FileHeader * nav::MapFile( const char *file, const char *magic, const unsigned int node_size, const bool check )
+{
+	const FileHeader *header = NULL;
+	struct stat st;
+	void *map = MAP_FAILED;
+	int fd;
+	
+	fd = open( file, O_RDONLY );
+	if( fd < 0 ) {
+		goto map_error;
+	}
+	
+	if( fstat( fd, &st ) || st.st_size < (off_t) sizeof(FileHeader) ) {
+		goto map_error;
+	}
+
+	map = mmap( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+	if( map == MAP_FAILED ) {
+		goto map_error;
+	}
+	close( fd );
+	fd = -1;
+	
+	header = (const FileHeader*) map;
+	if( strncmp( header->magic, magic, sizeof(header->magic) ) || header->version != FILE_VERSION || header->endian != FILE_ENDIAN ) {
+		goto map_error;
+	}
+	
+	if( header->file_size != (size_t) st.st_size || header->header_size < sizeof(FileHeader) || header->header_size > header->file_size || header->node_size != node_size ) {
+		goto map_error;
+	}
+	
+	for( int s = 0; s < FILE_MAX_SECTIONS; s++ ) {
+		const unsigned int offset = header->sections[s].offset;
+		const unsigned int size   = header->sections[s].size;
+		if( offset && ( offset % SECTION_ALIGN || offset < header->header_size || offset > header->file_size || size > header->file_size - offset ) ) {
+			goto map_error;
+		}
+	}
+	
+	if( !header->sections[ FILE_SECTION_NODES ].offset || header->sections[ FILE_SECTION_NODES ].size != (size_t) header->num_nodes * node_size || header->num_spawn >= header->num_nodes ) {
+		goto map_error;
+	}
+	
+	if( check && Crc32( (const char*) map + header->header_size, header->file_size - header->header_size ) != header->crc ) {
+		goto map_error;
+	}
+	
+	return header;
+	
+map_error:
+	if( fd >= 0 ) close( fd );
+	if( map != MAP_FAILED ) munmap( map, st.st_size );
+	return NULL;
+}
+
+
+void nav::UnmapFile( const FileHeader *header )
+{
+	if( header ) munmap( (void*) header, header->file_size );
+}
+
+
+bool nav::SaveFile( const char *file, const char *magic, const unsigned int num_nodes, const unsigned int num_spawn, const void *nodes, const unsigned int node_size, const void *info, const unsigned int info_size )
+{
+	static const char zeros[ SECTION_ALIGN ] = { 0 };
+	const void *data[ FILE_MAX_SECTIONS ] = { nodes, info };
+	unsigned int pad[ FILE_MAX_SECTIONS ];
+	FileHeader header;
+	FILE *f;
+	
+	memset( &header, 0, sizeof(header) );
+	strncpy( header.magic, magic, sizeof(header.magic) - 1 );
+	header.num_nodes   = num_nodes;
+	header.num_spawn   = num_spawn;
+	header.version     = FILE_VERSION;
+	header.endian      = FILE_ENDIAN;
+	header.header_size = sizeof(FileHeader);
+	header.node_size   = node_size;
+	header.sections[ FILE_SECTION_NODES ].size = num_nodes * node_size;
+	if( info ) header.sections[ FILE_SECTION_NODE_INFO ].size = num_nodes * info_size;
+	
+	// sections aligned to SECTION_ALIGN, zero padding before each one
+	header.file_size = sizeof(FileHeader);
+	for( int s = 0; s < FILE_MAX_SECTIONS; s++ ) {
+		pad[s] = 0;
+		if( !data[s] ) continue;
+		pad[s] = ( SECTION_ALIGN - header.file_size % SECTION_ALIGN ) % SECTION_ALIGN;
+		header.sections[s].offset = header.file_size + pad[s];
+		header.file_size = header.sections[s].offset + header.sections[s].size;
+		header.crc = Crc32( zeros, pad[s], header.crc );
+		header.crc = Crc32( data[s], header.sections[s].size, header.crc );
+	}
+	
+	f = fopen( file, "wb" );
+	if( !f ) return false;
+	
+	bool ok = ( fwrite( &header, sizeof(header), 1, f ) == 1 );
+	for( int s = 0; s < FILE_MAX_SECTIONS; s++ ) {
+		if( !data[s] ) continue;
+		ok = ok && ( fwrite( zeros, 1, pad[s], f ) == pad[s] );
+		ok = ok && ( fwrite( data[s], 1, header.sections[s].size, f ) == header.sections[s].size );
+	}
+	ok = ( fclose( f ) == 0 ) && ok;
+	
+	return ok;
+}
+
+
 
 void nav::Initialize( void )
 {
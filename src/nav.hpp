@@ -52,59 +52,150 @@ namespace nav // navigation
 			float         x, y, z;			///< Posición del nodo.
 		};
 
-		struct PlanNode;	// private implementation
+		/// Distancia máxima de búsqueda de señales hacia delante (metros). Ver NodeInfo::sign_dist.
+		static const float LOOKAHEAD_MAX = 1000.0f;
+
+		/// Datos de cada nodo precalculados a partir del grafo, para que la planificación sólo tenga que sumar y leer tablas.
+		/// Se calculan al cargar el grafo o se leen del fichero si éste los incluye (ver veh::Save()).
+		struct NodeInfo {
+			float         length[2];	///< Longitud de los tramos hacia los nodos siguientes Node::next (metros), 0 si no existen.
+			float         sign_dist;	///< Distancia mínima hasta el próximo nodo con señal de ceda el paso, stop, semáforo o velocidad, 0 si es este nodo. Como mucho veh::LOOKAHEAD_MAX.
+			unsigned char speed_limit;	///< Límite de velocidad efectivo (km/h) según la señal de velocidad más cercana hacia atrás, 0 si no se conoce.
+			unsigned char _padding[3];
+		};
+
+		struct Reservations;	// private implementation
+		struct Traversal;		// private implementation
+		struct Routes;			// private implementation
 
 		/// Grafo dirigido de navegación de los vehículos.
+		/// Es de sólo lectura una vez cargado y puede compartirse entre varias simulaciones, cada una con su veh::Reservations.
 		struct Graph {
 			unsigned int num_nodes;		///< Número total de nodos en el grafo. \warning El primer nodo de índice 0 no es válido.
 			unsigned int num_spawns;	///< Número de nodos de nacimiento.     \warning El primer nodo de índice 0 no es válido.
-			Node 		 *nodes;		///< Array de nodos del grafo.
-			PlanNode	 (*pnodes)[2];	///< Array de nodos de planificación.
+			const Node	 *nodes;		///< Array de nodos del grafo.
+			const NodeInfo *node_info;	///< Datos precalculados de cada nodo.
+			const void	 *file;			///< Fichero proyectado en memoria que contiene los nodos, o NULL si se han leído en memoria propia.
 		};
 
 		/// Carga el fichero con los datos del grafo de navegación de vehículos.
-		/// \param  [in] file  Nombre del fichero con los datos del grafo.
-		/// \return            Puntero al grafo cargado. NULL si hay error.
-		const Graph * Load( const char *file );
+		/// Los ficheros de la versión 2 se proyectan en memoria de sólo lectura sin copiar los nodos, compartiéndolos entre procesos.
+		/// Los de la versión 1 se leen completos en memoria y, opcionalmente, se renumeran sus nodos siguiendo las cadenas de Node::next
+		/// para que los recorridos accedan a memoria consecutiva. El nodo 0 y los de nacimiento conservan su índice. \n
+		/// La renumeración es un paso explícito: veh::Save() guarda los nodos en el orden renumerado, de modo que basta hacerla al convertir el fichero a la versión 2.
+		/// \param  [in] file     Nombre del fichero con los datos del grafo.
+		/// \param  [in] check    Verifica el CRC de los ficheros de la versión 2. Desactivarlo evita recorrer el fichero completo al cargar.
+		/// \param  [in] reorder  Renumera los nodos de los ficheros de la versión 1. Los índices de los nodos dejan de coincidir con los del fichero.
+		/// \return               Puntero al grafo cargado. NULL si hay error.
+		const Graph * Load( const char *file, const bool check=true, const bool reorder=false );
+		
+		/// Guarda el grafo de navegación de vehículos en un fichero con el formato de la versión 2.
+		/// Permite convertir los ficheros de la versión 1 para cargarlos proyectados en memoria. Incluye los datos precalculados veh::NodeInfo. \n
+		/// Los nodos se guardan en el orden del grafo cargado, renumerado o no (ver veh::Load()).
+		/// \param  [in] graph  Grafo de navegación de vehículos.
+		/// \param  [in] file   Nombre del fichero.
+		/// \return             Verdadero o falso si se ha guardado correctamente o no.
+		bool Save( const Graph *graph, const char *file );
 		
 		/// Libera la memoria reservada por el grafo de navegación de vehículos.
 		/// \param [in,out] graph  Puntero al grafo a liberar.
 		void Free( const Graph *&graph );
 		
+		/// Crea la tabla de reservas de los nodos de un grafo para una simulación.
+		/// Los planes de una simulación reservan los nodos por los que van a pasar en su tabla, sin modificar el grafo,
+		/// de modo que varias simulaciones (p.ej. en un barrido de parámetros) pueden compartir un único grafo cargado.
+		/// \param  [in] graph  Grafo de navegación de vehículos. Debe existir mientras exista la tabla.
+		/// \return             Tabla de reservas vacía. NULL si hay error.
+		Reservations * CreateReservations( const Graph *graph );
+		
+		/// Libera la tabla de reservas.
+		/// \param [in,out] reservations  Tabla de reservas a liberar.
+		void FreeReservations( Reservations *&reservations );
+		
+		/// Avanza un frame la tabla de reservas, caducando las reservas no renovadas por los planes.
+		/// Esta función debe ser llamada una vez por frame de la simulación propietaria de la tabla.
+		/// \param [in,out] reservations  Tabla de reservas.
+		void UpdateReservations( Reservations *reservations );
+		
+		/// Crea un contexto para recorrer el grafo marcando los nodos visitados.
+		/// Las marcas llevan un contador de generación que se incrementa en cada recorrido, de modo que no hay que borrarlas entre recorridos. \n
+		/// Cada hilo que recorra el grafo a la vez que otros necesita su propio contexto (ver veh::Plan::Nearby()).
+		/// \param  [in] graph  Grafo de navegación de vehículos. Debe existir mientras exista el contexto.
+		/// \return             Contexto de recorrido. NULL si hay error.
+		Traversal * CreateTraversal( const Graph *graph );
+		
+		/// Libera el contexto de recorrido.
+		/// \param [in,out] traversal  Contexto a liberar.
+		void FreeTraversal( Traversal *&traversal );
+		
 		/// Devuelve las coordenadas del nodo de nacimiento indicado.
 		/// \param [in] graph        Grafo de navegación de vehículos.
 		/// \param [in] index_spawn  Índice del nodo de nacimiento.
 		/// \return                  Puntero al nodo de nacimiento.
 		const nav::veh::Node * GetRespawnNode( const nav::veh::Graph *graph, const int index_spawn );
+		
+		/// Busca el nodo más cercano a una posición, p.ej. para elegir los destinos de veh::CreateRoutes().
+		/// Los índices de los nodos cambian si el grafo se ha renumerado (ver veh::Load()), por lo que es preferible buscar los destinos por posición.
+		/// \param [in] graph  Grafo de navegación de vehículos.
+		/// \param [in] x      Coordenada X.
+		/// \param [in] y      Coordenada Y.
+		/// \return            Índice del nodo más cercano.
+		unsigned int FindNode( const Graph *graph, const float x, const float y );
+		
+		/// Busca con A* la ruta más corta desde la posición de un plan hasta un nodo destino, respetando el enrutamiento de cada acceso (Node::from).
+		/// Devuelve las direcciones de giro de las primeras 32 bifurcaciones codificadas como los bits de giro de veh::Plan (ver veh::Plan::SetTurnBits()),
+		/// por lo que es útil para destinos puntuales; para destinos frecuentes es mejor precalcular sus tablas con veh::CreateRoutes().
+		/// \param  [in]  graph        Grafo de navegación de vehículos.
+		/// \param  [in]  prev         Nodo anterior del plan (Plan::prev).
+		/// \param  [in]  curr         Nodo actual del plan (Plan::curr).
+		/// \param  [in]  destination  Nodo destino.
+		/// \param  [out] bits         Bits de giro de la ruta. Las bifurcaciones posteriores a la 32 o al destino se dejan a 0.
+		/// \param  [out] length       Longitud de la ruta desde el nodo actual (metros). Puede ser NULL.
+		/// \return                    Número de bifurcaciones de la ruta, aunque sean más de 32, o -1 si el destino no es alcanzable.
+		int FindRoute( const Graph *graph, const unsigned int prev, const unsigned int curr, const unsigned int destination, unsigned int *bits, float *length );
+		
+		/// Precalcula las tablas de rutas hacia un conjunto de destinos.
+		/// Para cada destino se guarda, en cada nodo y por cada acceso, la salida que lleva por el camino más corto, de modo que seguir una ruta
+		/// sólo cuesta leer la tabla en cada bifurcación (ver veh::Plan::SetRoute()). Cada destino ocupa un byte por nodo del grafo.
+		/// \param  [in] graph             Grafo de navegación de vehículos. Debe existir mientras existan las tablas.
+		/// \param  [in] destinations      Nodos destino (ver veh::FindNode()).
+		/// \param  [in] num_destinations  Número de destinos.
+		/// \return                        Tablas de rutas. NULL si hay error.
+		Routes * CreateRoutes( const Graph *graph, const unsigned int *destinations, const int num_destinations );
+		
+		/// Libera las tablas de rutas.
+		/// \param [in,out] routes  Tablas de rutas a liberar.
+		void FreeRoutes( Routes *&routes );
 
 		/// Planificación de los vehículos.
 		/// Todos los vehículos deben heredar de esta clase para ser guiados sobre el grafo de navegación. \n
 		/// También permite a los vehículos obtener información sobre preferencias, señales y posibles colisiones con otros vehículos. \n
-		/// En esta implementación, el comportamiento ante bifurcaciones es aleatorio.
+		/// En esta implementación, el comportamiento ante bifurcaciones es aleatorio, salvo que el plan siga una ruta hacia un destino (ver veh::Plan::SetRoute()).
 		class Plan
 		{
 			public:
 
 				/// Constructor del planificador de vehículos.
-				Plan() : graph(0), bits(0), prev(0), curr(0), speed_limit_kmh(0) { }
+				Plan() : graph(0), reservations(0), bits(0), prev(0), curr(0), speed_limit_kmh(0), routes(0), route_index(0), route_node(0), route_way(0) { }
 				
 				/// Destructor del planificador de vehículos.
 				virtual ~Plan() { }
 			
 				/// Inicializa el planificador sobre un nodo de nacimiento.
-				/// \param [in] graph        Grafo de navegación sobre el que planificar.
-				/// \param [in] speed        Velocidad de inicio del vehículo. (metros/segundo)
-				/// \param [in] index_spawn  Índice del nodo de nacimiento.
-				/// \return                  Puntero al nodo de nacimiento.
-				const nav::veh::Node * Respawn( const nav::veh::Graph *graph, const float speed, const int index_spawn );
+				/// Abandona la ruta que estuviera siguiendo el plan (ver veh::Plan::SetRoute()).
+				/// \param [in] reservations  Tabla de reservas de la simulación, sobre cuyo grafo se planifica.
+				/// \param [in] speed         Velocidad de inicio del vehículo. (metros/segundo)
+				/// \param [in] index_spawn   Índice del nodo de nacimiento.
+				/// \return                   Puntero al nodo de nacimiento.
+				const nav::veh::Node * Respawn( nav::veh::Reservations *reservations, const float speed, const int index_spawn );
 				
 				/// Inicializa el planificador sobre un nodo de nacimiento.
-				/// Reutiliza el graph asignado anteriormente.
+				/// Reutiliza la tabla de reservas asignada anteriormente.
 				/// \param [in] speed        Velocidad de inicio del vehículo. (metros/segundo)
 				/// \param [in] index_spawn  Índice del nodo de nacimiento. Si el índice es -1 se utiliza el número aleatorio \a bits (ver veh::Plan::SetTurnBitsRandom()).
 				/// \return                  Puntero al nodo de nacimiento.
 				inline const nav::veh::Node * Respawn( const float speed, const int index_spawn=-1 ) {
-					return this->Respawn( this->graph, speed, index_spawn );
+					return this->Respawn( this->reservations, speed, index_spawn );
 				}
 
 			public:
@@ -119,6 +210,8 @@ namespace nav // navigation
 					float		  speed_limit;	///< Límite máximo de velocidad para este tramo de la ruta. (metros/segundo)
 					unsigned char myway;		///< Indica si se trata del propio camino del vehículo: no=0, si=1.
 					unsigned char semaphore;	///< Índice del semáforo o 0 si el nodo no es un semáforo.
+					float		  sign_dist;	///< Distancia a la que se encuentra la próxima señal o semáforo, como mucho veh::LOOKAHEAD_MAX. (metros)
+					int			  visited;		///< Número de nodos visitados para reservar los nodos ocupados por el vehículo, acotado por la implementación.
 				};
 				
 				/// Realiza la planificación de un vehículo.
@@ -139,10 +232,18 @@ namespace nav // navigation
 				typedef void (*NearbyCallback) ( veh::Plan *plan, veh::Plan *other );
 				
 				/// Permite recoger los planes cercanos a la ruta del plan mediante una función callback.
+				/// Utiliza el contexto de recorrido de la tabla de reservas, por lo que no puede llamarse desde varios hilos a la vez.
 				/// \param [in] dist      Distancia desde la ruta del plan.
 				/// \param [in] callback  Puntero a función para recoger los planes cercanos.
 				void Nearby( const float dist, NearbyCallback callback );
 				
+				/// Permite recoger los planes cercanos a la ruta del plan mediante una función callback, desde cualquier hilo.
+				/// Sólo lee la tabla de reservas, por lo que varios hilos pueden buscar a la vez, cada uno con su contexto, mientras no se esté planificando.
+				/// \param [in]     dist       Distancia desde la ruta del plan.
+				/// \param [in]     callback   Puntero a función para recoger los planes cercanos.
+				/// \param [in,out] traversal  Contexto de recorrido del hilo que realiza la búsqueda. Ver veh::CreateTraversal().
+				void Nearby( const float dist, NearbyCallback callback, Traversal *traversal );
+				
 			public:
 			
 				/// Dirección de giro ante un bifurcación.
@@ -162,32 +263,97 @@ namespace nav // navigation
 					return (TurnDirection) ( ( this->bits >> index ) & 1 );
 				}
 				
-				/// Inicializa aleatoriamente los bits de giro.
+				/// Inicializa aleatoriamente los bits de giro y abandona la ruta de veh::Plan::SetRoute().
 				/// \param [in] seed  Semilla para inicializar los bits de giro.
 				inline void SetTurnBitsRandom( const unsigned int seed ) {
 					this->bits = seed * 3941169319u ^ 2902958803u;						// next random number
+					this->routes = NULL;
 				}			
 				
+				/// Asigna los bits de giro, p.ej. los de una ruta obtenida con veh::FindRoute(), y abandona la ruta de veh::Plan::SetRoute().
+				/// \param [in] bits  Los 32 siguientes giros codificados en 32 bits.
+				inline void SetTurnBits( const unsigned int bits ) {
+					this->bits = bits;
+					this->routes = NULL;
+				}
+				
 				/// Obtiene la próxima dirección de giro y avanza al siguiente.
 				/// \return  Dirección del próximo giro.
 				inline TurnDirection Turn( void ) {
 					TurnDirection turn = (TurnDirection) ( this->bits & 1 );			// first turn bit --> left/right
 					const unsigned int r = this->bits * 3941169319u ^ 2902958803u;		// next random number
-					this->bits = ( this->bits >> 1 ) | ( r & 0x80000000u );				// insert a new bit
+					const unsigned int bit = ( this->routes ? this->RouteTurn( r >> 31 ) : r >> 31 );
+					this->bits = ( this->bits >> 1 ) | ( bit << 31 );					// insert a new bit
 					return turn;
 				}
+				
+				/// Sigue la ruta hacia uno de los destinos de unas tablas de rutas.
+				/// Codifica en los bits de giro las 32 siguientes bifurcaciones de la ruta, y a medida que el vehículo las pasa (veh::Plan::Turn()) añade la siguiente
+				/// leyendo la tabla, sin buscar caminos durante la simulación. Al llegar al destino se vuelve a girar aleatoriamente. \n
+				/// Debe llamarse después de veh::Plan::Respawn(), veh::Plan::SetTurnBitsRandom() y veh::Plan::SetTurnBits(), que abandonan la ruta.
+				/// \param [in] routes  Tablas de rutas sobre el grafo del plan, o NULL para abandonar la ruta actual.
+				/// \param [in] index   Índice del destino en las tablas.
+				/// \return             Falso si el destino no es alcanzable desde la posición del plan, en cuyo caso el plan no cambia.
+				bool SetRoute( const nav::veh::Routes *routes, const int index );
+				
+				/// Calcula la dirección de giro de la siguiente bifurcación de la ruta no codificada aún en los bits de giro. Ver veh::Plan::Turn().
+				/// \param [in] random  Bit aleatorio a devolver si la ruta ha terminado.
+				/// \return             Dirección de giro: 0 o 1.
+				unsigned int RouteTurn( const unsigned int random );
 
 
 			public:
 			//protected:
 			
 				const nav::veh::Graph   *graph;
+				nav::veh::Reservations	*reservations;
 				unsigned int			bits;
 				unsigned int			prev;
 				unsigned int			curr;
 				unsigned char			speed_limit_kmh;
+				const nav::veh::Routes	*routes;		///< Tablas de la ruta que sigue el plan, o NULL. Ver veh::Plan::SetRoute().
+				int						route_index;	///< Índice del destino en las tablas.
+				unsigned int			route_node;		///< Siguiente nodo tras la última bifurcación codificada en los bits de giro, o 0 si la ruta ha terminado.
+				unsigned char			route_way;		///< Acceso por el que se llega a ese nodo.
 		};
 
+		struct Planner;		// private implementation
+
+		/// Parámetros de planificación de un vehículo, los mismos que recibe veh::Plan::Planify().
+		struct Request {
+			float x, y;		///< Posición actual del vehículo.
+			float length;	///< Longitud del vehículo.
+			float speed;	///< Velocidad actual del vehículo.
+			float time;		///< Tiempo de planificación.
+		};
+
+		/// Crea un planificador en paralelo de grupos de vehículos (ver veh::PlanifyAll()).
+		/// Los hilos de trabajo se crean aquí y esperan a cada llamada a veh::PlanifyAll(), de modo que planificar un frame no crea hilos.
+		/// \param  [in] reservations  Tabla de reservas de la simulación. Debe existir mientras exista el planificador.
+		/// \param  [in] num_threads   Número de hilos, incluido el que llama a veh::PlanifyAll(). Con 1 no se crea ningún hilo.
+		/// \return                    Planificador. NULL si hay error.
+		Planner * CreatePlanner( Reservations *reservations, const int num_threads );
+
+		/// Termina los hilos y libera el planificador.
+		/// \param [in,out] planner  Planificador a liberar.
+		void FreePlanner( Planner *&planner );
+
+		/// Planifica un grupo de vehículos en paralelo, equivalente a llamar a veh::Plan::Planify() en cada uno pero con un resultado que no depende
+		/// del orden de los vehículos dentro del grupo ni del número de hilos. \n
+		/// Primero cada vehículo recorre su ruta y propone sus reservas en un buffer propio de su hilo, sin leer las de los demás.
+		/// Después se resuelven las propuestas de cada nodo con las mismas reglas de preferencia (distancia en el propio camino, tiempo en los cruces),
+		/// deshaciendo los empates por el índice del vehículo en el grupo, y cada vehículo obtiene su colisión. Las reservas de los vehículos más allá de su colisión
+		/// se descartan y se vuelve a resolver, para que un vehículo detenido no conserve preferencia sobre los nodos a los que no llegará. Por último se escriben en la tabla.
+		/// \note Cada vehículo recorre su ruta hasta el horizonte aunque colisione antes, por lo que el trabajo total es varias veces el de veh::Plan::Planify():
+		/// sólo compensa repartido entre varios núcleos.
+		/// \param [in,out] planner      Planificador. Todos los planes deben utilizar su tabla de reservas.
+		/// \param [in,out] plans        Planes de los vehículos.
+		/// \param [in]     requests     Parámetros de planificación de cada vehículo.
+		/// \param [out]    infos        Información sobre posibles colisiones de cada vehículo.
+		/// \param [out]    targets      Nodo al que tiene que dirigirse cada vehículo, NULL al final de la ruta.
+		/// \param [in]     num          Número de vehículos.
+		void PlanifyAll( Planner *planner, Plan *const *plans, const Request *requests, Plan::Info *infos, const Node **targets, const int num );
+
 	} // namespace veh
 	
 
@@ -220,13 +386,22 @@ namespace nav // navigation
 		struct Graph {
 			unsigned int num_nodes;			///< Número total de nodos.      \warning El primer nodo de índice 0 no es válido.
 			unsigned int num_spawns;		///< Número nodos de nacimiento. \warning El primer nodo de índice 0 no es válido.
-			Node 		 *nodes;			///< Array de nodos del grafo de navegación.
+			const Node	 *nodes;			///< Array de nodos del grafo de navegación.
+			const void	 *file;				///< Fichero proyectado en memoria que contiene los nodos, o NULL si se han leído en memoria propia.
 		};
 
 		/// Carga el fichero con los datos del grafo de navegación de peatones.
-		/// \param  [in] file  Nombre del fichero con los datos del grafo.
-		/// \return            Puntero al grafo cargado. NULL si hay error.
-		const Graph * Load( const char *file );
+		/// Igual que veh::Load(), los ficheros de la versión 2 se proyectan en memoria y los de la versión 1 se leen completos.
+		/// \param  [in] file   Nombre del fichero con los datos del grafo.
+		/// \param  [in] check  Verifica el CRC de los ficheros de la versión 2.
+		/// \return             Puntero al grafo cargado. NULL si hay error.
+		const Graph * Load( const char *file, const bool check=true );
+		
+		/// Guarda el grafo de navegación de peatones en un fichero con el formato de la versión 2.
+		/// \param  [in] graph  Grafo de navegación de peatones.
+		/// \param  [in] file   Nombre del fichero.
+		/// \return             Verdadero o falso si se ha guardado correctamente o no.
+		bool Save( const Graph *graph, const char *file );
 		
 		/// Libera la memoria reservada por el grafo de navegación de peatones.
 		/// \param [in,out] graph  Puntero al grafo a liberar.
@@ -21,12 +21,80 @@
 
 
 
+#include <stddef.h>
+
 #include "nav.hpp"
 
 
 namespace nav // navigation
 {
 
+	/// Versión actual del formato de los ficheros de grafos de navegación.
+	/// La versión 1 (cabecera de 32 bytes seguida de los nodos) se sigue leyendo con fread. Su campo FileHeader::version es siempre 0.
+	static const unsigned int FILE_VERSION = 2;
+	
+	/// Marca de orden de bytes, escrita en el orden nativo de la máquina que genera el fichero.
+	static const unsigned int FILE_ENDIAN  = 0x01020304u;
+
+	/// Secciones de un fichero de grafo de navegación.
+	/// Los datos precalculados son opcionales (ver nav::veh::NodeInfo).
+	enum { FILE_SECTION_NODES=0, FILE_SECTION_NODE_INFO, FILE_MAX_SECTIONS=4 };
+
+	/// Cabecera de los ficheros de grafos de navegación a partir de la versión 2.
+	/// Los primeros 32 bytes coinciden con la cabecera de la versión 1, de modo que basta leer éstos para distinguir ambas versiones. \n
+	/// Las secciones se alinean a 64 bytes y el fichero completo se proyecta en memoria de sólo lectura (ver nav::MapFile()).
+	struct FileHeader {
+		char			magic[16];		///< Identificador del archivo: "NAV_VEH_GRAPH" o "NAV_PED_GRAPH".
+		unsigned int	num_nodes;		///< Número de nodos en el grafo. \warning El primer nodo de índice 0 no es válido.
+		unsigned int	num_spawn;		///< Número nodos de nacimiento.  \warning El primer nodo de índice 0 no es válido.
+		unsigned int	version;		///< Versión del formato: 0 en la versión 1, nav::FILE_VERSION en adelante.
+		unsigned int	endian;			///< nav::FILE_ENDIAN. Los ficheros con otro orden de bytes se rechazan.
+		unsigned int	header_size;	///< Tamaño de esta cabecera en bytes.
+		unsigned int	node_size;		///< Tamaño de cada nodo en bytes.
+		unsigned int	file_size;		///< Tamaño total del fichero en bytes.
+		unsigned int	crc;			///< CRC-32 (el mismo que zlib) de todos los bytes que siguen a la cabecera.
+		struct {
+			unsigned int offset;		///< Posición de la sección desde el inicio del fichero o 0 si no existe.
+			unsigned int size;			///< Tamaño de la sección en bytes.
+		} sections[ FILE_MAX_SECTIONS ];	///< Secciones del fichero, ver nav::FILE_SECTION_NODES.
+	};
+
+	/// Calcula el CRC-32 de un bloque de memoria.
+	/// \param [in] data  Bloque de memoria.
+	/// \param [in] size  Tamaño del bloque en bytes.
+	/// \param [in] crc   CRC del bloque anterior para encadenar bloques, 0 para el primero.
+	/// \return           CRC-32 acumulado.
+	unsigned int Crc32( const void *data, const size_t size, unsigned int crc=0 );
+
+	/// Proyecta en memoria de sólo lectura un fichero de grafo en formato versión 2, sin copias.
+	/// Comprueba identificador, versión, orden de bytes, tamaños y límites de las secciones, y opcionalmente el CRC.
+	/// \param [in] file       Nombre del fichero.
+	/// \param [in] magic      Identificador esperado.
+	/// \param [in] node_size  Tamaño esperado de cada nodo.
+	/// \param [in] check      Verifica el CRC, recorriendo el fichero completo.
+	/// \return                Cabecera al inicio de la proyección o NULL si hay error. Liberar con nav::UnmapFile().
+	const FileHeader * MapFile( const char *file, const char *magic, const unsigned int node_size, const bool check );
+
+	/// Libera la proyección obtenida con nav::MapFile().
+	void UnmapFile( const FileHeader *header );
+	
+	/// Devuelve el puntero al inicio de una sección de un fichero proyectado.
+	inline const void * FileSection( const FileHeader *header, const int section ) {
+		return (const char*) header + header->sections[ section ].offset;
+	}
+
+	/// Escribe un fichero de grafo en formato versión 2 con la sección de nodos y, opcionalmente, la de datos precalculados.
+	/// \param [in] file        Nombre del fichero.
+	/// \param [in] magic       Identificador del fichero.
+	/// \param [in] num_nodes   Número de nodos.
+	/// \param [in] num_spawn   Número de nodos de nacimiento.
+	/// \param [in] nodes       Array de nodos.
+	/// \param [in] node_size   Tamaño de cada nodo.
+	/// \param [in] info        Array de datos precalculados por nodo o NULL.
+	/// \param [in] info_size   Tamaño de los datos precalculados de cada nodo.
+	/// \return                 Verdadero o falso si se ha escrito correctamente o no.
+	bool SaveFile( const char *file, const char *magic, const unsigned int num_nodes, const unsigned int num_spawn, const void *nodes, const unsigned int node_size, const void *info=0, const unsigned int info_size=0 );
+
 	
 	namespace veh // vehicle
 	{		
@@ -34,16 +34,39 @@ namespace nav
 			char			magic[16];		///< Identificador del archivo: "NAV_PED_GRAPH" 
 			unsigned int	num_nodes;		///< Número de nodos en el grafo. \warning El primer nodo de índice 0 no es válido.
 			unsigned int	num_spawn;		///< Número nodos de nacimiento.  \warning El primer nodo de índice 0 no es válido.
-			unsigned int	_padding[2];	///< Padding para alcanzar los 32 bytes.
+			unsigned int	version;		///< Siempre 0 en la versión 1. Ver nav::FileHeader.
+			unsigned int	_padding;		///< Padding para alcanzar los 32 bytes.
 		};
 	}
 }
 
 
-const nav::ped::Graph * nav::ped::Load( const char *file )
+/// Carga un fichero de la versión 2 proyectando los nodos en memoria de sólo lectura.
+static const nav::ped::Graph * LoadMapped( const char *file, const bool check )
+{
+	const nav::FileHeader *header = nav::MapFile( file, "NAV_PED_GRAPH", sizeof(nav::ped::Node), check );
+	if( !header ) return NULL;
+	
+	nav::ped::Graph *graph = (nav::ped::Graph*) ::malloc( sizeof(nav::ped::Graph) );
+	if( !graph ) {
+		nav::UnmapFile( header );
+		return NULL;
+	}
+	
+	graph->num_nodes  = header->num_nodes;
+	graph->num_spawns = header->num_spawn;
+	graph->nodes      = (const nav::ped::Node*) nav::FileSection( header, nav::FILE_SECTION_NODES );
+	graph->file       = header;
+	
+	return graph;
+}
+
+
+const nav::ped::Graph * nav::ped::Load( const char *file, const bool check )
 {
 	FILE     *f      = NULL;
 	Graph    *graph  = NULL;
+	Node     *nodes  = NULL;	// graph->nodes, writable while loading
 	Header   header;
 	size_t   r;
 
@@ -64,6 +87,11 @@ const nav::ped::Graph * nav::ped::Load( const char *file )
 		goto load_error;
 	}
 	
+	if( header.version ) {	// version 2: map nodes read-only
+		fclose( f );
+		return LoadMapped( file, check );
+	}
+	
 	graph = (Graph*) ::malloc( sizeof(Graph) + header.num_nodes * sizeof(Node) );	
 	if( !graph ) {
 		goto load_error;
@@ -71,9 +99,11 @@ const nav::ped::Graph * nav::ped::Load( const char *file )
 
 	graph->num_nodes  = header.num_nodes;
 	graph->num_spawns = header.num_spawn;
-	graph->nodes      = (Node*) ( graph + 1 );	
+	nodes             = (Node*) ( graph + 1 );
+	graph->nodes      = nodes;
+	graph->file       = NULL;
 
-	r = fread( graph->nodes, sizeof(Node), header.num_nodes, f );
+	r = fread( nodes, sizeof(Node), header.num_nodes, f );
 	if( r != header.num_nodes ) {
 		goto load_error;
 	}
@@ -92,8 +122,15 @@ load_error:
 }
 
 
+bool nav::ped::Save( const nav::ped::Graph *graph, const char *file )
+{
+	return nav::SaveFile( file, "NAV_PED_GRAPH", graph->num_nodes, graph->num_spawns, graph->nodes, sizeof(Node) );
+}
+
+
 void nav::ped::Free( const nav::ped::Graph *&graph )
 {
+	if( graph ) nav::UnmapFile( (const nav::FileHeader*) graph->file );
 	::free( (void*)graph );
 	graph = NULL;
 }
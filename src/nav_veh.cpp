@@ -20,6 +20,12 @@
 #include <math.h>
 #include <string.h>
 #include <assert.h>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "nav.hxx"
 
@@ -34,7 +40,8 @@ namespace nav
 			char			magic[16];		///< Identificador del archivo: "NAV_VEH_GRAPH" 
 			unsigned int	num_nodes;		///< Número de nodos en el grafo. \warning El primer nodo de índice 0 no es válido.
 			unsigned int	num_spawn;		///< Número nodos de nacimiento.  \warning El primer nodo de índice 0 no es válido.
-			unsigned int	_padding[2];	///< Padding para alcanzar los 32 bytes.
+			unsigned int	version;		///< Siempre 0 en la versión 1. Ver nav::FileHeader.
+			unsigned int	_padding;		///< Padding para alcanzar los 32 bytes.
 		};
 
 		/// Información sobre el estado de cada nodo del grafo.
@@ -42,35 +49,253 @@ namespace nav
 		/// de modo que se puede determinar la intersección con la ruta de algún otro vehículo.
 		struct PlanNode {
 			Plan			*plan;		///< Plan con ruta pasando sobre este nodo.
-			unsigned int	tick;		///< Para conocer si el nodo es válido. Ver nav::veh::tick.
-			unsigned int	visited;	///< Evitar bucles o finalizar recursiones. Ver nav::veh::visited.
+			unsigned int	tick;		///< Para conocer si el nodo es válido. Ver Reservations::tick.
 			float			dist;		///< Distancia que tiene que recorrer el vehículo para llegar al nodo.
 			float			time;		///< Tiempo que tarda el vehículo en llegar a este nodo.
 		};
 
-		/// Contador utilizado para determinar si la información de los PlanNode está obsoleta.
-		/// Los planificadores modifican la información de los nodos de plan y actualizan el contador (PlanNode::tick = veh::tick+N). \n
-		/// Este contador es incrementado una vez por frame, por tanto, sumar N al contador es equivalente a decir que el nodo está reservado por un plan durante los próximos N frames. \n
-		/// Cualquier nodo con un tick menor a veh::tick está obsoleto y su información no es válida.
-		static unsigned int tick;
+		/// Tabla de reservas de los nodos del grafo para una simulación.
+		/// Contiene todo el estado que modifican los planes, de modo que el grafo es de sólo lectura y puede compartirse entre varias simulaciones.
+		struct Reservations {
+			const Graph		*graph;			///< Grafo compartido sobre el que se reservan los nodos.
+			PlanNode		(*pnodes)[2];	///< Nodos de planificación, dos por nodo del grafo (uno por acceso).
+			
+			/// Contador utilizado para determinar si la información de los PlanNode está obsoleta.
+			/// Los planificadores modifican la información de los nodos de plan y actualizan el contador (PlanNode::tick = tick+N). \n
+			/// Este contador es incrementado una vez por frame (ver veh::UpdateReservations()), por tanto, sumar N al contador es equivalente a decir que el nodo está reservado por un plan durante los próximos N frames. \n
+			/// Cualquier nodo con un tick menor a este contador está obsoleto y su información no es válida.
+			unsigned int	tick;
+			
+			/// Contexto de recorrido de veh::Plan::Planify() y de veh::Plan::Nearby() cuando no reciben uno propio.
+			Traversal		*traversal;
+		};
+		
+		/// Contexto de recorrido del grafo. Ver veh::CreateTraversal().
+		struct Traversal {
+			unsigned int	num_nodes;	///< Número de nodos del grafo.
+			
+			/// Generación del recorrido actual, incrementada al iniciar cada recorrido (ver BeginTraversal()).
+			/// Un nodo está visitado si su marca es igual a este valor, de lo contrario le asignamos este valor y lo procesamos.
+			unsigned int	generation;
+			
+			unsigned int	*stamps;	///< Marca de cada nodo: generación del último recorrido que lo ha visitado.
+		};
 		
-		/// Para indicar que un nodo ha sido visitado anteriormente.
-		/// Utilizado para recorrer el grafo y no entrar en bucles. \n
-		/// Antes de iniciar el recorrido por el grafo incrementamos este valor. Si PlanNode::visited es igual a veh::visited, el nodo ya lo hemos visitado, de lo contrario le asignameos este valor y lo procesamos.
-		static unsigned int visited;
+		/// Tablas de rutas hacia un conjunto de destinos. Ver veh::CreateRoutes().
+		struct Routes {
+			const Graph		*graph;				///< Grafo sobre el que se han calculado las rutas.
+			int				num_destinations;	///< Número de destinos.
+			unsigned int	*destinations;		///< Nodos destino.
+			
+			/// Tabla de cada destino, Graph::num_nodes bytes por destino. En el byte de cada nodo, el bit \a way es la salida (Node::next)
+			/// hacia el destino al llegar por el acceso \a way, y el bit ::HOP_REACHABLE << \a way indica si el destino es alcanzable por ese acceso.
+			unsigned char	*hops;
+		};
 	}
 }
 
 
-const nav::veh::Graph * nav::veh::Load( const char *file )
+/// Indica si el nodo tiene alguna señal que afecte a la planificación: ceda el paso, stop, semáforo o velocidad.
+static inline bool IsRegulatory( const nav::veh::Node &node )
+{
+	return node.from[0].sign > nav::veh::sign::SPAWN || node.from[1].sign > nav::veh::sign::SPAWN;
+}
+
+
+/// Calcula los datos precalculados de cada nodo (ver nav::veh::NodeInfo).
+/// Las distancias a la próxima señal se obtienen con Dijkstra desde todos los nodos con señal recorriendo los tramos hacia atrás,
+/// y los límites de velocidad propagando hacia delante el de la señal de velocidad más cercana.
+/// \param [in]  graph  Grafo de navegación, sin NodeInfo.
+/// \param [out] info   Array de Graph::num_nodes datos a rellenar.
+static void ComputeNodeInfo( const nav::veh::Graph *graph, nav::veh::NodeInfo *info )
+{
+	typedef std::pair<float,unsigned int> Item;	// distance, node
+	std::vector<Item> heap;
+	std::vector<float> dist( graph->num_nodes );
+	
+	for( unsigned int i = 0; i < graph->num_nodes; i++ ) {
+		const nav::veh::Node &node = graph->nodes[i];
+		for( int k = 0; k < 2; k++ ) {
+			const nav::veh::Node &next = graph->nodes[ node.next[k] ];
+			const float rx = next.x - node.x;
+			const float ry = next.y - node.y;
+			info[i].length[k] = ( node.next[k] ? sqrtf( rx*rx + ry*ry ) : 0.0f );
+		}
+		info[i].sign_dist   = nav::veh::LOOKAHEAD_MAX;
+		info[i].speed_limit = 0;
+		info[i]._padding[0] = info[i]._padding[1] = info[i]._padding[2] = 0;
+		
+		if( i && IsRegulatory( node ) ) {
+			info[i].sign_dist = 0.0f;
+			heap.push_back( Item( 0.0f, i ) );
+		}
+	}
+	
+	// distance to the next sign: backwards from every sign node
+	std::make_heap( heap.begin(), heap.end(), std::greater<Item>() );
+	while( !heap.empty() ) {
+		std::pop_heap( heap.begin(), heap.end(), std::greater<Item>() );
+		const Item item = heap.back();
+		heap.pop_back();
+		if( item.first > info[ item.second ].sign_dist ) continue;	// outdated
+		
+		const nav::veh::Node &node = graph->nodes[ item.second ];
+		for( int k = 0; k < 2; k++ ) {
+			const unsigned int p = node.prev[k];
+			if( !p ) continue;
+			const float d = item.first + info[p].length[ graph->nodes[p].next[1] == item.second ];
+			if( d < info[p].sign_dist ) {
+				info[p].sign_dist = d;
+				heap.push_back( Item( d, p ) );
+				std::push_heap( heap.begin(), heap.end(), std::greater<Item>() );
+			}
+		}
+	}
+	
+	// effective speed limit: forwards from every speed sign, the nearest one wins
+	for( unsigned int i = 1; i < graph->num_nodes; i++ ) {
+		const nav::veh::Node &node = graph->nodes[i];
+		dist[i] = -1.0f;
+		if( node.from[0].sign == nav::veh::sign::SPEED ) {
+			dist[i] = 0.0f;
+			info[i].speed_limit = node.semaphore;
+			heap.push_back( Item( 0.0f, i ) );
+		}
+	}
+	std::make_heap( heap.begin(), heap.end(), std::greater<Item>() );
+	while( !heap.empty() ) {
+		std::pop_heap( heap.begin(), heap.end(), std::greater<Item>() );
+		const Item item = heap.back();
+		heap.pop_back();
+		if( item.first > dist[ item.second ] ) continue;	// outdated
+		
+		const nav::veh::Node &node = graph->nodes[ item.second ];
+		for( int k = 0; k < 2; k++ ) {
+			const unsigned int n = node.next[k];
+			if( !n || graph->nodes[n].from[0].sign == nav::veh::sign::SPEED ) continue;
+			const float d = item.first + info[ item.second ].length[k];
+			if( dist[n] < 0.0f || d < dist[n] ) {
+				dist[n] = d;
+				info[n].speed_limit = info[ item.second ].speed_limit;
+				heap.push_back( Item( d, n ) );
+				std::push_heap( heap.begin(), heap.end(), std::greater<Item>() );
+			}
+		}
+	}
+}
+
+
+/// Renumera los nodos para que los recorridos por Node::next accedan a posiciones de memoria consecutivas.
+/// Los nodos se ordenan por cadenas: partiendo de los nodos de nacimiento se sigue next[0] mientras sea posible, dejando la otra salida
+/// de las bifurcaciones para después (en profundidad). Los nodos no alcanzables desde ellos se recorren igual empezando por el inicio de su cadena. \n
+/// El nodo 0 y los nodos de nacimiento conservan su índice, como requiere veh::GetRespawnNode(), y se actualizan todos los Node::prev y Node::next.
+/// \param [in]     graph  Grafo de navegación en memoria propia, sin NodeInfo.
+/// \param [in,out] own    Array de nodos del grafo (Graph::nodes), que es de sólo lectura a través del grafo.
+/// \return                Falso si no hay memoria suficiente o algún nodo no se ha podido numerar (enlaces inconsistentes), en cuyo caso el grafo no se modifica.
+static bool ReorderNodes( const nav::veh::Graph *graph, nav::veh::Node *own )
+{
+	assert( graph->nodes == own );
+	const unsigned int num = graph->num_nodes;
+	unsigned int *index = (unsigned int*) ::malloc( ( 2*num + 2 ) * sizeof(unsigned int) );	// new index of each node, then pending branches
+	nav::veh::Node *nodes = (nav::veh::Node*) ::malloc( num * sizeof(nav::veh::Node) );
+	if( !index || !nodes ) {
+		::free( index );
+		::free( nodes );
+		return false;
+	}
+	
+	unsigned int *stack = index + num;
+	unsigned int count = 0, top = 0;
+	memset( index, 0, num * sizeof(unsigned int) );
+	
+	for( unsigned int i = 0; i <= graph->num_spawns && i < num; i++ )	// node 0 and spawn nodes keep their index
+		index[i] = count++;
+	
+	for( unsigned int seed = 1; seed < num; seed++ )
+	{
+		// the chains of spawn nodes first, then the rest starting from the beginning of their chain
+		unsigned int n = ( seed <= graph->num_spawns ? graph->nodes[seed].next[0] : seed );
+		if( seed > graph->num_spawns ) {
+			for( unsigned int steps = 0; steps < num && graph->nodes[n].prev[0] && !index[ graph->nodes[n].prev[0] ] && graph->nodes[n].prev[0] != seed; steps++ )
+				n = graph->nodes[n].prev[0];
+		}
+		if( seed <= graph->num_spawns ) stack[ top++ ] = graph->nodes[seed].next[1];
+		stack[ top++ ] = n;
+		
+		while( top ) {
+			n = stack[ --top ];
+			while( n && !index[n] ) {	// follow the chain, defer the other branch
+				index[n] = count++;
+				if( graph->nodes[n].next[1] && !index[ graph->nodes[n].next[1] ] ) stack[ top++ ] = graph->nodes[n].next[1];
+				n = graph->nodes[n].next[0];
+			}
+		}
+	}
+	if( count != num ) {
+		::free( index );
+		::free( nodes );
+		return false;
+	}
+	
+	for( unsigned int i = 0; i < num; i++ ) {
+		nav::veh::Node &node = nodes[ index[i] ];
+		node = graph->nodes[i];
+		for( int k = 0; k < 2; k++ ) {
+			node.prev[k] = index[ node.prev[k] ];
+			node.next[k] = index[ node.next[k] ];
+		}
+	}
+	memcpy( own, nodes, num * sizeof(nav::veh::Node) );
+	
+	::free( index );
+	::free( nodes );
+	return true;
+}
+
+
+/// Carga un fichero de la versión 2 proyectando los nodos en memoria de sólo lectura.
+/// Los datos precalculados también se proyectan si el fichero los incluye, de lo contrario se calculan.
+static const nav::veh::Graph * LoadMapped( const char *file, const bool check )
+{
+	const nav::FileHeader *header = nav::MapFile( file, "NAV_VEH_GRAPH", sizeof(nav::veh::Node), check );
+	if( !header ) return NULL;
+	
+	const bool stored = ( header->sections[ nav::FILE_SECTION_NODE_INFO ].offset && header->sections[ nav::FILE_SECTION_NODE_INFO ].size == header->num_nodes * sizeof(nav::veh::NodeInfo) );
+	const size_t r = ( stored ? 0 : header->num_nodes * sizeof(nav::veh::NodeInfo) );
+	nav::veh::Graph *graph = (nav::veh::Graph*) ::malloc( sizeof(nav::veh::Graph) + r );
+	if( !graph ) {
+		nav::UnmapFile( header );
+		return NULL;
+	}
+	
+	graph->num_nodes  = header->num_nodes;
+	graph->num_spawns = header->num_spawn;
+	graph->nodes      = (const nav::veh::Node*) nav::FileSection( header, nav::FILE_SECTION_NODES );
+	graph->file       = header;
+	
+	if( stored ) {
+		graph->node_info = (const nav::veh::NodeInfo*) nav::FileSection( header, nav::FILE_SECTION_NODE_INFO );
+	}
+	else {
+		graph->node_info = (nav::veh::NodeInfo*) ( graph + 1 );
+		ComputeNodeInfo( graph, (nav::veh::NodeInfo*) ( graph + 1 ) );
+	}
+	
+	return graph;
+}
+
+
+const nav::veh::Graph * nav::veh::Load( const char *file, const bool check, const bool reorder )
 {
 	FILE     *f      = NULL;
 	Graph    *graph  = NULL;
+	Node     *nodes  = NULL;	// graph->nodes, writable while loading
 	Header   header;
 	size_t   r;
 
 	assert( sizeof(Header) == 32 );
 	assert( sizeof(Node) == 32 );
+	assert( sizeof(NodeInfo) == 16 );
 
 	f = fopen( file, "rb" );
 	if( !f ) {
@@ -86,19 +311,24 @@ const nav::veh::Graph * nav::veh::Load( const char *file )
 		goto load_error;
 	}
 	
-	r = header.num_nodes * ( sizeof(Node) + 2*sizeof(PlanNode) );
-	graph = (Graph*) ::malloc( sizeof(Graph) + r );	
+	if( header.version ) {	// version 2: map nodes read-only
+		fclose( f );
+		return LoadMapped( file, check );
+	}
+	
+	graph = (Graph*) ::malloc( sizeof(Graph) + header.num_nodes * ( sizeof(Node) + sizeof(NodeInfo) ) );	
 	if( !graph ) {
 		goto load_error;
 	}
 
 	graph->num_nodes  = header.num_nodes;
 	graph->num_spawns = header.num_spawn;
-	graph->nodes      = (Node*) ( graph + 1 );
-	graph->pnodes     = (PlanNode(*)[2]) ( graph->nodes + header.num_nodes );
-	memset( graph+1, 0, r );
+	nodes             = (Node*) ( graph + 1 );
+	graph->nodes      = nodes;
+	graph->node_info  = (NodeInfo*) ( nodes + header.num_nodes );
+	graph->file       = NULL;
 
-	r = fread( graph->nodes, sizeof(Node), header.num_nodes, f );
+	r = fread( nodes, sizeof(Node), header.num_nodes, f );
 	if( r != header.num_nodes ) {
 		goto load_error;
 	}
@@ -108,6 +338,11 @@ const nav::veh::Graph * nav::veh::Load( const char *file )
 		
 	//####TODO: endianess
 	
+	if( reorder && !ReorderNodes( graph, nodes ) ) {
+		goto load_error;
+	}
+	ComputeNodeInfo( graph, (NodeInfo*) graph->node_info );
+	
 	return graph;
 	
 load_error:
@@ -117,8 +352,15 @@ load_error:
 }
 
 
+bool nav::veh::Save( const nav::veh::Graph *graph, const char *file )
+{
+	return nav::SaveFile( file, "NAV_VEH_GRAPH", graph->num_nodes, graph->num_spawns, graph->nodes, sizeof(Node), graph->node_info, sizeof(NodeInfo) );
+}
+
+
 void nav::veh::Free( const nav::veh::Graph *&graph )
 {
+	if( graph ) nav::UnmapFile( (const nav::FileHeader*) graph->file );
 	::free( (void*)graph );
 	graph = NULL;
 }
@@ -130,120 +372,560 @@ const nav::veh::Node * nav::veh::GetRespawnNode( const nav::veh::Graph *graph, c
 }
 
 
-const nav::veh::Node * nav::veh::Plan::Respawn( const nav::veh::Graph *graph, const float speed, const int index_spawn )
+const nav::veh::Node * nav::veh::Plan::Respawn( nav::veh::Reservations *reservations, const float speed, const int index_spawn )
 {
 	const int index = ( index_spawn < 0 ? this->bits : index_spawn );
+	const nav::veh::Graph *graph = reservations->graph;
 	
 	this->graph = graph;
+	this->reservations = reservations;
 	this->prev  = 1 + index % graph->num_spawns;		// skip first node
 	this->curr  = graph->nodes[ this->prev ].next[0];
-	this->speed_limit_kmh = ( speed > 70.0f ? 255 : speed*(60*60/1000.0f) );
+	this->speed_limit_kmh = graph->node_info[ this->prev ].speed_limit;	// effective limit at the spawn node, if any
+	if( !this->speed_limit_kmh ) this->speed_limit_kmh = ( speed > 70.0f ? 255 : speed*(60*60/1000.0f) );
+	this->routes = NULL;
 	
 	return &graph->nodes[ this->prev ];
 }
 
 
-/// Marca recursivamente los nodos ocupados por un plan. Ver MarkOwnNodes().
+/// Bit de nav::veh::Routes::hops que indica que el destino es alcanzable, desplazado por el acceso.
+static const unsigned char HOP_REACHABLE = 4;
+
+
+/// Indica si desde un acceso de un nodo se puede salir por Node::next[\a exit], según el enrutamiento del acceso.
+static inline bool CanExit( const nav::veh::Node &node, const unsigned int way, const unsigned int exit )
+{
+	if( !node.next[exit] ) return false;
+	
+	switch( node.from[way].route ) {
+		case nav::veh::route::LEFT:  return exit == 0;
+		case nav::veh::route::RIGHT: return exit == 1;
+		case nav::veh::route::ANY:   return true;
+		default:                     return false;
+	}
+}
+
+
+/// Acceso por el que se llega al nodo \a next desde el nodo \a node, igual que en nav::veh::Plan::Planify().
+static inline unsigned int ArrivalWay( const nav::veh::Graph *graph, const unsigned int node, const unsigned int next )
+{
+	return ( node == graph->nodes[ next ].prev[1] ? 1 : 0 );
+}
+
+
+unsigned int nav::veh::FindNode( const nav::veh::Graph *graph, const float x, const float y )
+{
+	unsigned int best = 0;
+	float best_rr = 0.0f;
+	
+	for( unsigned int i = 1; i < graph->num_nodes; i++ ) {	// skip first node
+		const float rx = graph->nodes[i].x - x;
+		const float ry = graph->nodes[i].y - y;
+		const float rr = rx*rx + ry*ry;
+		if( !best || rr < best_rr ) {
+			best    = i;
+			best_rr = rr;
+		}
+	}
+	
+	return best;
+}
+
+
+/// .\n
+/// Los estados de la búsqueda son los accesos a los nodos (2*nodo+acceso), ya que el enrutamiento depende del acceso por el que se llega.
+/// La heurística es la distancia en línea recta al destino, que nunca supera la longitud de los tramos, por lo que la ruta encontrada es la más corta.
+int nav::veh::FindRoute( const nav::veh::Graph *graph, const unsigned int prev, const unsigned int curr, const unsigned int destination, unsigned int *bits, float *length )
+{
+	typedef std::pair<float,unsigned int> Item;	// estimated distance to the destination, state
+	std::vector<Item> heap;
+	std::vector<float> dist( 2*graph->num_nodes, -1.0f );
+	std::vector<unsigned int> from( 2*graph->num_nodes );	// 2*previous state + exit
+	const nav::veh::Node &goal = graph->nodes[ destination ];
+	unsigned int found = 0;
+	
+	*bits = 0;
+	if( length ) *length = 0.0f;
+	if( !curr || !destination ) return -1;
+	
+	const unsigned int start = 2*curr + ArrivalWay( graph, prev, curr );
+	dist[ start ] = 0.0f;
+	heap.push_back( Item( hypotf( goal.x - graph->nodes[curr].x, goal.y - graph->nodes[curr].y ), start ) );
+	
+	while( !heap.empty() ) {
+		std::pop_heap( heap.begin(), heap.end(), std::greater<Item>() );
+		const Item item = heap.back();
+		heap.pop_back();
+		
+		const unsigned int n = item.second >> 1;
+		const unsigned int way = item.second & 1;
+		const nav::veh::Node &node = graph->nodes[n];
+		if( item.first > dist[ item.second ] + hypotf( goal.x - node.x, goal.y - node.y ) ) continue;	// outdated
+		if( n == destination ) {
+			found = item.second + 1;
+			break;
+		}
+		
+		for( unsigned int exit = 0; exit < 2; exit++ ) {
+			if( !CanExit( node, way, exit ) ) continue;
+			const unsigned int m = node.next[exit];
+			const unsigned int s = 2*m + ArrivalWay( graph, n, m );
+			const float d = dist[ item.second ] + graph->node_info[n].length[exit];
+			if( dist[s] < 0.0f || d < dist[s] ) {
+				dist[s] = d;
+				from[s] = 2*item.second + exit;
+				heap.push_back( Item( d + hypotf( goal.x - graph->nodes[m].x, goal.y - graph->nodes[m].y ), s ) );
+				std::push_heap( heap.begin(), heap.end(), std::greater<Item>() );
+			}
+		}
+	}
+	if( !found ) return -1;
+	
+	// walk the path backwards, then encode the turns at the junctions forwards
+	std::vector<unsigned int> path( 1, found - 1 );
+	while( path.back() != start ) path.push_back( from[ path.back() ] >> 1 );
+	
+	int junctions = 0;
+	for( size_t k = path.size() - 1; k > 0; k-- ) {
+		const unsigned int s = path[k];
+		if( graph->nodes[ s >> 1 ].from[ s & 1 ].route != nav::veh::route::ANY ) continue;
+		if( junctions < 32 ) *bits |= ( from[ path[k-1] ] & 1 ) << junctions;
+		junctions++;
+	}
+	
+	if( length ) *length = dist[ found - 1 ];
+	return junctions;
+}
+
+
+/// .\n
+/// Para cada destino se realiza una búsqueda de Dijkstra hacia atrás desde el destino sobre los accesos a los nodos, como en nav::veh::FindRoute().
+nav::veh::Routes * nav::veh::CreateRoutes( const nav::veh::Graph *graph, const unsigned int *destinations, const int num_destinations )
+{
+	typedef std::pair<float,unsigned int> Item;	// distance to the destination, state
+	const unsigned int num = graph->num_nodes;
+	Routes *routes = (Routes*) ::malloc( sizeof(Routes) + num_destinations * ( sizeof(unsigned int) + num ) );
+	if( !routes ) return NULL;
+	
+	routes->graph            = graph;
+	routes->num_destinations = num_destinations;
+	routes->destinations     = (unsigned int*) ( routes + 1 );
+	routes->hops             = (unsigned char*) ( routes->destinations + num_destinations );
+	memcpy( routes->destinations, destinations, num_destinations * sizeof(unsigned int) );
+	memset( routes->hops, 0, num_destinations * num );
+	
+	std::vector<Item> heap;
+	std::vector<float> dist( 2*num );
+	
+	for( int d = 0; d < num_destinations; d++ )
+	{
+		unsigned char *hops = routes->hops + (size_t) d * num;
+		const unsigned int destination = destinations[d];
+		assert( destination && destination < num );
+		
+		std::fill( dist.begin(), dist.end(), -1.0f );
+		for( unsigned int way = 0; way < 2; way++ ) {
+			dist[ 2*destination + way ] = 0.0f;
+			hops[ destination ] |= HOP_REACHABLE << way;
+			heap.push_back( Item( 0.0f, 2*destination + way ) );
+		}
+		
+		while( !heap.empty() ) {
+			std::pop_heap( heap.begin(), heap.end(), std::greater<Item>() );
+			const Item item = heap.back();
+			heap.pop_back();
+			if( item.first > dist[ item.second ] ) continue;	// outdated
+			
+			// the previous node through this access, and its exits leading here
+			const unsigned int m = item.second >> 1;
+			const unsigned int n = graph->nodes[m].prev[ item.second & 1 ];
+			if( !n || ArrivalWay( graph, n, m ) != ( item.second & 1 ) ) continue;
+			const nav::veh::Node &node = graph->nodes[n];
+			
+			for( unsigned int exit = 0; exit < 2; exit++ ) {
+				if( node.next[exit] != m ) continue;
+				const float d = item.first + graph->node_info[n].length[exit];
+				for( unsigned int way = 0; way < 2; way++ ) {
+					const unsigned int s = 2*n + way;
+					if( !CanExit( node, way, exit ) || ( dist[s] >= 0.0f && dist[s] <= d ) ) continue;
+					dist[s] = d;
+					hops[n] = ( hops[n] & ~( 1 << way ) ) | ( exit << way ) | ( HOP_REACHABLE << way );
+					heap.push_back( Item( d, s ) );
+					std::push_heap( heap.begin(), heap.end(), std::greater<Item>() );
+				}
+			}
+		}
+	}
+	
+	return routes;
+}
+
+
+void nav::veh::FreeRoutes( nav::veh::Routes *&routes )
+{
+	::free( routes );
+	routes = NULL;
+}
+
+
+/// Avanza el cursor de una ruta hasta pasar la siguiente bifurcación, siguiendo el enrutamiento de los nodos intermedios, y devuelve su dirección de giro.
+/// Cada nodo de la ruta se recorre una sola vez, por lo que el coste es proporcional a los nodos que recorre el vehículo.
+/// \param [in]     routes  Tablas de rutas.
+/// \param [in]     index   Índice del destino.
+/// \param [in,out] node    Nodo del cursor. Pasa a 0 cuando termina la ruta.
+/// \param [in,out] way     Acceso del cursor al nodo.
+/// \return                 Dirección de giro, o -1 si la ruta termina antes de otra bifurcación (destino alcanzado, final de carretera o destino no alcanzable).
+static int NextRouteTurn( const nav::veh::Routes *routes, const int index, unsigned int &node, unsigned char &way )
+{
+	const nav::veh::Graph *graph = routes->graph;
+	const unsigned char   *hops  = routes->hops + (size_t) index * graph->num_nodes;
+	const unsigned int destination = routes->destinations[ index ];
+	
+	for( unsigned int steps = 0; node && node != destination && steps < graph->num_nodes; steps++ )
+	{
+		const nav::veh::Node &curr = graph->nodes[ node ];
+		const bool junction = ( curr.from[way].route == nav::veh::route::ANY );
+		unsigned int exit;
+		
+		if( junction ) {
+			if( !( hops[node] & ( HOP_REACHABLE << way ) ) ) break;
+			exit = ( hops[node] >> way ) & 1;
+		}
+		else if( CanExit( curr, way, 0 ) ) exit = 0;
+		else if( CanExit( curr, way, 1 ) ) exit = 1;
+		else break;		// end of road
+		
+		const unsigned int next = curr.next[ exit ];
+		way  = ArrivalWay( graph, node, next );
+		node = next;
+		if( junction ) return exit;
+	}
+	
+	node = 0;
+	return -1;
+}
+
+
+unsigned int nav::veh::Plan::RouteTurn( const unsigned int random )
+{
+	const int turn = NextRouteTurn( this->routes, this->route_index, this->route_node, this->route_way );
+	return ( turn < 0 ? random : turn );
+}
+
+
+/// .\n
+/// El cursor de la ruta (Plan::route_node) va siempre 32 bifurcaciones por delante del vehículo.
+bool nav::veh::Plan::SetRoute( const nav::veh::Routes *routes, const int index )
+{
+	if( !routes ) {
+		this->routes = NULL;
+		return true;
+	}
+	
+	assert( routes->graph == this->graph && index >= 0 && index < routes->num_destinations );
+	if( !this->curr ) return false;
+	
+	const unsigned int way = ArrivalWay( this->graph, this->prev, this->curr );
+	if( !( routes->hops[ (size_t) index * this->graph->num_nodes + this->curr ] & ( HOP_REACHABLE << way ) ) ) return false;
+	
+	this->routes      = routes;
+	this->route_index = index;
+	this->route_node  = this->curr;
+	this->route_way   = way;
+	
+	const unsigned int random = this->bits * 3941169319u ^ 2902958803u;	// for the junctions after the destination
+	unsigned int bits = 0;
+	for( int k = 0; k < 32; k++ )
+		bits |= this->RouteTurn( ( random >> k ) & 1 ) << k;
+	this->bits = bits;
+	
+	return true;
+}
+
+
+/// Inicia un nuevo recorrido del grafo, en el que ningún nodo está visitado.
+/// Las marcas sólo se borran cuando el contador de generación da la vuelta.
+static inline void BeginTraversal( nav::veh::Traversal *traversal )
+{
+	if( ++traversal->generation == 0 ) {
+		memset( traversal->stamps, 0, traversal->num_nodes * sizeof(unsigned int) );
+		traversal->generation = 1;
+	}
+}
+
+
+/// Marca un nodo como visitado en el recorrido actual.
+static inline void MarkVisited( nav::veh::Traversal *traversal, const unsigned int node )
+{
+	traversal->stamps[ node ] = traversal->generation;
+}
+
+
+/// Indica si un nodo ha sido visitado en el recorrido actual.
+static inline bool IsVisited( const nav::veh::Traversal *traversal, const unsigned int node )
+{
+	return traversal->stamps[ node ] == traversal->generation;
+}
+
+
+/// Profundidad máxima de la pila de MarkOwnNodes(). Los nodos más profundos no se expanden.
+static const int MARK_STACK_SIZE = 32;
+
+/// Número máximo de nodos visitados por MarkOwnNodes() para un vehículo.
+static const int MARK_MAX_VISITS = 128;
+
+
+/// Política de MarkOwnNodes() para nav::veh::Plan::Planify(): reserva los nodos en la tabla si no están ocupados por otro plan de mayor prioridad.
+struct ReserveOwn {
+	nav::veh::Plan	*plan;		///< Plan del vehículo a insertar en los nodos de planificación.
+	
+	/// Reserva los dos accesos de un nodo ocupado por el vehículo.
+	/// \param [in]     curr     Índice del nodo.
+	/// \param [in]     dist     Distancia con la que se reserva el nodo.
+	/// \param [in]     force    Reservar aunque otro plan tenga preferencia.
+	/// \return                  Verdadero si el nodo se ha reservado y hay que recorrer sus nodos adyacentes.
+	inline bool Own( const unsigned int curr, const float dist, const bool force ) const
+	{
+		nav::veh::PlanNode *pnode = this->plan->reservations->pnodes[ curr ];
+		if( force || pnode[0].plan == this->plan || pnode[0].tick < this->plan->reservations->tick || dist < pnode[0].dist )
+		{
+			pnode[0].plan = this->plan;
+			pnode[0].tick = this->plan->reservations->tick + 1;
+			pnode[0].dist = dist;
+			pnode[0].time = dist;
+			pnode[1] = pnode[0];
+			return true;
+		}
+		return false;
+	}
+};
+
+
+/// Marca un nodo como visitado y, si está al alcance del vehículo, lo ocupa según la política \a policy. Ver MarkOwnNodes().
 /// \param [in]     x		 Coordeanda X de la posición del vehículo.
 /// \param [in]     y        Coordeanda Y de la posición del vehículo.
 /// \param [in]     length2  Distancia al cuadrado desde la posición del vihículo al nodo actual.
-/// \param [in,out] plan     Plan del vehículo a insertar en los nodos de planificación.
+/// \param [in]     plan     Plan del vehículo.
 /// \param [in]     curr     Índice del nodo actual.
 /// \param [in]     forward  Indica si se está recorriendo el grafo hacia delante o hacia atrás.
-static void MarkOwnNodesRecursive( const float x, const float y, const float length2, nav::veh::Plan *plan, unsigned int curr, bool forward )
+/// \param [in,out] traversal  Contexto del recorrido.
+/// \param [in,out] policy   Política de ocupación (ReserveOwn o ProposeOwn).
+/// \return                  Verdadero si el nodo se ha ocupado y hay que recorrer sus nodos adyacentes.
+template < class Policy >
+static inline bool MarkOwnNode( const float x, const float y, const float length2, const nav::veh::Plan *plan, const unsigned int curr, const bool forward, nav::veh::Traversal *traversal, Policy &policy )
 {
 	const nav::veh::Node &node = plan->graph->nodes[ curr ];
-	nav::veh::PlanNode  *pnode = plan->graph->pnodes[ curr ];
 
-	pnode[0].visited = nav::veh::visited;
+	MarkVisited( traversal, curr );
 
 	const float rx = node.x - x;
 	const float ry = node.y - y;
 	const float rr = rx*rx + ry*ry;
-	if( rr > length2 ) return;
+	if( rr > length2 ) return false;	// prune: too far away, do not expand
 	
 	//const float dist = rr * ( forward ? 0.001f : 0.000001f ); // using low values to prevent override other vehicle preferences
 	const float dist = rr * ( forward ? 0.001f : 0.00001f ); // using low values to prevent override other vehicle preferences
-	if( pnode[0].plan == plan || pnode[0].tick < nav::veh::tick || dist < pnode[0].dist )
-	{
-//		if( !forward ) {
-			pnode[0].plan = plan;
-			pnode[0].tick = nav::veh::tick + 1;
-			pnode[0].dist = dist;
-			pnode[0].time = dist;
-			pnode[1] = pnode[0];
-//		}
-
-		// recursively process all not already visited nodes
-		if( plan->graph->pnodes[ node.next[0] ][0].visited != nav::veh::visited ) MarkOwnNodesRecursive( x, y, length2, plan, node.next[0], forward );
-		if( plan->graph->pnodes[ node.next[1] ][0].visited != nav::veh::visited ) MarkOwnNodesRecursive( x, y, length2, plan, node.next[1], forward );
-		if( plan->graph->pnodes[ node.prev[0] ][0].visited != nav::veh::visited ) MarkOwnNodesRecursive( x, y, length2, plan, node.prev[0], false );
-		if( plan->graph->pnodes[ node.prev[1] ][0].visited != nav::veh::visited ) MarkOwnNodesRecursive( x, y, length2, plan, node.prev[1], false );
-	}
+	return policy.Own( curr, dist, false );
 }
 
 
 /// Un vehículo ocupa varios nodos del grafo dirigido a su alrededor.
-/// El plan del vehículo se inserta en los nodos cercanos que no estén ocupados por otro plan de mayor prioridad.
+/// El plan del vehículo se inserta en los nodos cercanos que no estén ocupados por otro plan de mayor prioridad. \n
+/// El recorrido es en profundidad por los nodos siguientes y anteriores, en el mismo orden que la antigua versión recursiva, pero sobre una pila
+/// fija de ::MARK_STACK_SIZE nodos y visitando como mucho ::MARK_MAX_VISITS nodos, de modo que el coste por vehículo está acotado aunque el grafo sea muy denso. \n
+/// La política decide qué se hace con cada nodo: reservarlo en la tabla (ReserveOwn, nav::veh::Plan::Planify()) o proponerlo (ProposeOwn, nav::veh::PlanifyAll()).
 /// \param [in]     x		 Coordeanda X de la posición del vehículo.
 /// \param [in]     y        Coordeanda Y de la posición del vehículo.
 /// \param [in]     length   Distancia máxima o radio de ocupación del vehículo.
-/// \param [in,out] plan     Plan del vehículo a insertar en los nodos de planificación.
-static void MarkOwnNodes( const float x, const float y, const float length, nav::veh::Plan *plan )
+/// \param [in]     plan     Plan del vehículo.
+/// \param [in,out] traversal  Contexto del recorrido.
+/// \param [in,out] policy   Política de ocupación.
+/// \return                  Número de nodos visitados.
+template < class Policy >
+static int MarkOwnNodes( const float x, const float y, const float length, const nav::veh::Plan *plan, nav::veh::Traversal *traversal, Policy &policy )
 {
-	nav::veh::visited++;
-	plan->graph->pnodes[0][0].visited = nav::veh::visited;
-	plan->graph->pnodes[0][1].visited = nav::veh::visited;
-
-	MarkOwnNodesRecursive( x, y, length*length, plan, plan->prev, false );
+	struct {
+		unsigned int	node;		///< Nodo ocupado cuyos adyacentes se están recorriendo.
+		unsigned char	child;		///< Siguiente adyacente a recorrer: next[0], next[1], prev[0], prev[1].
+		bool			forward;	///< Se ha llegado al nodo hacia delante.
+	} stack[ MARK_STACK_SIZE ];
+	
+	const float length2 = length*length;
+	int visits = 1;
+	int top = 0;
+	
+	BeginTraversal( traversal );
+	MarkVisited( traversal, 0 );
+
+	if( MarkOwnNode( x, y, length2, plan, plan->prev, false, traversal, policy ) ) {
+		stack[0].node    = plan->prev;
+		stack[0].child   = 0;
+		stack[0].forward = false;
+		top = 1;
+	}
+	
+	while( top > 0 )
+	{
+		const int c = stack[top-1].child++;
+		if( c == 4 ) {
+			top--;
+			continue;
+		}
+		
+		const nav::veh::Node &node = plan->graph->nodes[ stack[top-1].node ];
+		const unsigned int   next    = ( c < 2 ? node.next[c] : node.prev[c-2] );
+		const bool           forward = ( c < 2 && stack[top-1].forward );
+		if( IsVisited( traversal, next ) ) continue;
+		if( visits == MARK_MAX_VISITS ) break;
+		visits++;
+		
+		if( MarkOwnNode( x, y, length2, plan, next, forward, traversal, policy ) && top < MARK_STACK_SIZE ) {
+			stack[top].node    = next;
+			stack[top].child   = 0;
+			stack[top].forward = forward;
+			top++;
+		}
+	}
 	
 	// inconditionally mark current node as  occupied by this car
-	nav::veh::PlanNode *pnode = plan->graph->pnodes[ plan->prev ];
-	pnode[0].plan = plan;
-	pnode[0].tick = nav::veh::tick + 1;
-	pnode[0].time = 0.0f;
-	pnode[0].dist = 0.0f;
-	pnode[1] = pnode[0];
+	policy.Own( plan->prev, 0.0f, true );
+	
+	return visits;
 }
 
-/// .\n
-/// La planificación se realiza recorriendo los nodos por los que pasará el vehículo durante los futuros \a time segundos suponiendo una velocidad media de \a speed m/s. \n
-/// Podemos saber las próximas 32 direcciones de giro del vehículo (ver veh::Plan::GetTurnDirection()) y predecir su ruta sobre el grafo. \n
-/// Una colisión se produce cuando la ruta de un plan intersecta con otra ruta de mayor preferencia. La preferencia se determina según la distancia o tiempo al que se encuentran los vehículos del nodo donde colisionan.
-/// Si la colisión se produce por el mismo camino (un vehiculo delante sobre la misma carretera) se utiliza una preferencia basada en distancia, de modo que el vehículo de delante simpre tendrá preferencia y el atrasado obtendrá los datos de la futura colisión para frenar o actuar según le convenga.
-/// En el caso de un cruce o intersección entre dos caminos, se utiliza una preferencia basada en tiempo, informando de colisión al que llegue más tarde al nodo, que debería frenar para dejar pasar al que llega primero. \n
-/// La preferencia por defecto se puede alterar mediante señales de tráfico (nav::veh::sign) y semáforos (nav::sem). Al encotrarse un semáforo en rojo, la preferencia se termina y se corta la planificación resultando una colisión.
-/// \note Cuando se detecta una señal de ceda el paso (veh::sign::YIELD) se utiliza el truco de escalar el tiempo de llegada del vehículo por un valor pequeño, perdiendo preferencia en los cruces.
-/// \warning La señal de stop (veh::sign::STOP) no está aún implementada y se trata igual a una señal de ceda el paso.
-const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, const float length, const float speed, const float time, Info *const info )
+/// Enrutamiento precalculado: elige la salida de un nodo según el acceso por el que se llega a él.
+/// \param [in]     plan        Plan del vehículo, cuyos bits de giro deciden las bifurcaciones libres.
+/// \param [in]     node        Nodo actual.
+/// \param [in]     way         Acceso por el que se llega al nodo.
+/// \param [in,out] turn_count  Número de bits de giro utilizados en esta planificación.
+/// \return                     Salida del nodo, índice de Node::next.
+static inline unsigned int Route( const nav::veh::Plan *plan, const nav::veh::Node &node, const unsigned int way, unsigned int &turn_count )
+{
+	switch( node.from[way].route )
+	{
+		case nav::veh::route::NONE:
+			assert( node.next[0] == 0 && node.next[1] == 0 );
+			return 0;
+
+		case nav::veh::route::LEFT:
+			assert( node.next[0] != 0 );
+			return 0;
+
+		case nav::veh::route::RIGHT:
+			assert( node.next[1] != 0 );
+			return 1;
+
+		case nav::veh::route::ANY:
+			assert( node.next[0] != 0 && node.next[1] != 0 );
+			return plan->GetTurnDirection( turn_count++ );
+
+		default:
+			assert( !"veh::Plan::Planify: Invalid route" );
+	}
+	return 0;
+}
+
+
+/// Resultado de WalkRoute().
+struct RouteWalk {
+	const nav::veh::Node	*last;		///< Nodo en el que termina el recorrido.
+	float					dist;		///< Distancia recorrida hasta ese nodo.
+	float					sign_dist;	///< Ver nav::veh::Plan::Info::sign_dist.
+	unsigned int			target;		///< Nodo destino.
+};
+
+
+/// Política de WalkRoute() para nav::veh::Plan::Planify(): reserva los nodos de la ruta mientras el plan tenga preferencia y rellena la información de la colisión.
+struct ReserveRoute {
+	nav::veh::Plan			*plan;
+	nav::veh::Plan::Info	*info;
+	
+	/// Llegada del plan al acceso \a way del nodo \a curr con distancia \a r y tiempo \a t, escalado por \a yield en los cruces.
+	/// \return  Verdadero si el plan tiene preferencia y continúa la ruta.
+	inline bool Reach( const nav::veh::Node &node, const unsigned int curr, const unsigned int way, const float r, const float t, const float yield ) const
+	{
+		nav::veh::Reservations *res = this->plan->reservations;
+		nav::veh::PlanNode *plan_node = &res->pnodes[curr][way]; // preference on my way : distance based
+		bool preference = ( plan_node->plan == this->plan || plan_node->tick < res->tick || ( r < plan_node->dist ) );
+		if( preference )
+		{
+			plan_node->plan = this->plan;
+			plan_node->tick = res->tick + 1;
+			plan_node->dist = r;
+			plan_node->time = t*yield;
+
+			if( node.prev[1] ) {
+				plan_node = &res->pnodes[curr][!way]; // preference on cross : time based
+				preference = ( plan_node->plan == this->plan || plan_node->tick < res->tick || ( t*yield < plan_node->time ) );
+			}
+		}
+
+		if( !preference ) {	// the plan has no preference, return information of the future collision
+			this->info->node  = &node;
+			this->info->plan  = plan_node->plan;
+			this->info->dist  = r;
+			this->info->time  = t;
+			this->info->myway = ( plan_node == &res->pnodes[curr][way] );
+		}
+		return preference;
+	}
+	
+	/// Semáforo en rojo en el nodo, la ruta termina aquí.
+	inline void Red( const nav::veh::Node &node, const float r, const float t ) const
+	{
+		this->info->node  = &node;
+		this->info->dist  = r;
+		this->info->time  = t;
+		this->info->myway = 1;
+		this->info->semaphore = node.semaphore;
+	}
+	
+	/// Salida del nodo hacia \a target con el límite de velocidad \a speed_limit (km/h).
+	inline void Leave( const unsigned int, const unsigned char ) const { }
+};
+
+
+/// Recorre los nodos por los que pasará el vehículo durante los futuros \a time segundos, como se describe en nav::veh::Plan::Planify(),
+/// y actualiza su avance (Plan::prev, Plan::curr, los bits de giro y el límite de velocidad).
+/// La política decide la preferencia en cada nodo: reservarlo en la tabla (ReserveRoute) o proponerlo para nav::veh::PlanifyAll() (ProposeRoute).
+/// \param [in,out] plan    Plan del vehículo.
+/// \param [in]     x       Coordenada X de la posición del vehículo.
+/// \param [in]     y       Coordenada Y de la posición del vehículo.
+/// \param [in]     length  Longitud del vehículo.
+/// \param [in]     speed   Velocidad media del vehículo.
+/// \param [in]     time    Horizonte de planificación.
+/// \param [in,out] policy  Política de preferencia.
+/// \param [out]    walk    Final del recorrido.
+template < class Policy >
+static void WalkRoute( nav::veh::Plan *plan, const float x, const float y, const float length, const float speed, const float time, Policy &policy, RouteWalk &walk )
 {
 	const float speed_inv = ( speed < 1.0f ? 1.0f : 1.0f/speed );
+	const nav::veh::Graph *graph = plan->graph;
 	
 	const nav::veh::Node *curr_node, *prev_node;
 	unsigned int way, curr, prev, target, turn_count;
-	nav::veh::PlanNode *plan_node;
 	bool preference, advance;
 	float rx, ry, r, t;
 	float yield;
 
-	assert( info );
-	info->node = NULL;
-	info->plan = NULL;
-	info->semaphore = 0;
-
-	prev = this->prev;
-	curr = this->curr;
+	prev = plan->prev;
+	curr = plan->curr;
 	turn_count = 0;
 	target = curr;
 
 	// initial distance and time from the vehicle to its current node
-	curr_node = &this->graph->nodes[ curr ];
-	prev_node = &this->graph->nodes[ prev ];
+	curr_node = &graph->nodes[ curr ];
+	prev_node = &graph->nodes[ prev ];
 	rx = curr_node->x - x;
 	ry = curr_node->y - y;
 	r  = sqrt( rx*rx + ry*ry );
 	t  = r * speed_inv;
 
+	// precomputed lookahead: distance to the next sign or semaphore, even beyond the planning horizon
+	walk.sign_dist = r + graph->node_info[ curr ].sign_dist;
+	if( walk.sign_dist > nav::veh::LOOKAHEAD_MAX ) walk.sign_dist = nav::veh::LOOKAHEAD_MAX;
+
 	assert( curr == prev_node->next[0] || curr == prev_node->next[1] );
 	//way = ( prev == curr_node->prev[1] ? 1 : 0 );
 	//yield = ( curr_node->sign[way] == nav::veh::sign::YIELD ? 10.0f : 1.0f );
@@ -255,7 +937,7 @@ const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, co
 	
 	if( curr_node->from[0].sign == nav::veh::sign::SPEED ) {
 		assert( curr_node->from[1].sign == nav::veh::sign::SPEED );
-		this->speed_limit_kmh = curr_node->semaphore;
+		plan->speed_limit_kmh = curr_node->semaphore;
 	}
 	
 	while( curr )
@@ -265,54 +947,9 @@ const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, co
 		assert( prev == curr_node->prev[0] || prev == curr_node->prev[1] );
 		way = ( prev == curr_node->prev[1] ? 1 : 0 ); // vehicle comes from left=0 or right=1
 		
-		plan_node = &this->graph->pnodes[curr][way]; // preference on my way : distance based
-		preference = ( plan_node->plan == this || plan_node->tick < nav::veh::tick || ( r < plan_node->dist ) );
-		if( preference )
-		{
-			plan_node->plan = this;
-			plan_node->tick = nav::veh::tick + 1;
-			plan_node->dist = r;
-			plan_node->time = t*yield;
-
-			if( curr_node->prev[1] ) {
-				plan_node = &this->graph->pnodes[curr][!way]; // preference on cross : time based
-				preference = ( plan_node->plan == this || plan_node->tick < nav::veh::tick || ( t*yield < plan_node->time ) );
-			}
-		}
-
-		if( !preference ) {	// the plan has no preference, return information of the future collision
-			info->node  = curr_node;
-			info->plan  = plan_node->plan;
-			info->dist  = r;
-			info->time  = t;
-			info->myway = ( plan_node == &this->graph->pnodes[curr][way] );
-		}
-
-		switch( curr_node->from[way].route )	// precalculated routing, choose next node
-		{
-			case nav::veh::route::NONE:
-				assert( curr_node->next[0] == 0 && curr_node->next[1] == 0 );
-				way = 0;
-			break;
-
-			case nav::veh::route::LEFT:
-				assert( curr_node->next[0] != 0 );
-				way = 0;
-			break;
-
-			case nav::veh::route::RIGHT:
-				assert( curr_node->next[1] != 0 );
-				way = 1;
-			break;
-
-			case nav::veh::route::ANY:
-				assert( curr_node->next[0] != 0 && curr_node->next[1] != 0 );
-				way = this->GetTurnDirection( turn_count++ );
-			break;
+		preference = policy.Reach( *curr_node, curr, way, r, t, yield );
 
-			default:
-				assert( !"veh::Plan::Planify: Invalid route" );
-		}
+		way = Route( plan, *curr_node, way, turn_count );	// precalculated routing, choose next node
 
 		switch( curr_node->from[way].sign )
 		{
@@ -334,19 +971,15 @@ const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, co
 				if( preference ) {
 					if( !nav::sem::IsGreen( curr_node->semaphore ) ) {
 						preference = false;
-						info->node  = curr_node;
-						info->dist  = r;
-						info->time  = t;
-						info->myway = 1;
-						info->semaphore = curr_node->semaphore;
+						policy.Red( *curr_node, r, t );
 					}
 				}
 			break;
 			
 			case nav::veh::sign::SPEED:
 				assert( curr_node->semaphore );
-				if( curr_node->semaphore < this->speed_limit_kmh )
-					this->speed_limit_kmh = curr_node->semaphore;
+				if( curr_node->semaphore < plan->speed_limit_kmh )
+					plan->speed_limit_kmh = curr_node->semaphore;
 			break;
 			
 			default:
@@ -362,65 +995,90 @@ const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, co
 
 		if( advance ) {			// vehicle overpassed current node, aim to next node
 			advance = false;
-			this->prev = prev;
-			this->curr = curr;
+			plan->prev = prev;
+			plan->curr = curr;
 			if( turn_count ) {
 				assert( turn_count == 1 );
 				turn_count = 0;
-				this->Turn();
+				plan->Turn();
 			}
 		}
+		
+		policy.Leave( target, plan->speed_limit_kmh );
 
 		if( !preference || t > time ) break;
 		
-		// follow the path measuring distance and time
-		curr_node = &this->graph->nodes[ curr ];
-		prev_node = &this->graph->nodes[ prev ];
-		rx = curr_node->x - prev_node->x;
-		ry = curr_node->y - prev_node->y;
-		r += sqrt( rx*rx + ry*ry );
+		// follow the path measuring distance and time, precomputed edge lengths
+		r += graph->node_info[ prev ].length[ way ];
 		t  = r * speed_inv;
+		curr_node = &graph->nodes[ curr ];
 	}
 	
-	MarkOwnNodes( x, y, length, this );
+	walk.last   = curr_node;
+	walk.dist   = r;
+	walk.target = target;
+}
+
+
+/// .\n
+/// La planificación se realiza recorriendo los nodos por los que pasará el vehículo durante los futuros \a time segundos suponiendo una velocidad media de \a speed m/s. \n
+/// Podemos saber las próximas 32 direcciones de giro del vehículo (ver veh::Plan::GetTurnDirection()) y predecir su ruta sobre el grafo. \n
+/// Una colisión se produce cuando la ruta de un plan intersecta con otra ruta de mayor preferencia. La preferencia se determina según la distancia o tiempo al que se encuentran los vehículos del nodo donde colisionan.
+/// Si la colisión se produce por el mismo camino (un vehiculo delante sobre la misma carretera) se utiliza una preferencia basada en distancia, de modo que el vehículo de delante simpre tendrá preferencia y el atrasado obtendrá los datos de la futura colisión para frenar o actuar según le convenga.
+/// En el caso de un cruce o intersección entre dos caminos, se utiliza una preferencia basada en tiempo, informando de colisión al que llegue más tarde al nodo, que debería frenar para dejar pasar al que llega primero. \n
+/// La preferencia por defecto se puede alterar mediante señales de tráfico (nav::veh::sign) y semáforos (nav::sem). Al encotrarse un semáforo en rojo, la preferencia se termina y se corta la planificación resultando una colisión.
+/// \note Cuando se detecta una señal de ceda el paso (veh::sign::YIELD) se utiliza el truco de escalar el tiempo de llegada del vehículo por un valor pequeño, perdiendo preferencia en los cruces.
+/// \warning La señal de stop (veh::sign::STOP) no está aún implementada y se trata igual a una señal de ceda el paso.
+const nav::veh::Node * nav::veh::Plan::Planify( const float x, const float y, const float length, const float speed, const float time, Info *const info )
+{
+	ReserveRoute route = { this, info };
+	ReserveOwn   own   = { this };
+	RouteWalk    walk;
+	float rx, ry;
+
+	assert( info );
+	info->node = NULL;
+	info->plan = NULL;
+	info->semaphore = 0;
+
+	WalkRoute( this, x, y, length, speed, time, route, walk );
+	
+	info->sign_dist = walk.sign_dist;
+	info->visited   = MarkOwnNodes( x, y, length, this, this->reservations->traversal, own );
 
 	// fast way to evaluate the curvature of the path:  ( dist( node_first, node_last )^2 / path_length^2 )^2   // from 0.0 to 1.0=line
-	rx = curr_node->x - x;
-	ry = curr_node->y - y;
-	info->curvature = ( rx*rx + ry*ry ) / ( r*r );
+	rx = walk.last->x - x;
+	ry = walk.last->y - y;
+	info->curvature = ( rx*rx + ry*ry ) / ( walk.dist*walk.dist );
 	info->curvature *= info->curvature;
 
 	info->speed_limit = this->speed_limit_kmh * (1000.0f/60/60);	// km/h to m/s
 
-	return ( target ? &this->graph->nodes[target] : NULL );
+	return ( walk.target ? &this->graph->nodes[ walk.target ] : NULL );
 }
 
 
-void NearbyRecursive( nav::veh::Plan::NearbyCallback callback, nav::veh::Plan &plan, const unsigned int curr, const unsigned int prev, float dist )
+void NearbyRecursive( nav::veh::Plan::NearbyCallback callback, nav::veh::Plan &plan, nav::veh::Traversal *traversal, const unsigned int curr, const float edge, float dist )
 {
 	const nav::veh::Node &node = plan.graph->nodes[curr];
 	
-	plan.graph->pnodes[curr][0].visited = nav::veh::visited;	// mark current node as visited to cut recursion
+	MarkVisited( traversal, curr );	// mark current node as visited to cut recursion
 	
-	if( prev ) { // substract distance, cut recursion when dist < 0
-		const float rx = node.x - plan.graph->nodes[prev].x;
-		const float ry = node.y - plan.graph->nodes[prev].y;
-		dist -= sqrt( rx*rx + ry*ry );
-	}
+	dist -= edge; // substract length of the edge from the previous node, cut recursion when dist < 0
 
 	for( int i = 0; i < 2; i++ ) {
 		if( node.next[i] ) {
-			nav::veh::PlanNode *pnode = plan.graph->pnodes[ node.next[i] ];						// next node to visit
-			if( pnode[0].visited != nav::veh::visited ) {										// check node not already visited
+			nav::veh::PlanNode *pnode = plan.reservations->pnodes[ node.next[i] ];						// next node to visit
+			if( !IsVisited( traversal, node.next[i] ) ) {										// check node not already visited
 				for( int way = 0; way < 2; way++ ) {											// 
-					if( pnode[way].plan != &plan && pnode[way].tick >= nav::veh::tick ) {		// is another plan over this node ?
+					if( pnode[way].plan != &plan && pnode[way].tick >= plan.reservations->tick ) {		// is another plan over this node ?
 						if( pnode[way].dist == 0.0f && pnode[way].plan ) {						// is the vehicle exactly over this node ?
 							callback( &plan, pnode[way].plan );									// notify the intersection
 						}						
 					}
 				}
 				if( dist > 0.0f ) {
-					NearbyRecursive( callback, plan, node.next[i], curr, dist );					
+					NearbyRecursive( callback, plan, traversal, node.next[i], plan.graph->node_info[curr].length[i], dist );					
 				}
 			}
 		}
@@ -429,27 +1087,673 @@ void NearbyRecursive( nav::veh::Plan::NearbyCallback callback, nav::veh::Plan &p
 
 void nav::veh::Plan::Nearby( const float dist, NearbyCallback callback )
 {
-	nav::veh::visited++;
-	NearbyRecursive( callback, *this, this->curr, 0, dist );
+	this->Nearby( dist, callback, this->reservations->traversal );
+}
+
+void nav::veh::Plan::Nearby( const float dist, NearbyCallback callback, Traversal *traversal )
+{
+	BeginTraversal( traversal );
+	NearbyRecursive( callback, *this, traversal, this->curr, 0.0f, dist );
+}
+
+
+namespace nav
+{
+	namespace veh
+	{
+		/// Reserva propuesta por un vehículo en veh::PlanifyAll(), sin consultar las propuestas de los demás.
+		struct Proposal {
+			unsigned int	node;			///< Nodo a reservar.
+			unsigned char	way;			///< Acceso al nodo.
+			unsigned char	flags;			///< Ver ::PROPOSAL_CROSS y ::PROPOSAL_RED.
+			unsigned char	speed_limit;	///< Límite de velocidad del plan (km/h) tras pasar por el nodo.
+			unsigned char	_padding;
+			float			dist;			///< Distancia que tiene que recorrer el vehículo para llegar al nodo.
+			float			time;			///< Tiempo que tarda el vehículo en llegar al nodo, escalado por las señales de ceda el paso.
+			unsigned int	target;			///< Nodo destino si la planificación termina en este nodo.
+		};
+
+		/// Resultado de la propuesta de un vehículo en veh::PlanifyAll().
+		struct Proposer {
+			int				thread;			///< Hilo en cuyo buffer están sus propuestas.
+			unsigned int	begin;			///< Primera propuesta de su ruta.
+			unsigned int	walk;			///< Fin de las propuestas de su ruta y primera de los nodos que ocupa.
+			unsigned int	end;			///< Fin de las propuestas de los nodos que ocupa.
+			int				cut;			///< Propuesta de su ruta en la que colisiona, relativa a \a begin, o -1 si no colisiona.
+			unsigned int	merged;			///< Fin de las propuestas de su ruta incluidas en la última mezcla: \a walk o la siguiente a la colisión.
+			unsigned int	last;			///< Nodo en el que termina el recorrido si no colisiona.
+			float			dist;			///< Distancia recorrida hasta ese nodo.
+			unsigned int	target;			///< Nodo destino si no colisiona.
+			unsigned char	speed_limit;	///< Límite de velocidad (km/h) si no colisiona.
+			float			sign_dist;		///< Ver Plan::Info::sign_dist.
+			int				visited;		///< Ver Plan::Info::visited.
+		};
+
+		/// Tramo de propuestas consecutivas de un vehículo sobre nodos del mismo rango, en el buffer de su hilo. Agrupan las propuestas por rango para la mezcla de veh::PlanifyAll().
+		struct ProposalRun {
+			int				vehicle;		///< Índice del vehículo en el grupo.
+			unsigned int	begin;			///< Primera propuesta del tramo.
+			unsigned int	end;			///< Fin del tramo.
+		};
+
+		/// Mejor propuesta de un acceso a un nodo (la de menor distancia), dos por nodo del grafo como los PlanNode.
+		struct Candidate {
+			unsigned int	stamp;			///< Es válida si es igual a Planner::stamp.
+			int				vehicle;		///< Índice del vehículo en el grupo, -1 si todavía no hay ninguna.
+			float			dist;			///< Distancia del vehículo al nodo.
+			float			time;			///< Tiempo de llegada del vehículo al nodo.
+			bool			renewed;		///< El plan de la reserva anterior (PlanNode) también propone este acceso, por lo que la reemplaza.
+		};
+
+		/// Planificador en paralelo. Ver veh::PlanifyAll().
+		struct Planner {
+			Reservations					*reservations;	///< Tabla de reservas sobre la que se planifica.
+			Candidate						*candidates;	///< Mejores propuestas, dos por nodo del grafo.
+			unsigned int					stamp;			///< Incrementado en cada mezcla para invalidar las propuestas anteriores.
+			std::vector< std::vector<Proposal> > buffers;	///< Propuestas de los vehículos de cada hilo.
+			std::vector< std::vector<ProposalRun> > buckets;	///< Tramos de propuestas de cada hilo por rango de nodos (ver Bucket()): buckets[ hilo*num_threads + rango ].
+			unsigned long long				bucket_scale;	///< num_threads * 2^32 / número de nodos, para calcular el rango de un nodo sin dividir.
+			std::vector< std::vector<unsigned int> > touched;	///< Accesos (2*nodo+acceso) con propuestas en la última mezcla, de los nodos de cada hilo.
+			std::vector<Traversal*>			traversals;		///< Contexto de recorrido de cada hilo.
+			std::vector<Proposer>			proposers;		///< Resultado de cada vehículo.
+			std::vector<unsigned char>		remerge;		///< El hilo ha cambiado en la última resolución el corte de algún vehículo (Proposer::merged), hay que volver a mezclar.
+			
+			Plan *const						*plans;			///< Parámetros de la llamada actual a veh::PlanifyAll().
+			const Request					*requests;
+			Plan::Info						*infos;
+			const Node						**targets;
+			int								num;
+			
+			int								num_threads;	///< Número de hilos, incluido el que llama a veh::PlanifyAll().
+			std::vector<std::thread>		threads;		///< Hilos de trabajo, del 1 al num_threads-1.
+			std::mutex						mutex;
+			std::condition_variable			wake;			///< Avisa a los hilos de una nueva fase.
+			std::condition_variable			done;			///< Avisa del fin de la fase en todos los hilos.
+			unsigned int					job;			///< Incrementado en cada fase.
+			int								phase;			///< Fase a ejecutar.
+			int								pending;		///< Hilos que no han terminado la fase.
+			bool							quit;			///< Terminar los hilos.
+		};
+	}
+}
+
+
+/// Indicadores de nav::veh::Proposal::flags.
+static const unsigned char PROPOSAL_CROSS = 1;	///< El nodo tiene dos accesos, también se compite por tiempo con el otro acceso.
+static const unsigned char PROPOSAL_RED   = 2;	///< Semáforo en rojo en el nodo, la ruta termina aquí.
+
+/// Fases paralelas de nav::veh::PlanifyAll(). Las de propuesta y resolución reparten los vehículos entre los hilos, las de mezcla y escritura reparten los nodos.
+enum { PHASE_PROPOSE, PHASE_MERGE, PHASE_CUT, PHASE_RESOLVE, PHASE_COMMIT, PHASE_MERGE_COMMIT };
+
+
+/// Rango de nodos al que pertenece \a node en las fases de mezcla y escritura de nav::veh::PlanifyAll(), que es también el hilo que lo procesa.
+static inline int Bucket( const nav::veh::Planner *planner, const unsigned int node )
+{
+	return ( node * planner->bucket_scale ) >> 32;
+}
+
+
+/// Política de MarkOwnNodes() para nav::veh::PlanifyAll(): propone los nodos cercanos al vehículo en lugar de reservarlos.
+/// Se expande por todos los nodos al alcance del vehículo aunque otro plan tenga preferencia sobre ellos, ya que las preferencias se resuelven después.
+struct ProposeOwn {
+	std::vector<nav::veh::Proposal>	*buffer;	///< Buffer de propuestas del hilo.
+	
+	/// Propone los dos accesos de un nodo ocupado por el vehículo. Ver ReserveOwn::Own().
+	inline bool Own( const unsigned int curr, const float dist, const bool ) const
+	{
+		nav::veh::Proposal proposal;
+		proposal.node  = curr;
+		proposal.flags = 0;
+		proposal.speed_limit = 0;
+		proposal._padding = 0;
+		proposal.dist  = dist;
+		proposal.time  = dist;
+		proposal.target = 0;
+		for( int way = 0; way < 2; way++ ) {
+			proposal.way = way;
+			this->buffer->push_back( proposal );
+		}
+		return true;
+	}
+};
+
+
+/// Política de WalkRoute() para nav::veh::PlanifyAll(): guarda una propuesta por nodo de la ruta sin escribir en la tabla de reservas. Ver ReserveRoute.
+/// La ruta termina en el primer nodo donde la tabla, que no cambia hasta la escritura de nav::veh::PlanifyAll(), da preferencia a otro plan con las reglas de ReserveRoute::Reach().
+struct ProposeRoute {
+	const nav::veh::Plan			*plan;		///< Plan del vehículo.
+	std::vector<nav::veh::Proposal>	*buffer;	///< Buffer de propuestas del hilo.
+	nav::veh::Proposal				proposal;	///< Propuesta del nodo actual.
+	
+	inline bool Reach( const nav::veh::Node &node, const unsigned int curr, const unsigned int way, const float r, const float t, const float yield )
+	{
+		this->proposal.node  = curr;
+		this->proposal.way   = way;
+		this->proposal.flags = ( node.prev[1] ? PROPOSAL_CROSS : 0 );
+		this->proposal._padding = 0;
+		this->proposal.dist  = r;
+		this->proposal.time  = t*yield;
+		
+		// nodes past a reservation of another plan with preference would be cut anyway, stop proposing here like Planify()
+		const nav::veh::Reservations *res = this->plan->reservations;
+		const nav::veh::PlanNode *plan_node = &res->pnodes[curr][way];
+		bool preference = ( plan_node->plan == this->plan || plan_node->tick < res->tick || r < plan_node->dist );
+		if( preference && node.prev[1] ) {
+			plan_node = &res->pnodes[curr][!way];
+			preference = ( plan_node->plan == this->plan || plan_node->tick < res->tick || t*yield < plan_node->time );
+		}
+		return preference;
+	}
+	
+	inline void Red( const nav::veh::Node &, const float, const float )
+	{
+		this->proposal.flags |= PROPOSAL_RED;
+	}
+	
+	inline void Leave( const unsigned int target, const unsigned char speed_limit )
+	{
+		this->proposal.speed_limit = speed_limit;
+		this->proposal.target = target;
+		this->buffer->push_back( this->proposal );
+	}
+};
+
+
+/// Primera fase de nav::veh::PlanifyAll(): recorre la ruta del vehículo \a i con WalkRoute(), como nav::veh::Plan::Planify(), pero sin escribir en la tabla de reservas,
+/// guardando en el buffer del hilo una propuesta por nodo hasta el horizonte de planificación, un semáforo en rojo, la primera reserva de otro plan con preferencia
+/// o el final de la ruta, y otra por cada nodo que ocupa.
+/// Las propuestas se reparten además en tramos en los buckets del hilo según el rango de su nodo.
+/// Actualiza el avance del plan (Plan::prev, Plan::curr y los bits de giro) como nav::veh::Plan::Planify().
+static void Propose( nav::veh::Planner *planner, const int thread, const int i )
+{
+	nav::veh::Plan *plan = planner->plans[i];
+	const nav::veh::Request &request = planner->requests[i];
+	std::vector<nav::veh::Proposal> &buffer = planner->buffers[ thread ];
+	nav::veh::Proposer &proposer = planner->proposers[i];
+	ProposeRoute route;
+	ProposeOwn   own = { &buffer };
+	RouteWalk    walk;
+	
+	assert( plan->reservations == planner->reservations );
+	proposer.thread = thread;
+	proposer.begin  = buffer.size();
+	proposer.cut    = -1;
+	
+	route.plan   = plan;
+	route.buffer = &buffer;
+	WalkRoute( plan, request.x, request.y, request.length, request.speed, request.time, route, walk );
+	
+	proposer.walk   = buffer.size();
+	proposer.merged = proposer.walk;
+	proposer.last   = walk.last - plan->graph->nodes;
+	proposer.dist   = walk.dist;
+	proposer.target = walk.target;
+	proposer.speed_limit = plan->speed_limit_kmh;
+	proposer.sign_dist   = walk.sign_dist;
+	
+	proposer.visited = MarkOwnNodes( request.x, request.y, request.length, plan, planner->traversals[ thread ], own );
+	proposer.end = buffer.size();
+	
+	// bucket runs by node range, so that each merge thread reads only the proposals of its nodes
+	nav::veh::ProposalRun run;
+	run.vehicle = i;
+	if( planner->num_threads == 1 ) {	// a single range, no need to split
+		run.begin = proposer.begin;
+		run.end   = proposer.end;
+		planner->buckets[0].push_back( run );
+		return;
+	}
+	run.end = proposer.begin;
+	while( run.end < proposer.end ) {
+		const int bucket = Bucket( planner, buffer[ run.end ].node );
+		run.begin = run.end;
+		while( ++run.end < proposer.end && Bucket( planner, buffer[ run.end ].node ) == bucket );
+		planner->buckets[ thread*planner->num_threads + bucket ].push_back( run );
+	}
+}
+
+
+/// Añade una propuesta del vehículo \a i a la mejor de su acceso: gana la de menor distancia y, a igual distancia, la del vehículo de menor índice.
+static inline void Insert( nav::veh::Planner *planner, const int thread, const int i, const nav::veh::Proposal &proposal )
+{
+	const unsigned int key = 2*proposal.node + proposal.way;
+	nav::veh::Candidate &candidate = planner->candidates[ key ];
+	
+	if( candidate.stamp != planner->stamp ) {
+		candidate.stamp   = planner->stamp;
+		candidate.vehicle = -1;
+		candidate.renewed = false;
+		planner->touched[ thread ].push_back( key );
+	}
+	
+	if( planner->reservations->pnodes[ proposal.node ][ proposal.way ].plan == planner->plans[i] )
+		candidate.renewed = true;
+	
+	if( candidate.vehicle < 0 || proposal.dist < candidate.dist ) {
+		candidate.vehicle = i;
+		candidate.dist    = proposal.dist;
+		candidate.time    = proposal.time;
+	}
+}
+
+
+/// Calcula la mejor propuesta de cada acceso a los nodos del hilo leyendo sólo sus buckets. Los hilos proponen bloques consecutivos de vehículos en orden,
+/// así que recorriendo los buckets de los hilos en orden se insertan las propuestas en orden de vehículo y el resultado no depende del reparto entre hilos.
+/// Las propuestas de la ruta de cada vehículo posteriores a su colisión en la última resolución (Proposer::merged) se descartan.
+/// \param [in,out] planner   Planificador.
+/// \param [in]     thread    Hilo, que es también el rango de nodos (ver Bucket()).
+static void Merge( nav::veh::Planner *planner, const int thread )
+{
+	planner->touched[ thread ].clear();
+	
+	for( int t = 0; t < planner->num_threads; t++ ) {
+		const std::vector<nav::veh::ProposalRun> &bucket = planner->buckets[ t*planner->num_threads + thread ];
+		const std::vector<nav::veh::Proposal> &buffer = planner->buffers[t];
+		for( size_t b = 0; b < bucket.size(); b++ ) {
+			const nav::veh::ProposalRun &run = bucket[b];
+			const nav::veh::Proposer &proposer = planner->proposers[ run.vehicle ];
+			for( unsigned int k = run.begin; k < run.end && k < proposer.merged; k++ )
+				Insert( planner, thread, run.vehicle, buffer[k] );
+			for( unsigned int k = ( run.begin > proposer.walk ? run.begin : proposer.walk ); k < run.end; k++ )
+				Insert( planner, thread, run.vehicle, buffer[k] );
+		}
+	}
+}
+
+
+/// Plan con preferencia sobre un acceso. Ver GetWinner().
+struct Winner {
+	nav::veh::Plan	*plan;
+	int				vehicle;	///< Índice del vehículo en el grupo o -1 si es una reserva anterior.
+	float			dist;
+	float			time;
+};
+
+
+/// Obtiene el plan con preferencia sobre un acceso: la mejor propuesta o la reserva anterior de la tabla, si sigue siendo válida,
+/// no la ha renovado su plan y está más cerca (a igual distancia se mantiene la anterior, como en nav::veh::Plan::Planify()).
+/// \return  Falso si nadie ha reservado el acceso.
+static inline bool GetWinner( const nav::veh::Planner *planner, const unsigned int node, const unsigned int way, Winner &winner )
+{
+	const nav::veh::Candidate &candidate = planner->candidates[ 2*node + way ];
+	const nav::veh::PlanNode  &pnode     = planner->reservations->pnodes[ node ][ way ];
+	const bool fresh = ( candidate.stamp == planner->stamp );
+	const bool proposed = ( fresh && candidate.vehicle >= 0 );
+	const bool reserved = ( pnode.tick >= planner->reservations->tick && !( fresh && candidate.renewed ) );
+	
+	if( reserved && !( proposed && candidate.dist < pnode.dist ) ) {
+		winner.plan    = pnode.plan;
+		winner.vehicle = -1;
+		winner.dist    = pnode.dist;
+		winner.time    = pnode.time;
+		return true;
+	}
+	if( proposed ) {
+		winner.plan    = planner->plans[ candidate.vehicle ];
+		winner.vehicle = candidate.vehicle;
+		winner.dist    = candidate.dist;
+		winner.time    = candidate.time;
+		return true;
+	}
+	return false;
+}
+
+
+/// Indica si el vehículo \a i, con distancia o tiempo \a value, pierde la preferencia frente al plan \a winner con \a other.
+/// Los empates los pierde frente a las reservas anteriores y frente a los vehículos de menor índice.
+static inline bool Loses( const int i, const Winner &winner, const float value, const float other )
+{
+	return ( other < value || ( other == value && ( winner.vehicle < 0 || winner.vehicle < i ) ) );
+}
+
+
+/// Busca la primera colisión del vehículo \a i en su ruta con las mejores propuestas actuales, con las mismas reglas que nav::veh::Plan::Planify():
+/// preferencia por distancia en su propio camino, por tiempo en los cruces, y corte en los semáforos en rojo. Sólo lee el planificador y la tabla.
+/// \param [in,out] planner  Planificador. Se actualizan Proposer::cut y Proposer::merged del vehículo y, si cambia este último, Planner::remerge del hilo.
+/// \param [in]     thread   Hilo.
+/// \param [in]     i        Índice del vehículo.
+/// \param [in]     final    Rellenar también el resultado del vehículo (Plan::Info, destino y límite de velocidad).
+static void Resolve( nav::veh::Planner *planner, const int thread, const int i, const bool final )
+{
+	nav::veh::Plan *plan = planner->plans[i];
+	nav::veh::Proposer &proposer = planner->proposers[i];
+	const std::vector<nav::veh::Proposal> &buffer = planner->buffers[ proposer.thread ];
+	const nav::veh::Graph *graph = plan->graph;
+	nav::veh::Plan *other = NULL;
+	unsigned char myway = 1;
+	Winner winner;
+	
+	proposer.cut = -1;
+	for( unsigned int k = proposer.begin; k < proposer.walk; k++ )
+	{
+		const nav::veh::Proposal &proposal = buffer[k];
+		if( GetWinner( planner, proposal.node, proposal.way, winner ) && winner.plan != plan && Loses( i, winner, proposal.dist, winner.dist ) ) {
+			other = winner.plan;	// preference on my way : distance based
+			myway = 1;
+		}
+		else if( ( proposal.flags & PROPOSAL_CROSS ) && GetWinner( planner, proposal.node, !proposal.way, winner ) && winner.plan != plan && Loses( i, winner, proposal.time, winner.time ) ) {
+			other = winner.plan;	// preference on cross : time based
+			myway = 0;
+		}
+		else if( !( proposal.flags & PROPOSAL_RED ) ) {
+			continue;
+		}
+		proposer.cut = k - proposer.begin;
+		break;
+	}
+	
+	// the next merge only differs from the last one if some vehicle truncates its route at another node
+	const unsigned int merged = ( proposer.cut >= 0 ? proposer.begin + proposer.cut + 1 : proposer.walk );
+	if( merged != proposer.merged ) {
+		proposer.merged = merged;
+		planner->remerge[ thread ] = true;
+	}
+	
+	if( !final ) return;
+	
+	const nav::veh::Request &request = planner->requests[i];
+	const float speed_inv = ( request.speed < 1.0f ? 1.0f : 1.0f/request.speed );
+	nav::veh::Plan::Info *info = &planner->infos[i];
+	unsigned int last   = proposer.last;
+	unsigned int target = proposer.target;
+	float r = proposer.dist;
+	
+	info->node = NULL;
+	info->plan = NULL;
+	info->semaphore = 0;
+	plan->speed_limit_kmh = proposer.speed_limit;
+	
+	if( proposer.cut >= 0 ) {	// the plan has no preference, return information of the future collision
+		const nav::veh::Proposal &proposal = buffer[ proposer.begin + proposer.cut ];
+		last   = proposal.node;
+		target = proposal.target;
+		r      = proposal.dist;
+		plan->speed_limit_kmh = proposal.speed_limit;
+		
+		info->node  = &graph->nodes[ last ];
+		info->plan  = other;
+		info->dist  = r;
+		info->time  = r * speed_inv;
+		info->myway = myway;
+		if( !other ) info->semaphore = graph->nodes[ last ].semaphore;
+	}
+	
+	const float rx = graph->nodes[ last ].x - request.x;
+	const float ry = graph->nodes[ last ].y - request.y;
+	info->curvature = ( rx*rx + ry*ry ) / ( r*r );
+	info->curvature *= info->curvature;
+	
+	info->speed_limit = plan->speed_limit_kmh * (1000.0f/60/60);	// km/h to m/s
+	info->sign_dist   = proposer.sign_dist;
+	info->visited     = proposer.visited;
+	
+	planner->targets[i] = ( target ? &graph->nodes[ target ] : NULL );
+}
+
+
+/// Escribe en la tabla de reservas las mejores propuestas de los nodos del hilo que superan a la reserva anterior de su acceso.
+static void Commit( nav::veh::Planner *planner, const int thread )
+{
+	nav::veh::Reservations *reservations = planner->reservations;
+	const std::vector<unsigned int> &touched = planner->touched[ thread ];
+	Winner winner;
+	
+	for( size_t k = 0; k < touched.size(); k++ ) {
+		const unsigned int node = touched[k] >> 1;
+		const unsigned int way  = touched[k] & 1;
+		if( !GetWinner( planner, node, way, winner ) || winner.vehicle < 0 ) continue;
+		
+		nav::veh::PlanNode &pnode = reservations->pnodes[ node ][ way ];
+		pnode.plan = winner.plan;
+		pnode.tick = reservations->tick + 1;
+		pnode.dist = winner.dist;
+		pnode.time = winner.time;
+	}
+}
+
+
+/// Ejecuta una fase sobre los vehículos o los nodos del hilo, repartidos en bloques consecutivos.
+static void RunPhase( nav::veh::Planner *planner, const int phase, const int thread )
+{
+	const int first = (long) planner->num * thread / planner->num_threads;
+	const int last  = (long) planner->num * ( thread + 1 ) / planner->num_threads;
+	
+	switch( phase ) {
+		case PHASE_PROPOSE:      for( int i = first; i < last; i++ ) Propose( planner, thread, i );        break;
+		case PHASE_MERGE:        Merge( planner, thread );                                                 break;
+		case PHASE_CUT:          for( int i = first; i < last; i++ ) Resolve( planner, thread, i, false );  break;
+		case PHASE_RESOLVE:      for( int i = first; i < last; i++ ) Resolve( planner, thread, i, true );   break;
+		case PHASE_COMMIT:       Commit( planner, thread );                                                break;
+		case PHASE_MERGE_COMMIT: Merge( planner, thread ); Commit( planner, thread );                      break;
+	}
+}
+
+
+/// Bucle de los hilos de trabajo: espera cada fase, la ejecuta y avisa al terminar.
+static void Worker( nav::veh::Planner *planner, const int thread )
+{
+	unsigned int job = 0;
+	
+	for( ;; ) {
+		int phase;
+		{
+			std::unique_lock<std::mutex> lock( planner->mutex );
+			while( planner->job == job ) planner->wake.wait( lock );
+			job = planner->job;
+			if( planner->quit ) return;
+			phase = planner->phase;
+		}
+		
+		RunPhase( planner, phase, thread );
+		
+		std::lock_guard<std::mutex> lock( planner->mutex );
+		if( --planner->pending == 0 ) planner->done.notify_one();
+	}
+}
+
+
+/// Ejecuta una fase en todos los hilos, incluido el que llama, y espera a que terminen.
+static void Dispatch( nav::veh::Planner *planner, const int phase )
+{
+	if( planner->num_threads > 1 ) {
+		std::lock_guard<std::mutex> lock( planner->mutex );
+		planner->phase   = phase;
+		planner->pending = planner->num_threads - 1;
+		planner->job++;
+		planner->wake.notify_all();
+	}
+	
+	RunPhase( planner, phase, 0 );
+	
+	std::unique_lock<std::mutex> lock( planner->mutex );
+	while( planner->pending ) planner->done.wait( lock );
+}
+
+
+/// Indica si algún hilo ha cambiado el corte de un vehículo en la última resolución, y lo olvida.
+static bool Remerge( nav::veh::Planner *planner )
+{
+	bool remerge = false;
+	for( int t = 0; t < planner->num_threads; t++ ) {
+		if( planner->remerge[t] ) remerge = true;
+		planner->remerge[t] = false;
+	}
+	return remerge;
+}
+
+
+nav::veh::Planner * nav::veh::CreatePlanner( nav::veh::Reservations *reservations, const int num_threads )
+{
+	assert( num_threads >= 1 );
+	const size_t size = reservations->graph->num_nodes * 2*sizeof(Candidate);
+	Candidate *candidates = (Candidate*) ::malloc( size );
+	if( !candidates ) return NULL;
+	memset( candidates, 0, size );
+	
+	Planner *planner = new Planner();
+	planner->traversals.resize( num_threads );
+	for( int t = 0; t < num_threads; t++ ) {
+		planner->traversals[t] = CreateTraversal( reservations->graph );
+		if( !planner->traversals[t] ) {
+			for( int k = 0; k < t; k++ ) FreeTraversal( planner->traversals[k] );
+			::free( candidates );
+			delete planner;
+			return NULL;
+		}
+	}
+	
+	planner->reservations = reservations;
+	planner->candidates   = candidates;
+	planner->stamp        = 0;
+	planner->num          = 0;
+	planner->num_threads  = num_threads;
+	planner->buffers.resize( num_threads );
+	planner->buckets.resize( num_threads * num_threads );
+	planner->bucket_scale = ( (unsigned long long) num_threads << 32 ) / reservations->graph->num_nodes;
+	planner->touched.resize( num_threads );
+	planner->remerge.resize( num_threads, false );
+	planner->job          = 0;
+	planner->phase        = PHASE_PROPOSE;
+	planner->pending      = 0;
+	planner->quit         = false;
+	
+	for( int t = 1; t < num_threads; t++ )
+		planner->threads.push_back( std::thread( Worker, planner, t ) );
+	
+	return planner;
+}
+
+
+void nav::veh::FreePlanner( nav::veh::Planner *&planner )
+{
+	if( !planner ) return;
+	
+	{
+		std::lock_guard<std::mutex> lock( planner->mutex );
+		planner->quit = true;
+		planner->job++;
+		planner->wake.notify_all();
+	}
+	for( size_t t = 0; t < planner->threads.size(); t++ )
+		planner->threads[t].join();
+	
+	for( size_t t = 0; t < planner->traversals.size(); t++ )
+		FreeTraversal( planner->traversals[t] );
+	::free( planner->candidates );
+	delete planner;
+	planner = NULL;
+}
+
+
+/// .\n
+/// Las fases de propuesta y resolución reparten los vehículos entre los hilos; las de mezcla de propuestas y escritura en la tabla reparten los nodos,
+/// leyendo cada hilo sólo las propuestas de sus nodos, que la fase de propuesta deja agrupadas por rango.
+/// Antes de escribir se vuelven a mezclar las propuestas truncadas en la colisión final de cada vehículo, que puede quedar antes que la de la primera resolución,
+/// de modo que no se reservan nodos posteriores a la colisión devuelta en Plan::Info. Cada hilo mezcla y escribe los mismos nodos, así que no hace falta esperar entre ambas.
+/// Las mezclas tras cada resolución se omiten si ningún vehículo ha cambiado su corte, lo habitual en la final porque la ruta de cada vehículo
+/// ya termina en la primera reserva de otro plan con preferencia (ver ProposeRoute).
+/// \note A diferencia de llamar a veh::Plan::Planify() en secuencia, un vehículo no ve las reservas de este frame de los vehículos anteriores del grupo al elegir su ruta,
+/// por lo que los nodos que ocupa se proponen todos aunque otro plan tenga preferencia (ver ProposeOwn), y el resultado puede diferir del secuencial en los empates y cruces simultáneos.
+void nav::veh::PlanifyAll( nav::veh::Planner *planner, nav::veh::Plan *const *plans, const nav::veh::Request *requests, nav::veh::Plan::Info *infos, const nav::veh::Node **targets, const int num )
+{
+	planner->plans    = plans;
+	planner->requests = requests;
+	planner->infos    = infos;
+	planner->targets  = targets;
+	planner->num      = num;
+	if( (int) planner->proposers.size() < num ) planner->proposers.resize( num );
+	for( int t = 0; t < planner->num_threads; t++ ) planner->buffers[t].clear();
+	for( size_t b = 0; b < planner->buckets.size(); b++ ) planner->buckets[b].clear();
+	
+	Dispatch( planner, PHASE_PROPOSE );
+	planner->stamp++;
+	Dispatch( planner, PHASE_MERGE );
+	Dispatch( planner, PHASE_CUT );			// first collision of each vehicle against every proposal
+	if( Remerge( planner ) ) {
+		planner->stamp++;
+		Dispatch( planner, PHASE_MERGE );	// forget the proposals beyond the collisions
+	}
+	Dispatch( planner, PHASE_RESOLVE );
+	if( Remerge( planner ) ) {
+		planner->stamp++;
+		Dispatch( planner, PHASE_MERGE_COMMIT );	// reserve only up to the final collisions
+	} else {
+		Dispatch( planner, PHASE_COMMIT );
+	}
+}
+
+
+nav::veh::Reservations * nav::veh::CreateReservations( const nav::veh::Graph *graph )
+{
+	const size_t size = graph->num_nodes * 2*sizeof(PlanNode);
+	Reservations *reservations = (Reservations*) ::malloc( sizeof(Reservations) + size );
+	if( !reservations ) return NULL;
+	
+	reservations->graph     = graph;
+	reservations->pnodes    = (PlanNode(*)[2]) ( reservations + 1 );
+	reservations->tick      = 1;
+	reservations->traversal = CreateTraversal( graph );
+	memset( reservations+1, 0, size );
+	
+	if( !reservations->traversal ) {
+		::free( reservations );
+		return NULL;
+	}
+	
+	return reservations;
+}
+
+
+void nav::veh::FreeReservations( nav::veh::Reservations *&reservations )
+{
+	if( reservations ) FreeTraversal( reservations->traversal );
+	::free( reservations );
+	reservations = NULL;
+}
+
+
+void nav::veh::UpdateReservations( nav::veh::Reservations *reservations )
+{
+	reservations->tick++;
+}
+
+
+nav::veh::Traversal * nav::veh::CreateTraversal( const nav::veh::Graph *graph )
+{
+	const size_t size = graph->num_nodes * sizeof(unsigned int);
+	Traversal *traversal = (Traversal*) ::malloc( sizeof(Traversal) + size );
+	if( !traversal ) return NULL;
+	
+	traversal->num_nodes  = graph->num_nodes;
+	traversal->generation = 0;
+	traversal->stamps     = (unsigned int*) ( traversal + 1 );
+	memset( traversal->stamps, 0, size );
+	
+	return traversal;
+}
+
+
+void nav::veh::FreeTraversal( nav::veh::Traversal *&traversal )
+{
+	::free( traversal );
+	traversal = NULL;
 }
 
 
 void nav::veh::Initialize( void )
 {
-	nav::veh::tick    = 1;
-	nav::veh::visited = 1;
+	// nothing to do, see veh::CreateReservations()
 }
 
 
 void nav::veh::Finalize( void )
 {
-	nav::veh::tick    = 0;
-	nav::veh::visited = 0;
+	// nothing to do
 }
 
 
 void nav::veh::Update( const float dt )
 {
-	nav::veh::tick++;
+	// nothing to do, each simulation advances its own veh::UpdateReservations()
 }
 
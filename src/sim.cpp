@@ -43,6 +43,7 @@
 //static const nav::ped::Graph *npg;
 
 static sim::Bus			 bus;
+static int				 bus_watch = -1;		///< Región vigilada alrededor del autobús (ver world::Watch()).
 
 
 float angleDiff( float a, float b) { // angular distance between a and b
@@ -65,6 +66,11 @@ const sim::Bus * sim::GetBus( void )	//####BUS
 	return &bus;
 }
 
+const world::WatchEvent * sim::GetBusEnvironmentEvents( int &count, bool &overflow )
+{
+	return world::WatchEvents( bus_watch, count, overflow );
+}
+
 
 #include "db_veh.hpp"	//####BUS
 
@@ -75,7 +81,14 @@ void sim::Initialize( const sim::Config &config )
 	srand(time(NULL)); //Use current time as seed for random generator
 	
 	phys::Initialize(4);
-	world::Initialize();
+	
+	world::Config world_config;		// pedestrians, cars and buses/trucks
+	world_config.num_levels   = 3;
+	world_config.cell_size[0] = 2.0f;
+	world_config.cell_size[1] = 8.0f;
+	world_config.cell_size[2] = 32.0f;
+	world::Initialize( world_config );
+	ASSERT( !config.world_stats || world::StatsOpen( config.world_stats ), "sim::Initialize: Can not create world statistics file '%s'", config.world_stats );
 	//nav::Initialize();
 	
 	phys::LoadGroundMeshBig( config.collision_mesh );
@@ -184,7 +197,9 @@ void sim::Initialize( const sim::Config &config )
 /*	(phys::UserVehicleID&)bus = phys::userveh::Create( "Vehicle Big" );*/
 /*	(phys::UserVehicleID&)bus = phys::userveh::Create( "Vehicle Tempus" );*/
 	(phys::UserVehicleID&)bus = phys::userveh::Create( "Vehicle EMT" );
-	bus.WorldUpdate( bus.px, bus.py );
+	bus.SetExtent( 0.5f * bus.length );
+	ASSERT( bus.WorldUpdate( bus.px, bus.py ), "sim::Initialize: Can not insert the bus in the world" );
+	bus_watch = world::Watch( bus.px, bus.py, sim::VEH_ENVIRONMENT_RADIUS, world::ALL_TYPES & ~world::TypeMask( sim::ent::BUS ) );
 	phys::userveh::SetPositionDirection( bus, (float3&)bus.px, (float2&)bus.dx );
 	
 //	// Save the coordinates of both paths
@@ -223,12 +238,19 @@ void sim::Finalize( void )
 //bool sim::Update( const float dt )
 bool sim::Update( const float dt)//, const safetrans_msgs::event msg )
 {	
+	world::WatchClear( bus_watch );
+	
 	phys::Update( dt );
 	//nav::Update( dt );
 	
 	//####BUS
 	phys::userveh::GetPositionDirectionOrientationSpeed( bus, (float3&)bus.px, (float2&)bus.dx, (short4&)bus.orientation[0], bus.speed );
-	bus.WorldUpdate( bus.px, bus.py );	//####BUS2
+	bus.WorldMove( bus.px, bus.py );	//####BUS2
+	
+	world::CommitUpdates();
+	world::WatchMove( bus_watch, bus.px, bus.py );	// bus environment as enter/exit deltas
+	world::Publish();	// read-only copy for visualization/sensors/output threads
+	world::StatsDump();	// only if config.world_stats
 	
 	return true;
 }
@@ -69,8 +69,9 @@ namespace sim // simulator
 
 	/// Parámetros de configuración del simulador.
 	struct Config {
-		Config() : collision_mesh(0) { }
+		Config() : collision_mesh(0), world_stats(0) { }
 		const char *collision_mesh;		///< Ruta de la malla de colisión de la escena. Formato OBJ: solo vértices y triángulos, sin uv ni normales, XYZ=(right,forward,up).
+		const char *world_stats;		///< Ruta del fichero CSV de estadísticas de la cuadricula por frame (ver world::StatsOpen()), o NULL para no generarlo.
 	};
 	
 	/// Reserva e inicializa recursos.
@@ -88,6 +89,12 @@ namespace sim // simulator
 
 	const Bus * GetBus( void );	//####BUS
 
+	/// Obtiene las entidades que han entrado o salido del entorno del autobús (sim::VEH_ENVIRONMENT_RADIUS) en el último sim::Update().
+	/// \param [out] count     Número de eventos.
+	/// \param [out] overflow  Verdadero si se han perdido eventos (ver world::WatchEvents()).
+	/// \return                Eventos en el orden en que se produjeron.
+	const world::WatchEvent * GetBusEnvironmentEvents( int &count, bool &overflow );
+
 
 } // namespace sim
 
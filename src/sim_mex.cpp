@@ -28,6 +28,7 @@ void sim_mex::Initialize( void )  //####FIXME: hardcoded stuff
 	sim::Config sim_config;
 	//sim_config.collision_mesh   = BASE"valencia_collision.obj";
  	sim_config.collision_mesh   = BASE"empty.obj";
+// 	sim_config.world_stats      = "world_stats.csv";
 // 	sim_config.nav_veh_graph	= BASE"nav_veh_graph.dat";
 // 	sim_config.nav_ped_graph	= BASE"nav_ped_graph.dat";
 // 	sim_config.nav_sem_times	= BASE"nav_sem_times.txt";
@@ -74,7 +74,7 @@ static void BuildVehicleGraph( const vis::Config &config, Ogre::SceneManager *sc
 	const float s = 0.5f;
 	const float z = 0.1f;
 	for( unsigned int i = 0; i < nvg->num_spawns; i++ ) {
-		nav::veh::Node &o = nvg->nodes[i+1];
+		const nav::veh::Node &o = nvg->nodes[i+1];
 		graph->position( o.x-s, o.y-s, o.z+z );  graph->colour( colour_magenta );
 		graph->position( o.x+s, o.y+s, o.z+z );  graph->colour( colour_magenta );
 		graph->position( o.x-s, o.y+s, o.z+z );  graph->colour( colour_magenta );
@@ -84,14 +84,14 @@ static void BuildVehicleGraph( const vis::Config &config, Ogre::SceneManager *sc
 	const Ogre::ColourValue *color1 = &colour_gray;
 	const Ogre::ColourValue *color2 = &colour_gray;
 	for( unsigned int i = 1; i < nvg->num_nodes; i++ ) {
-		nav::veh::Node &o = nvg->nodes[i];
+		const nav::veh::Node &o = nvg->nodes[i];
 		switch( o.from[0].sign ) {
 			case nav::veh::sign::SPAWN:  color1 = &colour_magenta;  break;
 			default:                     color1 = &colour_gray;     break;
 		}
 		for( int n = 0; n < 2; n++ ) {
 			if( o.next[n] ) {
-				nav::veh::Node &t = nvg->nodes[ o.next[n] ];
+				const nav::veh::Node &t = nvg->nodes[ o.next[n] ];
 				assert( i == t.prev[0] || i == t.prev[1] );
 				switch( t.from[ i == t.prev[1] ? 1 : 0 ].sign ) {
 					case nav::veh::sign::NONE:      color2 = &Ogre::ColourValue::White;   break;
@@ -130,7 +130,7 @@ static void BuildPedestrianGraph( const vis::Config &config, Ogre::SceneManager
 	const float s = 0.5f;
 	const float z = 0.1f;
 	for( unsigned int i = 0; i < npg->num_spawns; i++ ) {
-		nav::ped::Node &o = npg->nodes[i+1];
+		const nav::ped::Node &o = npg->nodes[i+1];
 		graph->position( o.x-s, o.y-s, o.z+z );  graph->colour( colour_magenta );
 		graph->position( o.x+s, o.y+s, o.z+z );  graph->colour( colour_magenta );
 		graph->position( o.x-s, o.y+s, o.z+z );  graph->colour( colour_magenta );
@@ -140,7 +140,7 @@ static void BuildPedestrianGraph( const vis::Config &config, Ogre::SceneManager
 	const Ogre::ColourValue *color1 = &colour_gray;
 	const Ogre::ColourValue *color2 = &colour_gray;
 	for( unsigned int i = 1; i < npg->num_nodes; i++ ) {
-		nav::ped::Node &o = npg->nodes[i];
+		const nav::ped::Node &o = npg->nodes[i];
 		switch( o.sign ) {
 			case nav::ped::sign::NONE:       color1 = &colour_gray;     break;
 			case nav::ped::sign::SPAWN:      color1 = &colour_magenta;  break;
@@ -149,7 +149,7 @@ static void BuildPedestrianGraph( const vis::Config &config, Ogre::SceneManager
 		}
 		for( int j = 0; j < 4; j++ ) {
 			if( o.na[j].next ) {
-				nav::ped::Node &t = npg->nodes[ o.na[j].next ];
+				const nav::ped::Node &t = npg->nodes[ o.na[j].next ];
 				assert( i == t.na[0].next || i == t.na[1].next || i == t.na[2].next || i == t.na[3].next );
 				switch( t.sign ) {
 					case nav::ped::sign::NONE:       color2 = &colour_gray;    break;
@@ -16,279 +16,2257 @@
 
 /// \file
 /// .\n
-/// Como se indica en ::world, el mundo se divide en celdas de tamaño world::CELL_SIZE. \n
-/// Las entidades se insertan/extraen en su celda correspondiente calculada en función de su posición (x,y). Ver ::CellHashPos(). \n
-/// Estas celdas en realidad son listas enlazadas. Cada entidad dispone de un puntero a la entidad siguiente (world::Entity::next) para formar esta listas. \n
-/// Las celdas se mantienen organizadas en una cuadricula dispersa formado por el mapa ::cells : \a índice_de_celda --> \a lista_de_entidades.
+/// Como se indica en ::world, el mundo se divide en celdas de tamaño world::CELL_SIZE, o en varios niveles ::grids con distintos tamaños de celda. \n
+/// Las entidades se insertan/extraen en su celda correspondiente calculada en función de su posición (x,y) y del nivel elegido según su radio. Ver ::CellHashPos() y ::LevelFor(). \n
+/// El estado de cada entidad en el mundo (posición, celda, enlaces, tipo...) se guarda en arrays contiguos (SoA) del \a pool ::pool, indexados por la parte baja de su world::Handle. \n
+/// Las celdas en realidad son listas doblemente enlazadas por índice del \a pool (Pool::next y Pool::prev), de modo que extraer una entidad de su celda tiene coste constante. \n
+/// Las entradas libres forman otra lista y al liberarse incrementan su generación, con lo que los world::Handle antiguos dejan de ser válidos. \n
+/// Las celdas de cada nivel se mantienen organizadas en una cuadricula dispersa formada por la tabla hash Grid::table : \a índice_de_celda --> \a lista_de_entidades. \n
+/// La tabla utiliza direccionamiento abierto con sondeo lineal, por lo que insertar o extraer celdas no reserva memoria (salvo al crecer la tabla). \n
+/// Opcionalmente, las celdas dentro del área densa (ver world::Config) se guardan en el array Grid::dense indexado directamente por coordenada de celda. \n
+/// Las búsquedas recorren cada nivel ocupado ampliando el área con el radio máximo de sus entidades (Grid::extent). \n
+/// Los cambios de posición diferidos (world::Entity::WorldMove()) se acumulan en ::pending y se aplican por lotes en world::CommitUpdates(). \n
+/// Cada celda mantiene una máscara de los tipos de entidad que contiene para descartar celdas completas en las búsquedas filtradas por tipo. \n
+/// Al extraer una entidad la máscara puede quedar con bits de más; estas celdas se guardan en ::dirty y su máscara se recalcula en world::CommitUpdates(). \n
+/// La cola temporal ::queue es una cola acotada multi-productor/multi-consumidor sin bloqueos: cada entrada tiene un número de secuencia que indica
+/// si está libre o llena para la vuelta actual, y productores y consumidores reservan posiciones con una operación CAS sobre ::queue_tail y ::queue_head. \n
+/// world::Publish() copia la cuadricula en una de las tres ::snapshots que no sea la última publicada ni tenga lectores; si no queda ninguna, no publica en lugar de esperar.
+/// La copia ordena las celdas por código Morton (::MortonEncode()) para que las búsquedas por área recorran memoria contigua. \n
+/// world::ForEachPair() recorre las celdas ocupadas comparando cada una con su media vecindad, reuniendo antes las celdas vecinas en ::pair_cells. \n
+/// world::NearbyQuery() recorre directamente las listas de las celdas que cruzan el círculo, sin comprobar la posición en las que quedan completamente dentro. \n
+/// world::NeighbourList guarda los world::Handle de los vecinos y solo repite la búsqueda cuando su entidad se aleja de la posición de construcción. \n
+/// Las regiones vigiladas (::watches) se comprueban en cada cambio de posición; Pool::watch indica en cuáles está cada entidad, de modo que solo se generan eventos al entrar o salir.
 
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
 #include <assert.h>
-#include <map>
+#include <atomic>
+#include <new>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "world.hpp"
 
 
-typedef std::map< unsigned int, world::Entity* > CellMap;	///< Mapa de índices a celdas.
+/// Celda de la cuadricula.
+struct Cell {
+	unsigned int	hash;	///< Índice de celda (ver ::CellHash()) o 0 si la entrada de la tabla está libre.
+	unsigned int	types;	///< Máscara de los tipos de entidad presentes en la celda (ver world::TypeMask()). Puede contener bits de más hasta el próximo world::CommitUpdates().
+	unsigned int	list;	///< Primera entidad (entrada del ::pool) de la lista enlazada de la celda o 0 si está vacía.
+};
 
-static world::Entity *queueHead;
-static world::Entity *queueTail;
+static const unsigned int TABLE_SIZE_MIN = 1024;	///< Tamaño inicial de la tabla hash. Debe ser potencia de dos.
 
-static CellMap  cells;		///< Cuadricula dispersa de celdas.
-static int		entities;	///< Número de entidades en las celdas.
+/// Nivel de la cuadricula jerárquica.
+struct Grid {
+	float			size;			///< Tamaño de las celdas.
+	float			size_inv;		///< Inversa del tamaño de las celdas.
+	float			extent;			///< Radio máximo de las entidades insertadas en el nivel desde que quedó vacío.
+	unsigned int	types;			///< Máscara de los tipos de entidad presentes en las celdas del nivel (los de Grid::type_entities no nulos).
+	int				entities;		///< Número de entidades en las celdas del nivel.
+	int				type_entities[32];	///< Número de entidades de cada tipo (índice de bit de world::TypeMask()) en las celdas del nivel.
+	unsigned int	cell_min_x;		///< Coordenada de celda X mínima ocupada desde que el nivel quedó vacío.
+	unsigned int	cell_min_y;		///< Coordenada de celda Y mínima ocupada desde que el nivel quedó vacío.
+	unsigned int	cell_max_x;		///< Coordenada de celda X máxima ocupada desde que el nivel quedó vacío.
+	unsigned int	cell_max_y;		///< Coordenada de celda Y máxima ocupada desde que el nivel quedó vacío.
 
-#define CellFromFloat( f ) ( (unsigned short) ( 0x7FFF + (f)*CELL_SIZE_INV ) )		///< Conversión de \a float a \a coordenada_de_celda.
-#define CellToFloat( c )   ( (float) ( ( (c) - 0x7FFF + 0.5f ) * CELL_SIZE ) )		///< Conversión de \a coordenada_de_celda a \a float.
+	Cell			*table;			///< Cuadricula dispersa de celdas: tabla hash con direccionamiento abierto.
+	unsigned int	table_size;		///< Número de entradas de la tabla hash (potencia de dos) o 0 si no está reservada.
+	unsigned int	table_used;		///< Número de entradas ocupadas de la tabla hash.
+
+	Cell			*dense;			///< Cuadricula densa de celdas o NULL si no se utiliza. Ver world::Config.
+	unsigned int	dense_min_x;	///< Coordenada de celda X mínima del área densa.
+	unsigned int	dense_min_y;	///< Coordenada de celda Y mínima del área densa.
+	unsigned int	dense_size_x;	///< Número de celdas en X del área densa.
+	unsigned int	dense_size_y;	///< Número de celdas en Y del área densa.
+};
+
+static const unsigned int QUEUED_BLOCK_BITS = 12;	///< Log2 del número de entradas del ::pool por bloque de Pool::queued.
+
+/// Estado de las entidades del mundo en formato SoA. La entrada 0 no se utiliza, de modo que el índice 0 indica el final de las listas.
+struct Pool {
+	unsigned int	size;		///< Capacidad de los arrays.
+	unsigned int	used;		///< Número de entradas utilizadas alguna vez (incluida la entrada 0).
+	unsigned int	free;		///< Primera entrada libre (enlazadas por Pool::next) o 0.
+	
+	float			*x;			///< Última posición X notificada.
+	float			*y;			///< Última posición Y notificada.
+	unsigned int	*cell;		///< Índice de la celda en la que está insertada o 0 si no está insertada.
+	unsigned int	*next;		///< Siguiente entidad de la celda o 0.
+	unsigned int	*prev;		///< Entidad anterior en la celda o 0 si es la primera de la lista.
+	unsigned int	*type;		///< Tipo de la entidad (ver world::Entity::GetType()).
+	float			*extent;	///< Radio de la entidad en la última actualización (ver world::Entity::SetExtent()).
+	unsigned int	*moved;		///< Posición+1 en la lista de entidades pendientes de world::CommitUpdates() o 0 si no está pendiente.
+	unsigned short	*gen;		///< Generación de la entrada, se incrementa al liberarla.
+	unsigned char	*level;		///< Nivel de la cuadricula de Pool::cell.
+	unsigned int	*watch;		///< Máscara de las regiones vigiladas (ver ::watches) que contienen la entidad.
+	/// Distinto de 0 desde que la entidad se añade a la cola temporal hasta que vuelve a notificar su posición o sale del mundo.
+	/// Lo escriben los productores de world::QueuePushBack() mientras otro hilo puede estar añadiendo entidades, así que se reserva
+	/// por bloques que no se mueven al crecer el pool en lugar de con realloc() como el resto de arrays. Ver PoolQueuedFlag().
+	std::atomic<unsigned char>	*queued[ ( 1u << world::HANDLE_INDEX_BITS ) >> QUEUED_BLOCK_BITS ];
+	world::Entity	**owner;	///< Entidad propietaria o NULL si la entrada está libre.
+};
+
+static Pool			pool;		///< Estado de las entidades del mundo.
+
+#define HandleIndex( h )  ( (h) & ( ( 1u << world::HANDLE_INDEX_BITS ) - 1 ) )		///< Entrada del ::pool de un world::Handle.
+#define HandleGen( h )    ( (h) >> world::HANDLE_INDEX_BITS )						///< Generación de un world::Handle.
+#define HandleMake( i )   ( ( (unsigned int) pool.gen[i] << world::HANDLE_INDEX_BITS ) | (i) )	///< world::Handle de la entrada \a i del ::pool.
+
+/// Indicador Pool::queued de la entrada \a i del ::pool.
+static inline std::atomic<unsigned char> & PoolQueuedFlag( const unsigned int i )
+{
+	return pool.queued[ i >> QUEUED_BLOCK_BITS ][ i & ( ( 1u << QUEUED_BLOCK_BITS ) - 1 ) ];
+}
+
+/// Indica si la entrada \a i del ::pool está en la cola temporal. Las búsquedas ignoran estas entidades aunque sigan en su celda.
+static inline bool PoolQueued( const unsigned int i )
+{
+	return PoolQueuedFlag( i ).load( std::memory_order_relaxed );
+}
+
+/// Entrada de la cola temporal de entidades.
+struct QueueSlot {
+	std::atomic<unsigned int>	seq;	///< Número de secuencia: la posición de la entrada si está libre, o la posición+1 si contiene una entidad.
+	world::Entity				*ent;	///< Entidad en la cola.
+};
+
+static QueueSlot						*queue;				///< Cola temporal de entidades: array circular con ::queue_mask+1 entradas, o NULL si no está reservada.
+static unsigned int						queue_mask;			///< Capacidad de la cola menos uno.
+alignas(64) static std::atomic<unsigned int>	queue_head;	///< Posición de la siguiente extracción.
+alignas(64) static std::atomic<unsigned int>	queue_tail;	///< Posición de la siguiente inserción.
+static unsigned int						queue_committed;	///< Posición hasta la que world::CommitUpdates() ya ha extraído las entidades de la cola del mundo.
+
+static Grid			grids[ world::MAX_LEVELS ] = {};	///< Niveles de la cuadricula, de menor a mayor tamaño de celda. Los inicializa world::Initialize().
+static int			num_levels = 1;		///< Número de niveles utilizados en ::grids.
+
+/// Entidad pendiente de cambiar de celda en world::CommitUpdates().
+struct Move {
+	unsigned int	hash;	///< Índice de la celda destino.
+	unsigned int	level;	///< Nivel de la celda destino.
+	unsigned int	ent;	///< Entidad a mover (entrada del ::pool).
+};
+
+static unsigned int		*pending;		///< Entidades (entradas del ::pool) con cambios de posición pendientes. Las entradas canceladas son 0.
+static unsigned int		pending_count;	///< Número de entradas en ::pending.
+static unsigned int		pending_size;	///< Capacidad de ::pending y de los buffers de ordenación.
+static Move				*sort_buff[2];	///< Buffers para la ordenación \a radix de world::CommitUpdates().
+
+static const unsigned int COMMIT_SORT_MIN = 256;	///< Número mínimo de cambios de celda para ordenarlos en world::CommitUpdates().
+
+static Move				*dirty[2];		///< Celdas cuya máscara de tipos hay que recalcular (y buffer para ordenarlas). Ver Cell::types.
+static unsigned int		dirty_count;	///< Número de entradas en ::dirty.
+static unsigned int		dirty_size;		///< Capacidad de ::dirty.
+
+/// Copia de la cuadricula junto a sus buffers y contador de lectores. Ver world::Publish().
+struct SnapshotBuffer {
+	world::Snapshot			snapshot;		///< Datos publicados.
+	world::SnapshotCell		*cells;			///< Buffer de celdas de todos los niveles.
+	world::SnapshotEntity	*entities;		///< Buffer de entidades.
+	unsigned int			cells_size;		///< Capacidad de SnapshotBuffer::cells.
+	unsigned int			entities_size;	///< Capacidad de SnapshotBuffer::entities.
+	std::atomic<int>		readers;		///< Número de lectores que están utilizando la copia.
+};
+
+static const int						SNAPSHOT_BUFFERS = 3;	///< Número de copias: la última publicada, la que puede retener un lector lento y la siguiente.
+static SnapshotBuffer					snapshots[ SNAPSHOT_BUFFERS ];	///< Copias de la cuadricula.
+static std::atomic<SnapshotBuffer*>	snapshot_front;			///< Última copia publicada o NULL.
+static unsigned int						snapshot_frame;			///< Número de publicaciones.
+static Move								*snapshot_sort[2];		///< Buffers para ordenar las celdas en world::Publish().
+static unsigned int						snapshot_sort_size;		///< Capacidad de ::snapshot_sort.
+
+static const Cell		**pair_cells;		///< Celdas a comparar con la celda actual en world::ForEachPair().
+static unsigned int		pair_cells_size;	///< Capacidad de ::pair_cells.
+
+/// Región vigilada. Ver world::Watch().
+struct WatchRegion {
+	float				x, y;		///< Centro.
+	float				radius;		///< Radio.
+	unsigned int		type_mask;	///< Tipos de entidad vigilados.
+	world::WatchEvent	*events;	///< Buffer de eventos.
+	int					count;		///< Número de eventos en WatchRegion::events.
+	int					size;		///< Capacidad de WatchRegion::events.
+	bool				overflow;	///< Se han descartado eventos desde el último world::WatchClear().
+};
+
+static WatchRegion		watches[ world::MAX_WATCHES ];	///< Regiones vigiladas.
+static unsigned int		watch_active;	///< Máscara de las entradas de ::watches en uso.
+static unsigned int		watch_stale;	///< Máscara de las entradas de ::watches liberadas cuyos bits en Pool::watch aún no se han borrado.
+static unsigned int		watch_types;	///< Unión de los tipos vigilados por las regiones en uso.
+
+static world::Stats			stats;				///< Contadores de world::GetStats() que sólo cambian en el hilo que actualiza el mundo. La ocupación se calcula al consultarla.
+static bool					stats_enabled;		///< Contar las búsquedas, desde world::StatsOpen() hasta world::StatsClose().
+static std::atomic<unsigned int>		stats_queries;				///< Ver world::Stats::queries. Las búsquedas pueden hacerse desde varios hilos, ver StatsAdd().
+static std::atomic<unsigned int>		stats_cells_visited;		///< Ver world::Stats::cells_visited.
+static std::atomic<unsigned int>		stats_entities_returned;	///< Ver world::Stats::entities_returned.
+static std::atomic<unsigned int>		stats_lookups;				///< Ver world::Stats::lookups.
+static std::atomic<unsigned long long>	stats_lookup_ticks;	///< Tiempo acumulado en ::CellFind() en unidades de ::StatsClock().
+static double				stats_tick_time;	///< Duración de una unidad de ::StatsClock() en segundos, o 0 si no se miden tiempos.
+static FILE					*stats_file;		///< Fichero CSV de world::StatsDump() o NULL.
+
+#define CellFromFloat( f, inv ) ( (unsigned short) ( 0x7FFF + (f)*(inv) ) )			///< Conversión de \a float a \a coordenada_de_celda, dada la inversa del tamaño de celda.
+#define CellToFloat( c, size )  ( (float) ( ( (c) - 0x7FFF + 0.5f ) * (size) ) )		///< Conversión de \a coordenada_de_celda a \a float (centro de la celda).
 #define CellHash( cx, cy ) ( (unsigned int) ( ( (cy) << 16 ) | ( (cx) << 0 ) ) )	///< Conversión de \a coordenada_de_celda (x,y) a \a índice_de_celda.
-#define CellHashPos( fx, fy )  CellHash( CellFromFloat(fx), CellFromFloat(fy) )		///< Conversión de posición de entidad (x,y) a \a índice_de_celda.
+#define CellHashPos( g, fx, fy )  CellHash( CellFromFloat( fx, (g).size_inv ), CellFromFloat( fy, (g).size_inv ) )	///< Conversión de posición de entidad (x,y) a \a índice_de_celda del nivel \a g.
+
+#define CellHashX( hash )  ( (hash) & 0xFFFF )		///< Coordenada de celda X a partir del \a índice_de_celda.
+#define CellHashY( hash )  ( (hash) >> 16 )			///< Coordenada de celda Y a partir del \a índice_de_celda.
+
+/// Código Morton (curva Z) de unas coordenadas de celda: bits de X en las posiciones pares y de Y en las impares.
+static inline unsigned int MortonEncode( unsigned int x, unsigned int y )
+{
+	x = ( x | ( x << 8 ) ) & 0x00FF00FF;
+	x = ( x | ( x << 4 ) ) & 0x0F0F0F0F;
+	x = ( x | ( x << 2 ) ) & 0x33333333;
+	x = ( x | ( x << 1 ) ) & 0x55555555;
+	y = ( y | ( y << 8 ) ) & 0x00FF00FF;
+	y = ( y | ( y << 4 ) ) & 0x0F0F0F0F;
+	y = ( y | ( y << 2 ) ) & 0x33333333;
+	y = ( y | ( y << 1 ) ) & 0x55555555;
+	return x | ( y << 1 );
+}
+
+static const unsigned int MORTON_X = 0x55555555;	///< Bits de la coordenada X en un código Morton.
+static const unsigned int MORTON_Y = 0xAAAAAAAA;	///< Bits de la coordenada Y en un código Morton.
+
+/// Indica si un código Morton está dentro del rectángulo de esquinas \a min y \a max.
+/// Los bits de cada coordenada conservan su orden, así que basta comparar cada coordenada por separado.
+#define MortonInside( code, min, max )  ( ( (code) & MORTON_X ) >= ( (min) & MORTON_X ) && ( (code) & MORTON_X ) <= ( (max) & MORTON_X ) && \
+                                          ( (code) & MORTON_Y ) >= ( (min) & MORTON_Y ) && ( (code) & MORTON_Y ) <= ( (max) & MORTON_Y ) )
+
+/// Menor código Morton mayor que \a code dentro del rectángulo de esquinas \a min y \a max (BIGMIN de Tropf y Herzog).
+/// \param [in] code  Código fuera del rectángulo, entre \a min y \a max.
+static unsigned int MortonNext( const unsigned int code, unsigned int min, unsigned int max )
+{
+	unsigned int next = 0;
+	for( int bit = 31 - __builtin_clz( min ^ max ); bit >= 0; bit-- )	// higher bits are equal in code, min and max
+	{
+		const unsigned int mask  = 1u << bit;
+		const unsigned int lower = ( mask - 1 ) & ( bit & 1 ? MORTON_Y : MORTON_X );	// lower bits of the same coordinate
+		const int c = ( code & mask ? 4 : 0 ) | ( min & mask ? 2 : 0 ) | ( max & mask ? 1 : 0 );
+		switch( c )
+		{
+			case 1:		// 0 0 1: the upper half of the range starts at min with this bit set
+				next = ( min | mask ) & ~lower;
+				max  = ( max & ~mask ) | lower;
+				break;
+			case 3:		// 0 1 1: the whole range is above code
+				return min;
+			case 4:		// 1 0 0: the whole range is below code
+				return next;
+			case 5:		// 1 0 1: code is in the upper half
+				min = ( min | mask ) & ~lower;
+				break;
+			default:	// 0 0 0, 1 1 1: same bit; 0 1 0, 1 1 0: min > max, not possible
+				assert( c == 0 || c == 7 );
+				break;
+		}
+	}
+	return next;
+}
+
+
+/// Posición ideal de un \a índice_de_celda en la tabla hash del nivel \a g (hashing multiplicativo de Fibonacci).
+#define TableSlot( g, hash )  ( ( (hash) * 2654435769u ) & ( (g).table_size - 1 ) )
+
+
+/// Reloj de bajo coste para medir ::CellFind(): contador de ciclos en x86, nanosegundos en el resto.
+static inline unsigned long long StatsClock( void )
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+
+
+/// Devuelve la celda densa de un \a índice_de_celda o NULL si está fuera del área densa.
+static inline Cell * DenseCell( const Grid &g, const unsigned int hash )
+{
+	const unsigned int x = CellHashX( hash ) - g.dense_min_x;
+	const unsigned int y = CellHashY( hash ) - g.dense_min_y;
+	if( !g.dense || x >= g.dense_size_x || y >= g.dense_size_y ) return NULL;
+	return &g.dense[ y * g.dense_size_x + x ];
+}
+
+
+/// Busca una celda ocupada, sin contabilizarlo en las estadísticas. Ver ::CellFind().
+static inline Cell * CellLookup( const Grid &g, const unsigned int hash )
+{
+	Cell *cell = DenseCell( g, hash );
+	if( cell ) return ( cell->list ? cell : NULL );
+	
+	if( !g.table_used ) return NULL;
+
+	for( unsigned int i = TableSlot( g, hash ); ; i = ( i + 1 ) & ( g.table_size - 1 ) )
+	{
+		if( g.table[i].hash == hash ) return &g.table[i];
+		if( g.table[i].hash == 0 ) return NULL;
+	}
+}
+
+
+/// Suma \a n a un contador de las búsquedas si se están tomando estadísticas. Los contadores son atómicos porque las búsquedas pueden hacerse desde varios hilos.
+static inline void StatsAdd( std::atomic<unsigned int> &counter, const unsigned int n )
+{
+	if( stats_enabled ) counter.fetch_add( n, std::memory_order_relaxed );
+}
+
+
+/// Busca una celda ocupada.
+/// \param [in] g     Nivel de la cuadricula.
+/// \param [in] hash  Índice de celda.
+/// \return           Celda ocupada o NULL si no existe.
+static inline Cell * CellFind( const Grid &g, const unsigned int hash )
+{
+	if( !stats_enabled ) return CellLookup( g, hash );
+	
+	stats_lookups.fetch_add( 1, std::memory_order_relaxed );
+	if( !stats_tick_time ) return CellLookup( g, hash );
+	
+	const unsigned long long t0 = StatsClock();
+	Cell *cell = CellLookup( g, hash );
+	stats_lookup_ticks.fetch_add( StatsClock() - t0, std::memory_order_relaxed );
+	return cell;
+}
+
+
+/// Redimensiona la tabla hash de un nivel reinsertando todas sus celdas.
+/// \param [in] g     Nivel de la cuadricula.
+/// \param [in] size  Nuevo número de entradas. Debe ser potencia de dos.
+static void TableResize( Grid &g, const unsigned int size )
+{
+	Cell *old = g.table;
+	const unsigned int old_size = g.table_size;
+	
+	g.table = (Cell*) ::calloc( size, sizeof(Cell) );
+	assert( g.table );
+	g.table_size = size;
+	
+	for( unsigned int j = 0; j < old_size; j++ )
+	{
+		if( !old[j].hash ) continue;
+		unsigned int i = TableSlot( g, old[j].hash );
+		while( g.table[i].hash ) i = ( i + 1 ) & ( g.table_size - 1 );
+		g.table[i] = old[j];
+	}
+	
+	::free( old );
+}
+
+
+/// Busca una celda y la crea si no existe.
+/// \param [in] g     Nivel de la cuadricula.
+/// \param [in] hash  Índice de celda.
+/// \return           Celda encontrada o nueva celda con la lista vacía.
+static inline Cell * CellInsert( Grid &g, const unsigned int hash )
+{
+	Cell *cell = DenseCell( g, hash );
+	if( cell ) {
+		cell->hash = hash;
+		return cell;
+	}
+
+	if( 2 * ( g.table_used + 1 ) > g.table_size )	// load factor <= 0.5
+		TableResize( g, g.table_size ? 2 * g.table_size : TABLE_SIZE_MIN );
+
+	unsigned int i = TableSlot( g, hash );
+	while( g.table[i].hash )
+	{
+		if( g.table[i].hash == hash ) return &g.table[i];
+		i = ( i + 1 ) & ( g.table_size - 1 );
+	}
+	
+	g.table_used++;
+	g.table[i].hash  = hash;
+	g.table[i].types = 0;
+	g.table[i].list  = 0;
+	return &g.table[i];
+}
+
+
+/// Elimina una celda vacía.
+/// En la tabla hash se desplazan hacia atrás las entradas siguientes del mismo grupo (\a backward-shift), evitando marcas de borrado.
+/// \param [in] g     Nivel de la cuadricula.
+/// \param [in] cell  Celda devuelta por ::CellFind() o ::CellInsert().
+static inline void CellErase( Grid &g, Cell *cell )
+{
+	if( g.dense && cell >= g.dense && cell < g.dense + g.dense_size_x * g.dense_size_y ) {
+		cell->types = 0;
+		cell->list  = 0;
+		return;
+	}
+	
+	const unsigned int mask = g.table_size - 1;
+	unsigned int i = cell - g.table;
+	unsigned int j = i;
+	while( true )
+	{
+		j = ( j + 1 ) & mask;
+		if( !g.table[j].hash ) break;
+		const unsigned int k = TableSlot( g, g.table[j].hash );
+		if( ( ( j - k ) & mask ) >= ( ( j - i ) & mask ) ) {	// ideal slot k is not in (i,j] --> move it to the hole
+			g.table[i] = g.table[j];
+			i = j;
+		}
+	}
+
+	g.table[i].hash  = 0;
+	g.table[i].types = 0;
+	g.table[i].list  = 0;
+	g.table_used--;
+}
+
+
+/// Nivel en el que se guarda una entidad: el primero cuyas celdas son al menos tan grandes como su diámetro, o el último.
+static inline int LevelFor( const float extent )
+{
+	int level = 0;
+	while( level + 1 < num_levels && grids[level].size < 2.0f * extent ) level++;
+	return level;
+}
+
+
+/// Amplía un array del ::pool a \a size elementos. Si no hay memoria suficiente lo deja como estaba.
+template < class T >
+static inline bool PoolGrow( T *&array, const unsigned int size )
+{
+	T *grown = (T*) ::realloc( (void*) array, size * sizeof(T) );
+	if( !grown ) return false;
+	array = grown;
+	return true;
+}
+
+
+/// Reserva una entrada del ::pool para una entidad que entra en el mundo.
+/// \return  Índice de la entrada, con la entidad fuera de cualquier celda, o 0 si se han agotado los índices de world::Handle (world::HANDLE_INDEX_BITS) o la memoria.
+static unsigned int PoolAlloc( world::Entity *ent )
+{
+	unsigned int i = pool.free;
+	if( i )
+	{
+		pool.free = pool.next[i];
+	}
+	else
+	{
+		if( !pool.size ) pool.used = 1;		// entry 0 is the end of the lists
+		if( pool.used >= ( 1u << world::HANDLE_INDEX_BITS ) ) return 0;	// the index would not fit in a handle
+		if( pool.used >= pool.size )
+		{
+			// arrays already grown keep their new size if another one fails, pool.size only counts when all of them succeed
+			const unsigned int size = ( pool.size ? 2 * pool.size : 1024 );
+			if( !( PoolGrow( pool.x, size ) && PoolGrow( pool.y, size ) && PoolGrow( pool.cell, size ) && PoolGrow( pool.next, size ) &&
+			       PoolGrow( pool.prev, size ) && PoolGrow( pool.type, size ) && PoolGrow( pool.extent, size ) && PoolGrow( pool.moved, size ) &&
+			       PoolGrow( pool.gen, size ) && PoolGrow( pool.level, size ) && PoolGrow( pool.watch, size ) && PoolGrow( pool.owner, size ) ) ) return 0;
+			pool.size = size;
+		}
+		
+		std::atomic<unsigned char> *&block = pool.queued[ pool.used >> QUEUED_BLOCK_BITS ];
+		if( !block ) block = new (std::nothrow) std::atomic<unsigned char>[ 1u << QUEUED_BLOCK_BITS ]();
+		if( !block ) return 0;
+		
+		i = pool.used++;
+		pool.gen[i] = 1;
+	}
+	
+	pool.x[i]      = 0.0f;
+	pool.y[i]      = 0.0f;
+	pool.cell[i]   = 0;
+	pool.next[i]   = 0;
+	pool.prev[i]   = 0;
+	pool.type[i]   = ent->GetType();
+	pool.extent[i] = ent->GetExtent();
+	pool.moved[i]  = 0;
+	pool.level[i]  = 0;
+	pool.watch[i]  = 0;
+	PoolQueuedFlag( i ).store( 0, std::memory_order_relaxed );
+	pool.owner[i]  = ent;
+	return i;
+}
+
+
+/// Libera una entrada del ::pool, que ya no debe estar en ninguna celda ni pendiente de mover.
+/// Al incrementar la generación, los world::Handle de la entrada dejan de ser válidos.
+static void PoolFree( const unsigned int i )
+{
+	assert( !pool.cell[i] && !pool.moved[i] && !pool.watch[i] );
+	pool.gen[i]   = ( pool.gen[i] + 1 ) & ( ( 1u << ( 32 - world::HANDLE_INDEX_BITS ) ) - 1 );
+	if( !pool.gen[i] ) pool.gen[i] = 1;		// generation 0 is never used, so handle 0 stays invalid
+	pool.owner[i] = NULL;
+	pool.next[i]  = pool.free;
+	pool.free     = i;
+}
+
+
+bool world::Initialize( const world::Config &config )
+{
+	world::Finalize();
+	
+	if( config.num_levels < 1 || config.num_levels > world::MAX_LEVELS ) return false;
+	for( int l = 0; l < config.num_levels; l++ )
+		if( !( config.cell_size[l] > 0.0f ) || ( l && config.cell_size[l] <= config.cell_size[l-1] ) ) return false;
+	
+	num_levels = config.num_levels;
+	for( int l = 0; l < num_levels; l++ )
+	{
+		Grid &g = grids[l];
+		g.size     = config.cell_size[l];
+		g.size_inv = 1.0f / g.size;
+		
+		TableResize( g, TABLE_SIZE_MIN );
+
+		if( config.dense_max_x > config.dense_min_x && config.dense_max_y > config.dense_min_y )
+		{
+			g.dense_min_x  = CellFromFloat( config.dense_min_x, g.size_inv );
+			g.dense_min_y  = CellFromFloat( config.dense_min_y, g.size_inv );
+			g.dense_size_x = CellFromFloat( config.dense_max_x, g.size_inv ) - g.dense_min_x + 1;
+			g.dense_size_y = CellFromFloat( config.dense_max_y, g.size_inv ) - g.dense_min_y + 1;
+			g.dense = (Cell*) ::calloc( g.dense_size_x * g.dense_size_y, sizeof(Cell) );
+			if( !g.dense ) return false;
+		}
+	}
+	
+	unsigned int queue_size = 2;
+	while( queue_size < config.queue_size ) queue_size *= 2;
+	queue = (QueueSlot*) ::calloc( queue_size, sizeof(QueueSlot) );
+	if( !queue ) return false;
+	for( unsigned int i = 0; i < queue_size; i++ )
+		queue[i].seq.store( i, std::memory_order_relaxed );
+	queue_mask = queue_size - 1;
+	queue_head = 0;
+	queue_tail = 0;
+	queue_committed = 0;
+
+	return true;
+}
+
+
+void world::Finalize( void )
+{
+	for( int l = 0; l < world::MAX_LEVELS; l++ )
+	{
+		Grid &g = grids[l];
+		::free( g.table );
+		::free( g.dense );
+		g.table = NULL;
+		g.dense = NULL;
+		g.table_size = 0;
+		g.table_used = 0;
+		g.dense_size_x = 0;
+		g.dense_size_y = 0;
+		g.extent = 0.0f;
+		g.types = 0;
+		g.entities = 0;
+		memset( g.type_entities, 0, sizeof(g.type_entities) );
+	}
+
+	// every entity still in the world leaves it, and its handle expires
+	for( unsigned int i = 1; i < pool.used; i++ )
+		if( pool.owner[i] ) pool.owner[i]->handle = 0;
+	
+	::free( pool.x );
+	::free( pool.y );
+	::free( pool.cell );
+	::free( pool.next );
+	::free( pool.prev );
+	::free( pool.type );
+	::free( pool.extent );
+	::free( pool.moved );
+	::free( pool.gen );
+	::free( pool.level );
+	::free( pool.watch );
+	for( unsigned int b = 0; b < sizeof(pool.queued) / sizeof(pool.queued[0]); b++ )
+		delete[] pool.queued[b];
+	::free( pool.owner );
+	memset( &pool, 0, sizeof(pool) );
+
+	::free( pending );
+	::free( dirty[0] );
+	::free( dirty[1] );
+	::free( sort_buff[0] );
+	::free( sort_buff[1] );
+	pending = NULL;
+	dirty[0] = NULL;
+	dirty[1] = NULL;
+	dirty_count = 0;
+	dirty_size = 0;
+	sort_buff[0] = NULL;
+	sort_buff[1] = NULL;
+	pending_count = 0;
+	pending_size = 0;
+
+	snapshot_front = NULL;
+	for( int i = 0; i < SNAPSHOT_BUFFERS; i++ )
+	{
+		assert( !snapshots[i].readers );
+		::free( snapshots[i].cells );
+		::free( snapshots[i].entities );
+		snapshots[i].cells = NULL;
+		snapshots[i].entities = NULL;
+		snapshots[i].cells_size = 0;
+		snapshots[i].entities_size = 0;
+	}
+	for( int i = 0; i < 2; i++ )
+	{
+		::free( snapshot_sort[i] );
+		snapshot_sort[i] = NULL;
+	}
+	snapshot_sort_size = 0;
+	snapshot_frame = 0;
+	
+	::free( pair_cells );
+	pair_cells = NULL;
+	pair_cells_size = 0;
+
+	for( int w = 0; w < world::MAX_WATCHES; w++ )
+		::free( watches[w].events );
+	memset( watches, 0, sizeof(watches) );
+	watch_active = 0;
+	watch_stale = 0;
+	watch_types = 0;
+
+	world::StatsClose();
+	world::StatsReset();
+	stats.frame = 0;
+
+	::free( queue );
+	queue = NULL;
+	queue_mask = 0;
+	queue_head = 0;
+	queue_tail = 0;
+	queue_committed = 0;
+}
+
+
+/// .\n
+/// Una entrada libre para la posición \a pos tiene número de secuencia \a pos. El productor que consigue avanzar ::queue_tail escribe la entidad
+/// y publica la entrada con el número de secuencia \a pos+1. \n
+/// Antes de publicarla marca la entidad en Pool::queued, de modo que desaparece de las búsquedas aunque siga en su celda hasta world::CommitUpdates().
+bool world::QueuePushBack( world::Entity *ent )
+{
+	assert( queue );
+	if( !queue ) return false;
+	
+	QueueSlot *slot;
+	unsigned int pos = queue_tail.load( std::memory_order_relaxed );
+	while( true )
+	{
+		slot = &queue[ pos & queue_mask ];
+		const int diff = (int) ( slot->seq.load( std::memory_order_acquire ) - pos );
+		if( diff == 0 ) {
+			if( queue_tail.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) break;	// slot reserved
+		} else if( diff < 0 ) {
+			return false;	// full: the slot still holds the entity of the previous lap
+		} else {
+			pos = queue_tail.load( std::memory_order_relaxed );		// another producer took it
+		}
+	}
+	
+	const world::Handle handle = ent->GetHandle();
+	if( handle ) PoolQueuedFlag( HandleIndex( handle ) ).store( 1, std::memory_order_relaxed );
+	
+	slot->ent = ent;
+	slot->seq.store( pos + 1, std::memory_order_release );
+	return true;
+}
+
+	
+/// .\n
+/// El consumidor que consigue avanzar ::queue_head lee la entidad y libera la entrada para la siguiente vuelta con el número de secuencia \a pos+capacidad.
+world::Entity * world::QueuePopFront( void )
+{
+	if( !queue ) return NULL;
+	
+	QueueSlot *slot;
+	unsigned int pos = queue_head.load( std::memory_order_relaxed );
+	while( true )
+	{
+		slot = &queue[ pos & queue_mask ];
+		const int diff = (int) ( slot->seq.load( std::memory_order_acquire ) - ( pos + 1 ) );
+		if( diff == 0 ) {
+			if( queue_head.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) break;	// slot reserved
+		} else if( diff < 0 ) {
+			return NULL;	// empty
+		} else {
+			pos = queue_head.load( std::memory_order_relaxed );		// another consumer took it
+		}
+	}
+	
+	world::Entity *ent = slot->ent;
+	slot->seq.store( pos + queue_mask + 1, std::memory_order_release );
+	return ent;
+}
+
+	
+	
+/// Marca la máscara de tipos de una celda para recalcularla en world::CommitUpdates().
+static void CellDirty( const unsigned int level, const unsigned int hash )
+{
+	if( dirty_count == dirty_size )
+	{
+		dirty_size = ( dirty_size ? 2 * dirty_size : 1024 );
+		dirty[0] = (Move*) ::realloc( dirty[0], dirty_size * sizeof(Move) );
+		dirty[1] = (Move*) ::realloc( dirty[1], dirty_size * sizeof(Move) );
+		assert( dirty[0] && dirty[1] );
+	}
+	dirty[0][ dirty_count ].hash  = hash;
+	dirty[0][ dirty_count ].level = level;
+	dirty[0][ dirty_count ].ent   = 0;
+	dirty_count++;
+}
+
+
+/// Contabiliza una entidad (entrada del ::pool) insertada en un nivel, ya enlazada en su celda Pool::cell.
+static inline void GridAdd( Grid &g, const unsigned int i )
+{
+	const unsigned int cx = CellHashX( pool.cell[i] );
+	const unsigned int cy = CellHashY( pool.cell[i] );
+	if( g.entities++ == 0 ) {
+		g.cell_min_x = g.cell_max_x = cx;
+		g.cell_min_y = g.cell_max_y = cy;
+	} else {
+		if( cx < g.cell_min_x ) g.cell_min_x = cx;
+		if( cx > g.cell_max_x ) g.cell_max_x = cx;
+		if( cy < g.cell_min_y ) g.cell_min_y = cy;
+		if( cy > g.cell_max_y ) g.cell_max_y = cy;
+	}
+	g.type_entities[ pool.type[i] & 31 ]++;
+	g.types |= world::TypeMask( pool.type[i] );
+	if( pool.extent[i] > g.extent ) g.extent = pool.extent[i];
+}
+
+
+/// Número de entidades de los tipos \a type_mask en las celdas de un nivel.
+static inline int GridCount( const Grid &g, const unsigned int type_mask )
+{
+	if( ( g.types & type_mask ) == g.types ) return g.entities;
+	int count = 0;
+	for( unsigned int bits = g.types & type_mask; bits; bits &= bits - 1 )
+		count += g.type_entities[ __builtin_ctz( bits ) ];
+	return count;
+}
+
+
+/// Inserta una entidad (entrada del ::pool) al principio de la lista de una celda.
+static inline void CellLink( Cell *cell, const unsigned int i )
+{
+	pool.prev[i] = 0;
+	pool.next[i] = cell->list;
+	if( cell->list ) pool.prev[ cell->list ] = i;
+	cell->list = i;
+	cell->types |= world::TypeMask( pool.type[i] );
+}
+
+
+/// Extrae una entidad (entrada del ::pool) de su celda y cancela su cambio de posición pendiente.
+static void CellUnlink( const unsigned int i )
+{
+	if( pool.moved[i] )	// cancel pending move
+	{
+		pending[ pool.moved[i] - 1 ] = 0;
+		pool.moved[i] = 0;
+	}
+	
+	if( !pool.cell[i] ) return;
+	
+	const unsigned int level = pool.level[i];
+	const unsigned int next  = pool.next[i];
+	const unsigned int prev  = pool.prev[i];
+	Grid &g = grids[ level ];
+	Cell *cell = CellFind( g, pool.cell[i] );
+	assert( cell && ( prev || cell->list == i ) );
+
+	if( prev )
+	{
+		assert( pool.next[ prev ] == i );
+		pool.next[ prev ] = next;
+	}
+	else if( next )		// first entity of the list, update the cell
+	{
+		cell->list = next;
+	}
+	else
+	{
+		CellErase( g, cell );
+		cell = NULL;
+	}
+
+	// if the cell only had entities of this type the mask is still exact, otherwise it may have an extra bit now
+	if( cell && cell->types != world::TypeMask( pool.type[i] ) )
+		CellDirty( level, cell->hash );
+	
+	if( next )
+	{
+		assert( pool.prev[ next ] == i );
+		pool.prev[ next ] = prev;
+	}
+	
+	assert( g.entities > 0 && g.type_entities[ pool.type[i] & 31 ] > 0 );
+	if( --g.type_entities[ pool.type[i] & 31 ] == 0 )	// last entity of its type, queries for it skip the level
+		g.types &= ~world::TypeMask( pool.type[i] );
+	if( --g.entities == 0 ) {	// empty level, reset its bounds
+		assert( g.types == 0 );
+		g.extent = 0.0f;
+	}
+
+	pool.cell[i] = 0;
+	pool.next[i] = 0;
+	pool.prev[i] = 0;
+}
+
+
+/// Añade un evento al buffer de una región vigilada.
+static inline void WatchPush( WatchRegion &r, const unsigned int i, const bool enter )
+{
+	if( r.count == r.size ) {
+		r.overflow = true;
+		return;
+	}
+	world::WatchEvent &event = r.events[ r.count++ ];
+	event.ent    = pool.owner[i];
+	event.handle = HandleMake( i );
+	event.enter  = enter;
+}
+
+
+/// Comprueba si una entidad (entrada del ::pool) ha entrado o salido de una región vigilada.
+static inline void WatchTest( const int w, const unsigned int i )
+{
+	WatchRegion &r = watches[w];
+	if( !( world::TypeMask( pool.type[i] ) & r.type_mask ) ) return;
+	
+	const float dx = pool.x[i] - r.x;
+	const float dy = pool.y[i] - r.y;
+	const bool inside = ( dx*dx + dy*dy <= r.radius * r.radius && !PoolQueued( i ) );	// queued entities have already left
+	if( inside != (bool) ( pool.watch[i] & ( 1u << w ) ) )
+	{
+		pool.watch[i] ^= 1u << w;
+		WatchPush( r, i, inside );
+	}
+}
+
+
+/// Comprueba la entidad (entrada del ::pool) en todas las regiones vigiladas, tras cambiar su posición.
+static inline void WatchUpdate( const unsigned int i )
+{
+	if( !( watch_types & world::TypeMask( pool.type[i] ) ) ) return;
+	for( unsigned int bits = watch_active; bits; bits &= bits - 1 )
+		WatchTest( __builtin_ctz( bits ), i );
+}
+
+
+bool world::Entity::WorldUpdate( const float x, const float y )
+{
+	unsigned int i;
+	if( this->handle ) {
+		i = HandleIndex( this->handle );
+	} else {
+		i = PoolAlloc( this );
+		if( !i ) return false;
+		this->handle = HandleMake( i );
+	}
+	
+	PoolQueuedFlag( i ).store( 0, std::memory_order_relaxed );
+	pool.extent[i] = this->extent;
+	pool.x[i] = x;
+	pool.y[i] = y;
+
+	const int level = LevelFor( this->extent );
+	Grid &g = grids[ level ];
+	const unsigned int hash = CellHashPos( g, x, y );
+	
+	if( hash != pool.cell[i] || level != pool.level[i] )
+	{
+		stats.migrations++;
+		CellUnlink( i );
+
+		Cell *cell = CellInsert( g, hash );
+		pool.cell[i]  = hash;
+		pool.level[i] = level;
+		CellLink( cell, i );
+		GridAdd( g, i );
+	}
+	
+	WatchUpdate( i );
+	return true;
+}
+
+
+bool world::Entity::WorldMove( const float x, const float y )
+{
+	unsigned int i;
+	if( this->handle ) {
+		i = HandleIndex( this->handle );
+	} else {
+		i = PoolAlloc( this );
+		if( !i ) return false;
+		this->handle = HandleMake( i );
+	}
+	
+	PoolQueuedFlag( i ).store( 0, std::memory_order_relaxed );
+	pool.extent[i] = this->extent;
+	pool.x[i] = x;
+	pool.y[i] = y;
+	
+	WatchUpdate( i );
+	
+	if( pool.moved[i] ) return true;	// already pending
+	
+	const int level = LevelFor( this->extent );
+	if( CellHashPos( grids[ level ], x, y ) == pool.cell[i] && level == pool.level[i] ) return true;
+	
+	if( pending_count == pending_size )
+	{
+		pending_size = ( pending_size ? 2 * pending_size : 1024 );
+		pending = (unsigned int*) ::realloc( pending, pending_size * sizeof(unsigned int) );
+		sort_buff[0] = (Move*) ::realloc( sort_buff[0], pending_size * sizeof(Move) );
+		sort_buff[1] = (Move*) ::realloc( sort_buff[1], pending_size * sizeof(Move) );
+		assert( pending && sort_buff[0] && sort_buff[1] );
+	}
+	
+	pending[ pending_count++ ] = i;
+	pool.moved[i] = pending_count;
+	return true;
+}
+
+
+void world::Entity::WorldDelete( void )
+{
+	if( !this->handle ) return;
+	
+	const unsigned int i = HandleIndex( this->handle );
+	assert( pool.owner[i] == this );
+	
+	CellUnlink( i );
+	
+	for( unsigned int bits = pool.watch[i] & watch_active; bits; bits &= bits - 1 )	// leave the watched regions
+		WatchPush( watches[ __builtin_ctz( bits ) ], i, false );
+	pool.watch[i] = 0;
+	
+	PoolFree( i );
+	this->handle = 0;
+}
+
+
+bool world::Entity::WorldInserted( void ) const
+{
+	return this->handle && pool.cell[ HandleIndex( this->handle ) ];
+}
+
+
+world::Entity* world::Resolve( const world::Handle handle )
+{
+	const unsigned int i = HandleIndex( handle );
+	if( !i || i >= pool.used || pool.gen[i] != HandleGen( handle ) ) return NULL;
+	return pool.owner[i];
+}
+
+
+bool world::GetPosition( const world::Handle handle, float &x, float &y )
+{
+	const unsigned int i = HandleIndex( handle );
+	if( !i || i >= pool.used || pool.gen[i] != HandleGen( handle ) ) return false;
+	x = pool.x[i];
+	y = pool.y[i];
+	return true;
+}
+
+
+
+/// Ordenación \a radix (LSD, dígitos de 8 bits) por nivel e índice de celda.
+/// Los dígitos iguales en todas las entradas (habitual en los bits altos de las coordenadas y en el nivel) no necesitan pasada.
+/// \param [in] n     Número de entradas.
+/// \param [in] src   Entradas a ordenar.
+/// \param [in] tmp   Buffer temporal del mismo tamaño.
+/// \return           Puntero a las entradas ordenadas, \a src o \a tmp.
+static Move * RadixSort( const unsigned int n, Move *src, Move *tmp )
+{
+	unsigned int count[5][256];
+	memset( count, 0, sizeof(count) );
+	
+	if( !n ) return src;
+	
+	for( unsigned int i = 0; i < n; i++ ) {
+		const unsigned int h = src[i].hash;
+		count[0][ ( h >>  0 ) & 0xFF ]++;
+		count[1][ ( h >>  8 ) & 0xFF ]++;
+		count[2][ ( h >> 16 ) & 0xFF ]++;
+		count[3][ ( h >> 24 ) & 0xFF ]++;
+		count[4][ src[i].level ]++;
+	}
+	
+	#define RadixDigit( m, d )  ( (d) < 4 ? ( (m).hash >> ( 8 * (d) ) ) & 0xFF : (m).level )
+	
+	for( int d = 0; d < 5; d++ )
+	{
+		if( count[d][ RadixDigit( src[0], d ) ] == n ) continue;	// same digit for all entries
+
+		unsigned int offset = 0;
+		for( int b = 0; b < 256; b++ ) {
+			const unsigned int c = count[d][b];
+			count[d][b] = offset;
+			offset += c;
+		}
+		
+		for( unsigned int i = 0; i < n; i++ )
+			tmp[ count[d][ RadixDigit( src[i], d ) ]++ ] = src[i];
+
+		Move *swap = src;
+		src = tmp;
+		tmp = swap;
+	}
+	
+	#undef RadixDigit
+	
+	return src;
+}
+
+
+void world::CommitUpdates( void )
+{
+	// remove from the grid the entities queued since the last commit and still in the queue
+	if( queue )
+	{
+		const unsigned int head = queue_head.load( std::memory_order_acquire );
+		const unsigned int tail = queue_tail.load( std::memory_order_acquire );
+		if( (int) ( queue_committed - head ) < 0 ) queue_committed = head;
+		for( ; queue_committed != tail; queue_committed++ )
+		{
+			const QueueSlot &slot = queue[ queue_committed & queue_mask ];
+			if( slot.seq.load( std::memory_order_acquire ) != queue_committed + 1 ) break;	// reserved but not written yet, left for the next commit
+			if( slot.ent->GetHandle() ) slot.ent->WorldDelete();
+		}
+	}
+	
+	unsigned int n = 0, table_moves = 0;
+	for( unsigned int i = 0; i < pending_count; i++ )
+	{
+		const unsigned int ent = pending[i];
+		if( !ent ) continue;
+		pool.moved[ent] = 0;
+
+		const int level = LevelFor( pool.extent[ent] );
+		const unsigned int hash = CellHashPos( grids[level], pool.x[ent], pool.y[ent] );
+		if( hash == pool.cell[ent] && level == pool.level[ent] ) continue;	// back to its current cell
+		
+		sort_buff[0][n].hash  = hash;
+		sort_buff[0][n].level = level;
+		sort_buff[0][n].ent   = ent;
+		n++;
+		if( !DenseCell( grids[level], hash ) ) table_moves++;
+	}
+	pending_count = 0;
+	stats.migrations += n;
+	
+	// sorting only pays off when several entities move to the same cell of the hash tables (crowds),
+	// otherwise each one is relinked in order, like Entity::WorldUpdate() does
+	unsigned int table_cells = 0;
+	for( int l = 0; l < num_levels; l++ )
+		table_cells += grids[l].table_used;
+	const Move *sorted = ( table_moves >= COMMIT_SORT_MIN && table_moves >= table_cells ? RadixSort( n, sort_buff[0], sort_buff[1] ) : sort_buff[0] );
+	
+	for( unsigned int i = 0, j; i < n; i = j )
+	{
+		const unsigned int hash  = sorted[i].hash;
+		const unsigned int level = sorted[i].level;
+		for( j = i; j < n && sorted[j].hash == hash && sorted[j].level == level; j++ )
+			CellUnlink( sorted[j].ent );
+
+		// splice the whole group [i,j) at the head of the destination cell
+		Grid &g = grids[ level ];
+		Cell *cell = CellInsert( g, hash );
+		const unsigned int head = cell->list;
+		for( unsigned int k = i; k < j; k++ )
+		{
+			const unsigned int ent = sorted[k].ent;
+			pool.cell[ent]  = hash;
+			pool.level[ent] = level;
+			pool.prev[ent]  = ( k > i     ? sorted[k-1].ent : 0 );
+			pool.next[ent]  = ( k + 1 < j ? sorted[k+1].ent : head );
+			cell->types |= world::TypeMask( pool.type[ent] );
+			GridAdd( g, ent );
+		}
+		if( head ) pool.prev[head] = sorted[j-1].ent;
+		cell->list = sorted[i].ent;
+	}
+	
+	// rebuild the type masks of the cells marked by CellDirty()
+	sorted = RadixSort( dirty_count, dirty[0], dirty[1] );
+	for( unsigned int i = 0; i < dirty_count; i++ )
+	{
+		if( i && sorted[i].hash == sorted[i-1].hash && sorted[i].level == sorted[i-1].level ) continue;		// already rebuilt
+		
+		Cell *cell = CellFind( grids[ sorted[i].level ], sorted[i].hash );
+		if( !cell ) continue;	// erased after being marked
+		
+		unsigned int types = 0;
+		for( unsigned int ent = cell->list; ent; ent = pool.next[ent] )
+			types |= world::TypeMask( pool.type[ent] );
+		cell->types = types;
+	}
+	dirty_count = 0;
+}
+
+
+
+bool world::Publish( void )
+{
+	// any copy but the front one without readers; a reader that bumps its counter now sees a new front on its recheck and leaves it
+	SnapshotBuffer *front = snapshot_front;
+	SnapshotBuffer *back = NULL;
+	for( int i = 0; i < SNAPSHOT_BUFFERS && !back; i++ )
+		if( &snapshots[i] != front && !snapshots[i].readers ) back = &snapshots[i];
+	if( !back ) return false;	// every other copy is still held: keep the last one published
+	
+	unsigned int total_cells = 0;
+	for( int l = 0; l < num_levels; l++ )
+		total_cells += grids[l].table_used + ( grids[l].dense ? grids[l].dense_size_x * grids[l].dense_size_y : 0 );
+	
+	if( snapshot_sort_size < total_cells )
+	{
+		snapshot_sort_size = total_cells;
+		snapshot_sort[0] = (Move*) ::realloc( snapshot_sort[0], snapshot_sort_size * sizeof(Move) );
+		snapshot_sort[1] = (Move*) ::realloc( snapshot_sort[1], snapshot_sort_size * sizeof(Move) );
+		assert( snapshot_sort[0] && snapshot_sort[1] );
+	}
+	
+	// collect occupied cells of all levels and sort them by level and Morton code
+	unsigned int n = 0;
+	for( int l = 0; l < num_levels; l++ )
+	{
+		const Grid &g = grids[l];
+		const unsigned int dense_size = ( g.dense ? g.dense_size_x * g.dense_size_y : 0 );
+		for( unsigned int i = 0; i < g.table_size + dense_size; i++ )
+		{
+			const Cell &cell = ( i < g.table_size ? g.table[i] : g.dense[ i - g.table_size ] );
+			if( !cell.list ) continue;
+			snapshot_sort[0][n].hash  = MortonEncode( CellHashX( cell.hash ), CellHashY( cell.hash ) );
+			snapshot_sort[0][n].level = l;
+			snapshot_sort[0][n].ent   = cell.list;
+			n++;
+		}
+	}
+	
+	const Move *sorted = RadixSort( n, snapshot_sort[0], snapshot_sort[1] );
+	
+	// copy cells and entities, each level followed by its end cell
+	if( back->cells_size < n + num_levels )
+	{
+		back->cells_size = n + num_levels;
+		back->cells = (world::SnapshotCell*) ::realloc( back->cells, back->cells_size * sizeof(world::SnapshotCell) );
+		assert( back->cells );
+	}
+	
+	unsigned int num_entities = 0;
+	world::SnapshotCell *cells = back->cells;
+	for( int l = 0, i = 0; l < num_levels; l++ )
+	{
+		world::SnapshotLevel &level = back->snapshot.levels[l];
+		level.cell_size = grids[l].size;
+		level.extent    = grids[l].extent;
+		level.cells     = cells;
+		
+		unsigned int c = 0;
+		for( ; i < (int)n && sorted[i].level == (unsigned int)l; i++, c++ )
+		{
+			cells[c].code  = sorted[i].hash;
+			cells[c].begin = num_entities;
+			cells[c].types = 0;
+			
+			for( unsigned int ent = sorted[i].ent; ent; ent = pool.next[ent] )
+			{
+				if( PoolQueued( ent ) ) continue;
+				if( num_entities == back->entities_size )
+				{
+					back->entities_size = ( back->entities_size ? 2 * back->entities_size : 1024 );
+					back->entities = (world::SnapshotEntity*) ::realloc( back->entities, back->entities_size * sizeof(world::SnapshotEntity) );
+					assert( back->entities );
+				}
+				
+				world::SnapshotEntity &snap = back->entities[ num_entities++ ];
+				snap.ent    = pool.owner[ent];
+				snap.handle = HandleMake( ent );
+				snap.type   = pool.type[ent];
+				snap.x      = pool.x[ent];
+				snap.y      = pool.y[ent];
+				cells[c].types |= world::TypeMask( pool.type[ent] );
+			}
+		}
+		cells[c].code  = 0xFFFFFFFF;
+		cells[c].begin = num_entities;
+		cells[c].types = 0;
+		
+		level.num_cells = c;
+		cells += c + 1;
+	}
+	
+	back->snapshot.frame        = ++snapshot_frame;
+	back->snapshot.num_levels   = num_levels;
+	back->snapshot.num_entities = num_entities;
+	back->snapshot.entities     = back->entities;
+	
+	snapshot_front = back;
+	return true;
+}
+
+
+const world::Snapshot * world::SnapshotAcquire( void )
+{
+	while( true )
+	{
+		SnapshotBuffer *front = snapshot_front;
+		if( !front ) return NULL;
+		
+		front->readers++;
+		if( front == snapshot_front ) return &front->snapshot;	// still the last published: safe to read
+		front->readers--;
+	}
+}
+
+
+void world::SnapshotRelease( const world::Snapshot *snapshot )
+{
+	if( !snapshot ) return;
+	
+	SnapshotBuffer *buff = NULL;
+	for( int i = 0; i < SNAPSHOT_BUFFERS; i++ )
+		if( snapshot == &snapshots[i].snapshot ) buff = &snapshots[i];
+	assert( buff && buff->readers > 0 );
+	buff->readers--;
+}
+
+
+/// Busca la primera celda de un nivel de una copia con código Morton mayor o igual a \a code, a partir de la celda \a lo.
+/// Avanza primero en saltos crecientes, ya que la celda buscada suele estar cerca.
+static unsigned int SnapshotLowerBound( const world::SnapshotLevel &level, const unsigned int code, unsigned int lo = 0 )
+{
+	unsigned int hi = level.num_cells;
+	unsigned int step = 1;
+	while( lo + step < hi && level.cells[ lo + step ].code < code )
+	{
+		lo += step;
+		step *= 2;
+	}
+	if( lo + step < hi ) hi = lo + step;
+	
+	while( lo < hi )
+	{
+		const unsigned int mid = ( lo + hi ) >> 1;
+		if( level.cells[mid].code < code ) lo = mid + 1;
+		else                               hi = mid;
+	}
+	return lo;
+}
+
+
+world::SnapshotIterator::SnapshotIterator( const world::Snapshot *snapshot, const float pos_x, const float pos_y, const float radius, const unsigned int type_mask )
+	: snapshot(snapshot), type_mask(type_mask)
+{
+	this->box_min_x = pos_x - radius;
+	this->box_min_y = pos_y - radius;
+	this->box_max_x = pos_x + radius;
+	this->box_max_y = pos_y + radius;
+
+	this->Reset();
+}
+
+
+world::SnapshotIterator::SnapshotIterator( const world::Snapshot *snapshot, const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask )
+	: snapshot(snapshot), type_mask(type_mask)
+{
+	this->box_min_x = box_min_x;
+	this->box_min_y = box_min_y;
+	this->box_max_x = box_max_x;
+	this->box_max_y = box_max_y;
+
+	this->Reset();
+}
+
+
+void world::SnapshotIterator::Reset( void )
+{
+	this->level = -1;
+	this->ent = 0;
+	this->ent_end = 0;
+	this->BeginLevel();
+}
+
+
+bool world::SnapshotIterator::BeginLevel( void )
+{
+	const int num_levels = ( this->snapshot ? this->snapshot->num_levels : 0 );
+	while( ++this->level < num_levels )
+	{
+		const world::SnapshotLevel &level = this->snapshot->levels[ this->level ];
+		if( !level.num_cells ) continue;
+		
+		const float inv = 1.0f / level.cell_size;
+		this->code_min = MortonEncode( CellFromFloat( this->box_min_x - level.extent, inv ), CellFromFloat( this->box_min_y - level.extent, inv ) );
+		this->code_max = MortonEncode( CellFromFloat( this->box_max_x + level.extent, inv ), CellFromFloat( this->box_max_y + level.extent, inv ) );
+		this->cell = SnapshotLowerBound( level, this->code_min );
+		return true;
+	}
+	
+	this->level = num_levels;
+	return false;
+}
+
+
+const world::SnapshotEntity * world::SnapshotIterator::Next( void )
+{
+	const world::Snapshot *snapshot = this->snapshot;
+	if( !snapshot ) return NULL;
+	
+	while( true )
+	{
+		while( this->ent < this->ent_end && !( world::TypeMask( snapshot->entities[ this->ent ].type ) & this->type_mask ) )
+			this->ent++;
+		if( this->ent < this->ent_end ) break;
+		
+		if( this->level >= snapshot->num_levels ) return NULL;
+		const world::SnapshotLevel &level = snapshot->levels[ this->level ];
+		
+		// scan the Morton range sequentially, jumping over the parts outside the area
+		const world::SnapshotCell *cell = &level.cells[ this->cell ];
+		if( this->cell >= level.num_cells || cell->code > this->code_max )
+		{
+			this->BeginLevel();
+		}
+		else if( MortonInside( cell->code, this->code_min, this->code_max ) )
+		{
+			const bool any = ( cell->types & this->type_mask );
+			this->ent     = cell->begin;
+			this->ent_end = ( any ? cell[1].begin : this->ent );
+			this->cell++;
+		}
+		else
+		{
+			this->cell = SnapshotLowerBound( level, MortonNext( cell->code, this->code_min, this->code_max ), this->cell + 1 );
+		}
+	}
+	
+	return &snapshot->entities[ this->ent++ ];
+}
 
 
 
-bool world::Initialize( void )
+world::NearbyIterator::NearbyIterator( const float pos_x, const float pos_y, const float radius, const unsigned int type_mask )
+	: type_mask(type_mask)
 {
-	world::Finalize();
-	return true;
+	this->box_min_x = pos_x - radius;
+	this->box_min_y = pos_y - radius;
+	this->box_max_x = pos_x + radius;
+	this->box_max_y = pos_y + radius;
+
+	this->Reset();
+}
+
+		
+world::NearbyIterator::NearbyIterator( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask )
+	: type_mask(type_mask)
+{
+	this->box_min_x = box_min_x;
+	this->box_min_y = box_min_y;
+	this->box_max_x = box_max_x;
+	this->box_max_y = box_max_y;
+	
+	this->Reset();
 }
 
 
-void world::Finalize( void )
+void world::NearbyIterator::Reset( void )
+{
+	this->level = -1;
+	this->cells = 0;
+	this->ent = 0;
+	this->BeginLevel();
+	StatsAdd( stats_queries, 1 );
+}
+
+
+bool world::NearbyIterator::BeginLevel( void )
 {
-	for( CellMap::iterator it = cells.begin(); it != cells.end(); ++it )
+	while( ++this->level < num_levels )
 	{
-		world::Entity *ent, *next = it->second;
-		while( next )
-		{
-			ent  = next;
-			next = ent->next;
-			
-			ent->cell_x = 0;
-			ent->cell_y = 0;
-			ent->next   = NULL;
-		}
+		const Grid &g = grids[ this->level ];
+		if( !g.entities || !( g.types & this->type_mask ) ) continue;	// nothing to find in this level
+		
+		this->cell_min_x = CellFromFloat( this->box_min_x - g.extent, g.size_inv );
+		this->cell_min_y = CellFromFloat( this->box_min_y - g.extent, g.size_inv );
+		this->cell_max_x = CellFromFloat( this->box_max_x + g.extent, g.size_inv );
+		this->cell_max_y = CellFromFloat( this->box_max_y + g.extent, g.size_inv );
+		this->cell_cur_x = this->cell_min_x - 1;
+		this->cell_cur_y = this->cell_min_y;
+		return true;
 	}
+	
+	this->level = num_levels;
+	this->cell_cur_x = this->cell_max_x = 0;
+	this->cell_cur_y = this->cell_max_y = 0;
+	return false;
+}
+
 
-	world::Entity *ent;
-	while( queueHead )
+bool world::NearbyIterator::NextCell( void )
+{
+	while( true )
 	{
-		ent       = queueHead;
-		queueHead = ent->next;
+		if( this->cell_cur_x < this->cell_max_x )
+		{
+			this->cell_cur_x++;
+		}
+		else if( this->cell_cur_y < this->cell_max_y )
+		{
+			this->cell_cur_x = this->cell_min_x;
+			this->cell_cur_y++;
+		}
+		else if( this->BeginLevel() )
+		{
+			continue;
+		}
+		else
+		{
+			return false;
+		}
 		
-		ent->cell_x = 0;
-		ent->cell_y = 0;
-		ent->next   = NULL;
+		const Cell *cell = CellFind( grids[ this->level ], CellHash( this->cell_cur_x, this->cell_cur_y ) );
+		this->ent = ( cell && ( cell->types & this->type_mask ) ? cell->list : 0 );
+		this->cells++;
+		StatsAdd( stats_cells_visited, 1 );
+		return true;
 	}
+}
+
+
+world::Entity * world::NearbyIterator::Next( void )
+{
+	if( this->ent ) this->ent = pool.next[ this->ent ];
 	
-	cells.clear();
-	entities = 0;
+	while( true )
+	{
+		while( this->ent && ( !( world::TypeMask( pool.type[ this->ent ] ) & this->type_mask ) || PoolQueued( this->ent ) ) )
+			this->ent = pool.next[ this->ent ];
+		if( this->ent || !this->NextCell() ) break;
+	}
 
-	queueHead = NULL;
-	queueTail = NULL;
+	if( !this->ent ) return NULL;
+	StatsAdd( stats_entities_returned, 1 );
+	return pool.owner[ this->ent ];
 }
 
 
-void world::QueuePushBack( world::Entity *ent )
+/// .\n
+/// Llamando \a u al eje principal (el de mayor componente de la dirección) y \a v al secundario, todo punto del pasillo está a una distancia menor
+/// que \a radius de la recta del segmento, es decir, a menos de \a radius*sqrt(1+slope^2) medido sobre el eje \a v, y su coordenada \a u está entre \a u0-radius y \a u1+radius. \n
+/// Por tanto, en cada columna basta con recorrer las filas entre el mínimo y el máximo de la recta dentro de la columna ensanchados por esa distancia. \n
+/// En cada nivel el radio del pasillo se amplía con el radio máximo de sus entidades.
+world::NearbyRayIterator::NearbyRayIterator( const float px, const float py, const float dx, const float dy, const float radius, const float distance, const unsigned int type_mask )
+	: type_mask(type_mask)
 {
-	assert( (bool)queueHead == (bool)queueTail );
+	const float len = sqrtf( dx*dx + dy*dy );
+	const float nx  = ( len > 0.0f ? dx / len : 1.0f );
+	const float ny  = ( len > 0.0f ? dy / len : 0.0f );
 	
-	if( ent->cell_x | ent->cell_y ) ent->WorldDelete();
+	this->swap = ( fabsf( ny ) > fabsf( nx ) );
 	
-	if( queueHead )
-	{
-		queueTail->next = ent;
-		queueTail = ent;
-	}
-	else
-	{
-		queueHead = ent;
-		queueTail = ent;
+	const float du = ( this->swap ? ny : nx );
+	const float dv = ( this->swap ? nx : ny );
+	float u0 = ( this->swap ? py : px );
+	float v0 = ( this->swap ? px : py );
+	float u1 = u0 + du * distance;
+	
+	if( u1 < u0 ) {		// always walk the columns in increasing order
+		const float v1 = v0 + dv * distance;
+		u1 = u0;
+		u0 = u0 + du * distance;
+		v0 = v1;
 	}
+	
+	this->u0     = u0;
+	this->v0     = v0;
+	this->u1     = u1;
+	this->slope  = dv / du;
+	this->radius = radius;
+	
+	this->Reset();
 }
 
-	
-world::Entity * world::QueuePopFront( void )
+
+void world::NearbyRayIterator::Reset( void )
 {
-	assert( (bool)queueHead == (bool)queueTail );
+	this->level = -1;
+	this->cells = 0;
+	this->ent = 0;
+	this->BeginLevel();
+}
+
 
-	Entity *ent = queueHead;
-	if( queueHead == queueTail )
+bool world::NearbyRayIterator::BeginLevel( void )
+{
+	while( ++this->level < num_levels )
 	{
-		if( !ent ) return NULL;
-		queueHead = NULL;
-		queueTail = NULL;
+		const Grid &g = grids[ this->level ];
+		if( !g.entities || !( g.types & this->type_mask ) ) continue;	// nothing to find in this level
+		
+		this->level_radius = this->radius + g.extent;
+		this->width   = this->level_radius * sqrtf( 1.0f + this->slope * this->slope );
+		this->col_min = CellFromFloat( this->u0 - this->level_radius, g.size_inv );
+		this->col_max = CellFromFloat( this->u1 + this->level_radius, g.size_inv );
+		this->col_cur = this->col_min;
+		this->BeginColumn();
+		return true;
 	}
-	else
+	
+	this->level = num_levels;
+	this->col_cur = this->col_max = 0;
+	this->row_cur = 1;
+	this->row_max = 0;
+	return false;
+}
+
+
+void world::NearbyRayIterator::BeginColumn( void )
+{
+	const Grid &g = grids[ this->level ];
+	
+	// column span on the main axis, clipped to the segment extended by the radius
+	float a = CellToFloat( this->col_cur, g.size ) - 0.5f * g.size;
+	float b = CellToFloat( this->col_cur, g.size ) + 0.5f * g.size;
+	if( a < this->u0 - this->level_radius ) a = this->u0 - this->level_radius;
+	if( b > this->u1 + this->level_radius ) b = this->u1 + this->level_radius;
+	
+	const float va = this->v0 + ( a - this->u0 ) * this->slope;
+	const float vb = this->v0 + ( b - this->u0 ) * this->slope;
+	
+	this->row_cur = CellFromFloat( ( va < vb ? va : vb ) - this->width, g.size_inv );
+	this->row_max = CellFromFloat( ( va < vb ? vb : va ) + this->width, g.size_inv );
+}
+
+
+world::Entity * world::NearbyRayIterator::Next( void )
+{
+	if( this->ent ) this->ent = pool.next[ this->ent ];
+	
+	while( true )
 	{
-		queueHead = ent->next;
+		while( this->ent && ( !( world::TypeMask( pool.type[ this->ent ] ) & this->type_mask ) || PoolQueued( this->ent ) ) )
+			this->ent = pool.next[ this->ent ];
+		if( this->ent ) break;
+		
+		if( this->row_cur > this->row_max )
+		{
+			if( this->col_cur < this->col_max ) {
+				this->col_cur++;
+				this->BeginColumn();
+			}
+			else if( !this->BeginLevel() ) {
+				break;
+			}
+		}
+		
+		const unsigned int hash = ( this->swap ? CellHash( this->row_cur, this->col_cur ) : CellHash( this->col_cur, this->row_cur ) );
+		const Cell *cell = CellFind( grids[ this->level ], hash );
+		this->ent = ( cell && ( cell->types & this->type_mask ) ? cell->list : 0 );
+		this->row_cur++;
+		this->cells++;
 	}
 
-	assert( !ent->cell_x && !ent->cell_y );
+	return ( this->ent ? pool.owner[ this->ent ] : NULL );
+}
 
-	ent->next = NULL;
 
-	return ent;
+/// Añade una entidad candidata a la lista ordenada de las más cercanas de world::NearestK().
+/// \return  Nuevo número de entidades en la lista.
+static inline int NearestInsert( world::Entity *ent, const float d2, world::Entity *out[], float *out_d2, int found, const int k )
+{
+	int i = ( found < k ? found++ : k - 1 );	// drop the farthest one when full
+	while( i > 0 && out_d2[i-1] > d2 ) {
+		out[i]    = out[i-1];
+		out_d2[i] = out_d2[i-1];
+		i--;
+	}
+	out[i]    = ent;
+	out_d2[i] = d2;
+	return found;
 }
 
+
+/// .\n
+/// Cada nivel se recorre en anillos de celdas alrededor del punto, compartiendo la lista de candidatos, de modo que los niveles siguientes
+/// ya parten de la distancia de la k-ésima entidad encontrada. Un nivel termina al visitar todas sus entidades de los tipos buscados (Grid::type_entities)
+/// o al cubrir su rango de celdas ocupadas, que también impide dar la vuelta a las coordenadas de celda con un \a max_radius muy grande. \n
+/// Las distancias al cuadrado se guardan temporalmente en \a dist (o en un buffer local si no se indica) y se convierten al final.
+int world::NearestK( const float x, const float y, const int k, const unsigned int type_mask, world::Entity *out[], float *dist, const float max_radius )
+{
+	if( k <= 0 ) return 0;
 	
+	float local[64];
+	float *out_d2 = ( dist ? dist : k <= 64 ? local : (float*) ::malloc( k * sizeof(float) ) );
+	assert( out_d2 );
 	
-void world::Entity::WorldUpdate( const float x, const float y )
-{
-	const unsigned short cell_x = CellFromFloat( x );
-	const unsigned short cell_y = CellFromFloat( y );
+	const float max_r2 = max_radius * max_radius;
 	
-	if( cell_x != this->cell_x || cell_y != this->cell_y )
+	int found = 0;
+	for( int l = 0; l < num_levels; l++ )
 	{
-		const unsigned int hash = CellHash( cell_x, cell_y );
-		world::Entity *list = cells[ hash ];
+		const Grid &g = grids[l];
+		if( !g.entities || !( g.types & type_mask ) ) continue;
+		const int matching = GridCount( g, type_mask );
 		
-		if( this->cell_x | this->cell_y ) 
-			this->WorldDelete();
-
-		this->cell_x = cell_x;
-		this->cell_y = cell_y;
+		const unsigned short cx = CellFromFloat( x, g.size_inv );
+		const unsigned short cy = CellFromFloat( y, g.size_inv );
+		
+		// rings beyond the occupied cells are empty; 0x7FFF rings already cover every cell coordinate once
+		int rings = (int) g.cell_max_x - cx;
+		if( (int) cx - (int) g.cell_min_x > rings ) rings = (int) cx - (int) g.cell_min_x;
+		if( (int) g.cell_max_y - cy > rings ) rings = (int) g.cell_max_y - cy;
+		if( (int) cy - (int) g.cell_min_y > rings ) rings = (int) cy - (int) g.cell_min_y;
+		if( rings > 0x7FFF ) rings = 0x7FFF;
+		
+		// distances from the point to the borders of its own cell
+		const float left   = x - ( CellToFloat( cx, g.size ) - 0.5f * g.size );
+		const float right  = g.size - left;
+		const float bottom = y - ( CellToFloat( cy, g.size ) - 0.5f * g.size );
+		const float top    = g.size - bottom;
+		float border = left;
+		if( right  < border ) border = right;
+		if( bottom < border ) border = bottom;
+		if( top    < border ) border = top;
 
-		if( list )
-		{
-			this->next = list->next;
-			list->next = this;
-		}
-		else
+		int seen = 0;	// entities of the accepted types of this level already visited
+		for( int r = 0; ; r++ )
 		{
-			this->next = NULL;
-			cells[ hash ] = this;
+			for( int j = -r; j <= r; j++ )
+			{
+				const int step = ( j == -r || j == r ? 1 : 2 * r );	// full top/bottom rows, only both ends of the others
+				for( int i = -r; i <= r; i += step )
+				{
+					// skip cells farther than the current k-th entity
+					const float ex = ( i < 0 ? left   + ( -i - 1 ) * g.size : i > 0 ? right + ( i - 1 ) * g.size : 0.0f );
+					const float ey = ( j < 0 ? bottom + ( -j - 1 ) * g.size : j > 0 ? top   + ( j - 1 ) * g.size : 0.0f );
+					const float e2 = ex*ex + ey*ey;
+					if( e2 > max_r2 || ( found == k && e2 >= out_d2[k-1] ) ) continue;
+					
+					const Cell *cell = CellFind( g, CellHash( (unsigned short)( cx + i ), (unsigned short)( cy + j ) ) );
+					if( !cell || !( cell->types & type_mask ) ) continue;
+					
+					for( unsigned int ent = cell->list; ent; ent = pool.next[ent] )
+					{
+						if( !( world::TypeMask( pool.type[ent] ) & type_mask ) ) continue;
+						seen++;
+						if( PoolQueued( ent ) ) continue;
+						const float rx = pool.x[ent] - x;
+						const float ry = pool.y[ent] - y;
+						const float d2 = rx*rx + ry*ry;
+						if( d2 > max_r2 || ( found == k && d2 >= out_d2[k-1] ) ) continue;
+						found = NearestInsert( pool.owner[ent], d2, out, out_d2, found, k );
+					}
+				}
+			}
+			
+			// any cell outside the rings visited so far is at least this far
+			const float bound = border + r * g.size;
+			if( seen == matching || r == rings || bound > max_radius || ( found == k && bound*bound >= out_d2[k-1] ) ) break;
 		}
-		
-		assert( entities++ >= 0 );
 	}
+	
+	if( dist ) {
+		for( int i = 0; i < found; i++ )
+			dist[i] = sqrtf( dist[i] );
+	} else if( out_d2 != local ) {
+		::free( out_d2 );
+	}
+	
+	return found;
 }
 
 
-void world::Entity::WorldDelete( void )
+/// Cuerdas de un círculo en una fila de celdas entre \a y0 e \a y1.
+/// [\a outer_min, \a outer_max] es la parte de la fila que cruza el círculo y [\a inner_min, \a inner_max] la que queda completamente dentro.
+/// Un intervalo vacío tiene el mínimo mayor que el máximo.
+static inline void RowChord( const float y0, const float y1, const float x, const float y, const float r2, float &outer_min, float &outer_max, float &inner_min, float &inner_max )
 {
-	const unsigned int hash = CellHash( this->cell_x, this->cell_y );
-	world::Entity *list = cells[ hash ];
+	const float near_y = ( y < y0 ? y0 - y : ( y > y1 ? y - y1 : 0.0f ) );
+	const float far_y  = ( y - y0 > y1 - y ? y - y0 : y1 - y );
 	
-	assert( list );
+	outer_min = inner_min = 0.0f;
+	outer_max = inner_max = -1.0f;
+	if( near_y*near_y <= r2 ) {
+		const float outer = sqrtf( r2 - near_y*near_y );
+		outer_min = x - outer;
+		outer_max = x + outer;
+	}
+	if( far_y*far_y < r2 ) {
+		const float inner = sqrtf( r2 - far_y*far_y );
+		inner_min = x - inner;
+		inner_max = x + inner;
+	}
+}
+
+
+/// Búsqueda exacta de world::NearbyQuery() y world::NearbyQueryBox(): entidades cuyo centro está en el AABB y, si \a r2 >= 0, a distancia menor o igual que sqrt(\a r2) de (\a x, \a y).
+/// Como se comprueba el centro, el rango de celdas no se amplía con el radio de las entidades del nivel. \n
+/// En cada fila de celdas se calcula la cuerda del círculo en su borde más cercano y en el más lejano: solamente se visitan las celdas que cruza la primera,
+/// y en las que quedan dentro de la segunda se devuelven todas las entidades sin comprobar su posición, salvo las que tienen cambios pendientes
+/// de world::CommitUpdates(), que siguen en su celda anterior pero cuya posición ya puede estar fuera de ella.
+/// Los límites de las celdas se amplían un poco para cubrir el redondeo de CellFromFloat. \n
+/// En \a dist se guarda la distancia al cuadrado.
+/// \return  Número de entidades en la salida.
+static int QueryCells( const float min_x, const float min_y, const float max_x, const float max_y, const float x, const float y, const float r2,
+                       const unsigned int type_mask, world::Entity *out[], float *dist, const int max )
+{
+	const bool circle = ( r2 >= 0.0f );
+	int found = 0;
 	
-	if( list == this )
+	for( int l = 0; l < num_levels && found < max; l++ )
 	{
-		if( list->next )
-		{
-			cells[ hash ] = list->next;
-		}
-		else
+		const Grid &g = grids[l];
+		if( !g.entities || !( g.types & type_mask ) ) continue;	// nothing to find in this level
+		
+		const float margin = 0.01f * g.size;
+		const unsigned short cell_max_y = CellFromFloat( max_y, g.size_inv );
+		
+		for( unsigned short cy = CellFromFloat( min_y, g.size_inv ); cy <= cell_max_y && found < max; cy++ )
 		{
-			cells.erase( hash );
+			const float y0 = CellToFloat( cy, g.size ) - 0.5f * g.size - margin;
+			const float y1 = CellToFloat( cy, g.size ) + 0.5f * g.size + margin;
+			
+			// horizontal range of the row to visit, and of the cells completely inside
+			float row_min = min_x, row_max = max_x;
+			float in_min  = 0.0f,  in_max  = -1.0f;
+			if( circle ) {
+				RowChord( y0, y1, x, y, r2, row_min, row_max, in_min, in_max );
+			} else if( y0 >= min_y && y1 <= max_y ) {
+				in_min = min_x;
+				in_max = max_x;
+			}
+			if( !( row_min <= row_max ) ) continue;	// the circle does not reach this row
+			
+			const unsigned short cell_max_x = CellFromFloat( row_max, g.size_inv );
+			for( unsigned short cx = CellFromFloat( row_min, g.size_inv ); cx <= cell_max_x && found < max; cx++ )
+			{
+				const Cell *cell = CellFind( g, CellHash( cx, cy ) );
+				StatsAdd( stats_cells_visited, 1 );
+				if( !cell || !( cell->types & type_mask ) ) continue;
+				
+				const bool all    = !( cell->types & ~type_mask );
+				const bool inside = ( CellToFloat( cx, g.size ) - 0.5f * g.size - margin >= in_min && CellToFloat( cx, g.size ) + 0.5f * g.size + margin <= in_max );
+				for( unsigned int i = cell->list; i && found < max; i = pool.next[i] )
+				{
+					if( ( !all && !( world::TypeMask( pool.type[i] ) & type_mask ) ) || PoolQueued( i ) ) continue;
+					
+					const float dx = pool.x[i] - x;
+					const float dy = pool.y[i] - y;
+					const float d2 = dx*dx + dy*dy;
+					if( !inside || pool.moved[i] ) {	// entities moved by WorldMove() are still linked to their previous cell
+						if( circle ? !( d2 <= r2 ) : !( pool.x[i] >= min_x && pool.x[i] <= max_x && pool.y[i] >= min_y && pool.y[i] <= max_y ) ) continue;
+					}
+					
+					out[ found ] = pool.owner[i];
+					if( dist ) dist[ found ] = d2;
+					found++;
+				}
+			}
 		}
 	}
-	else
-	{
-		assert( list->next );
-		while( list->next != this ) {
-			list = list->next;
-			assert( list );
-		}
-			
-		assert( list && list->next == this );
+	
+	StatsAdd( stats_queries, 1 );
+	StatsAdd( stats_entities_returned, found );
+	return found;
+}
 
-		list->next = this->next;
+
+int world::NearbyQuery( const float x, const float y, const float radius, const unsigned int type_mask, world::Entity *out[], float *dist, const int max )
+{
+	if( max <= 0 ) return 0;
+	
+	const int found = QueryCells( x - radius, y - radius, x + radius, y + radius, x, y, radius * radius, type_mask, out, dist, max );
+	if( dist ) {
+		for( int i = 0; i < found; i++ )
+			dist[i] = sqrtf( dist[i] );
 	}
-			
-	assert( --entities >= 0 );
+	return found;
+}
+
 
-	this->cell_x = 0;
-	this->cell_y = 0;
-	this->next = NULL;
+int world::NearbyQueryBox( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask, world::Entity *out[], const int max )
+{
+	if( max <= 0 ) return 0;
+	
+	return QueryCells( box_min_x, box_min_y, box_max_x, box_max_y, 0.0f, 0.0f, -1.0f, type_mask, out, NULL, max );
 }
 
 
+/// Número de pares que se acumulan antes de llamar a la función de world::ForEachPair().
+static const int PAIR_BATCH = 256;
+
+/// Lote de pares pendiente de entregar en world::ForEachPair().
+struct PairBatch {
+	world::Pair			pairs[ PAIR_BATCH ];	///< Pares acumulados, con la distancia al cuadrado hasta entregarlos.
+	int					count;					///< Número de pares acumulados.
+	world::PairCallback	callback;				///< Función que recibe los pares.
+	void				*user;					///< Puntero de usuario para ::callback.
+};
+
 
-world::NearbyIterator::NearbyIterator( const float pos_x, const float pos_y, const float radius )
+/// Entrega los pares acumulados.
+static void PairFlush( PairBatch &batch )
 {
-	this->cell_min_x = CellFromFloat( pos_x - radius );
-	this->cell_min_y = CellFromFloat( pos_y - radius );
-	this->cell_max_x = CellFromFloat( pos_x + radius );
-	this->cell_max_y = CellFromFloat( pos_y + radius );
+	if( !batch.count ) return;
+	for( int i = 0; i < batch.count; i++ )
+		batch.pairs[i].dist = sqrtf( batch.pairs[i].dist );
+	batch.callback( batch.pairs, batch.count, batch.user );
+	batch.count = 0;
+}
 
-	this->Reset();
+
+/// Añade una celda a ::pair_cells.
+static inline void PairCellAdd( const Cell *cell, unsigned int &n )
+{
+	if( n == pair_cells_size )
+	{
+		pair_cells_size = ( pair_cells_size ? 2 * pair_cells_size : 64 );
+		pair_cells = (const Cell**) ::realloc( pair_cells, pair_cells_size * sizeof(Cell*) );
+		assert( pair_cells );
+	}
+	pair_cells[ n++ ] = cell;
 }
 
-		
-world::NearbyIterator::NearbyIterator( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y )
+
+/// .\n
+/// El primer elemento de ::pair_cells es la propia celda, en la que cada entidad solamente se compara con las siguientes de la lista.
+void world::ForEachPair( const float radius, const unsigned int type_mask, world::PairCallback callback, void *user )
 {
-	this->cell_min_x = CellFromFloat( box_min_x );
-	this->cell_min_y = CellFromFloat( box_min_y );
-	this->cell_max_x = CellFromFloat( box_max_x );
-	this->cell_max_y = CellFromFloat( box_max_y );
+	PairBatch batch;
+	batch.count    = 0;
+	batch.callback = callback;
+	batch.user     = user;
 	
-	this->Reset();
+	const float r2 = radius * radius;
+	
+	for( int l = 0; l < num_levels; l++ )
+	{
+		const Grid &g = grids[l];
+		if( !g.entities || !( g.types & type_mask ) ) continue;
+		
+		const int reach = (int) ceilf( radius * g.size_inv );		// neighbour cells on each side
+		const unsigned int dense_size = ( g.dense ? g.dense_size_x * g.dense_size_y : 0 );
+		
+		for( unsigned int c = 0; c < g.table_size + dense_size; c++ )
+		{
+			const Cell &cell = ( c < g.table_size ? g.table[c] : g.dense[ c - g.table_size ] );
+			if( !cell.list || !( cell.types & type_mask ) ) continue;
+			
+			const unsigned short cx = CellHashX( cell.hash );
+			const unsigned short cy = CellHashY( cell.hash );
+			
+			// the cell itself and half of its neighbourhood: cells to the right in the same row, and the rows above
+			unsigned int n = 0;
+			PairCellAdd( &cell, n );
+			for( int dy = 0; dy <= reach; dy++ )
+			{
+				for( int dx = ( dy ? -reach : 1 ); dx <= reach; dx++ )
+				{
+					const Cell *other = CellFind( g, CellHash( (unsigned short)( cx + dx ), (unsigned short)( cy + dy ) ) );
+					if( other && ( other->types & type_mask ) ) PairCellAdd( other, n );
+				}
+			}
+			
+			// cells of the coarser levels overlapping this cell extended by the radius
+			const float min_x = CellToFloat( cx, g.size ) - 0.5f * g.size - radius;
+			const float min_y = CellToFloat( cy, g.size ) - 0.5f * g.size - radius;
+			const float max_x = CellToFloat( cx, g.size ) + 0.5f * g.size + radius;
+			const float max_y = CellToFloat( cy, g.size ) + 0.5f * g.size + radius;
+			for( int m = l + 1; m < num_levels; m++ )
+			{
+				const Grid &h = grids[m];
+				if( !h.entities || !( h.types & type_mask ) ) continue;
+				
+				const int hx0 = CellFromFloat( min_x, h.size_inv );
+				const int hx1 = CellFromFloat( max_x, h.size_inv );
+				const int hy1 = CellFromFloat( max_y, h.size_inv );
+				for( int hy = CellFromFloat( min_y, h.size_inv ); hy <= hy1; hy++ )
+				{
+					for( int hx = hx0; hx <= hx1; hx++ )
+					{
+						const Cell *other = CellFind( h, CellHash( hx, hy ) );
+						if( other && ( other->types & type_mask ) ) PairCellAdd( other, n );
+					}
+				}
+			}
+			
+			for( unsigned int a = cell.list; a; a = pool.next[a] )
+			{
+				if( !( world::TypeMask( pool.type[a] ) & type_mask ) || PoolQueued( a ) ) continue;
+				const float ax = pool.x[a];
+				const float ay = pool.y[a];
+				
+				for( unsigned int i = 0; i < n; i++ )
+				{
+					for( unsigned int b = ( i ? pair_cells[i]->list : pool.next[a] ); b; b = pool.next[b] )
+					{
+						const float dx = pool.x[b] - ax;
+						const float dy = pool.y[b] - ay;
+						const float d2 = dx*dx + dy*dy;
+						if( d2 > r2 || !( world::TypeMask( pool.type[b] ) & type_mask ) || PoolQueued( b ) ) continue;
+						
+						world::Pair &pair = batch.pairs[ batch.count ];
+						pair.a    = pool.owner[a];
+						pair.b    = pool.owner[b];
+						pair.dist = d2;
+						if( ++batch.count == PAIR_BATCH ) PairFlush( batch );
+					}
+				}
+			}
+		}
+	}
+	
+	PairFlush( batch );
 }
 
 
-void world::NearbyIterator::Reset( void )
+
+world::NeighbourList::NeighbourList( const float radius, const float skin, const unsigned int type_mask ) :
+	radius(radius), skin(skin), type_mask(type_mask), owner(0), build_x(0), build_y(0), list(NULL), count(0), size(0), hits(0), misses(0)
 {
-	this->cell_cur_x = this->cell_min_x - 1;
-	this->cell_cur_y = this->cell_min_y;
+	assert( radius >= 0.0f && skin >= 0.0f );
+}
+
 
-	this->ent = NULL;
+world::NeighbourList::~NeighbourList()
+{
+	::free( this->list );
 }
 
 
-world::Entity * world::NearbyIterator::Next( void )
+bool world::NeighbourList::Update( const world::Entity &ent )
 {
-	if( this->ent ) this->ent = this->ent->next;
+	const world::Handle handle = ent.GetHandle();
+	float x, y;
+	if( !world::GetPosition( handle, x, y ) )	// not in the world: no neighbours
+	{
+		this->owner = 0;
+		this->count = 0;
+		return false;
+	}
 	
-	while( !this->ent )
+	const float half = 0.5f * this->skin;
+	const float dx = x - this->build_x;
+	const float dy = y - this->build_y;
+	if( handle == this->owner && dx*dx + dy*dy <= half*half )
 	{
-		if( this->cell_cur_x < this->cell_max_x )
-		{
-			this->cell_cur_x++;
-		}
-		else if( this->cell_cur_y < this->cell_max_y )
-		{
-			this->cell_cur_x = this->cell_min_x;
-			this->cell_cur_y++;
-		}
-		else
+		this->hits++;
+		return false;
+	}
+	
+	this->misses++;
+	this->owner   = handle;
+	this->build_x = x;
+	this->build_y = y;
+	this->count   = 0;
+	
+	const float r  = this->radius + this->skin;
+	const float r2 = r * r;
+	world::NearbyIterator nearby( x, y, r, this->type_mask );
+	while( const world::Entity *other = nearby.Next() )
+	{
+		const unsigned int i = HandleIndex( other->GetHandle() );
+		const float rx = pool.x[i] - x;
+		const float ry = pool.y[i] - y;
+		if( rx*rx + ry*ry > r2 || other == &ent ) continue;
+		
+		if( this->count == this->size )
 		{
-			break;
+			this->size = ( this->size ? 2 * this->size : 32 );
+			this->list = (world::Handle*) ::realloc( this->list, this->size * sizeof(world::Handle) );
+			assert( this->list );
 		}
-		
-		CellMap::iterator it = cells.find( CellHash( this->cell_cur_x, this->cell_cur_y ) );
-		this->ent = ( it == cells.end() ? NULL : it->second );
+		this->list[ this->count++ ] = other->GetHandle();
 	}
+	return true;
+}
 
-	return this->ent;
+
+world::Entity * world::NeighbourIterator::Next( void )
+{
+	while( this->i < this->list.count )
+	{
+		const world::Handle handle = this->list.list[ this->i++ ];
+		world::Entity *ent = world::Resolve( handle );
+		if( ent && !PoolQueued( HandleIndex( handle ) ) ) return ent;
+	}
+	return NULL;
 }
 
 
-/* //####TODO: NOT TESTED
-world::Entity * world::NearbyRayIterator::Next( void )
+
+int world::Watch( const float x, const float y, const float radius, const unsigned int type_mask, const int capacity )
+{
+	assert( radius >= 0.0f && capacity > 0 );
+	if( !~watch_active ) return -1;
+	
+	// reuse an entry with stale bits only when there is no other, clearing them for all the released entries at once
+	if( !~( watch_active | watch_stale ) ) {
+		for( unsigned int i = 1; i < pool.used; i++ )
+			pool.watch[i] &= ~watch_stale;
+		watch_stale = 0;
+	}
+	
+	const int w = __builtin_ctz( ~( watch_active | watch_stale ) );
+	WatchRegion &r = watches[w];
+	r.x         = x;
+	r.y         = y;
+	r.radius    = radius;
+	r.type_mask = type_mask;
+	r.events    = (world::WatchEvent*) ::malloc( capacity * sizeof(world::WatchEvent) );
+	r.count     = 0;
+	r.size      = capacity;
+	r.overflow  = false;
+	if( !r.events ) return -1;
+	
+	watch_active |= 1u << w;
+	watch_types  |= type_mask;
+	
+	// initial members, including entities with pending moves that are still in their previous cell
+	world::NearbyIterator nearby( x, y, radius, type_mask );
+	while( const world::Entity *ent = nearby.Next() )
+		WatchTest( w, HandleIndex( ent->GetHandle() ) );
+	for( unsigned int i = 0; i < pending_count; i++ )
+		if( pending[i] ) WatchTest( w, pending[i] );
+	
+	return w;
+}
+
+
+void world::Unwatch( const int watch )
+{
+	assert( watch >= 0 && watch < world::MAX_WATCHES && ( watch_active & ( 1u << watch ) ) );
+	
+	::free( watches[ watch ].events );
+	memset( &watches[ watch ], 0, sizeof(WatchRegion) );
+	watch_active &= ~( 1u << watch );
+	watch_stale  |= 1u << watch;	// the bits of the entities are cleared when the entry is reused
+	
+	watch_types = 0;
+	for( unsigned int bits = watch_active; bits; bits &= bits - 1 )
+		watch_types |= watches[ __builtin_ctz( bits ) ].type_mask;
+}
+
+
+void world::WatchMove( const int watch, const float x, const float y )
 {
-	if( this->ent ) this->ent = this->ent->next;
+	assert( watch >= 0 && watch < world::MAX_WATCHES && ( watch_active & ( 1u << watch ) ) );
+	
+	WatchRegion &r = watches[ watch ];
+	const float old_x = r.x;
+	const float old_y = r.y;
+	if( x == old_x && y == old_y ) return;
+	r.x = x;
+	r.y = y;
+	
+	const float r2 = r.radius * r.radius;
+	const float min_x = fminf( x, old_x ) - r.radius;
+	const float min_y = fminf( y, old_y ) - r.radius;
+	const float max_x = fmaxf( x, old_x ) + r.radius;
+	const float max_y = fmaxf( y, old_y ) + r.radius;
 	
-	while( !this->ent && this->count0 <= this->total )
+	for( int l = 0; l < num_levels; l++ )
 	{
-		const float x = this->px + this->count0 * this->mx;
-		const float y = this->py + this->count0 * this->my;
+		const Grid &g = grids[l];
+		if( !g.entities || !( g.types & r.type_mask ) ) continue;
 		
-		const int cx = CellFromFloat( x ) + ( this->mx == 1.0f ? 0 : this->count1 );
-		const int cy = CellFromFloat( y ) + ( this->mx == 1.0f ? this->count1 : 0 );
-		
-		const float rx = x - CellToFloat( cx );
-		const float ry = y - CellToFloat( cy );
-		const float rr = this->radius + world::CELL_SIZE;
-		if( rx*rx < rr*rr && ry*ry < rr*rr ) {
-			CellMap::iterator it = cells.find( CellHash( cx, cy ) );
-			this->ent = ( it == cells.end() ? NULL : it->second );
+		const float margin = 0.01f * g.size;	// cell bounds rounding
+		const int cy1 = CellFromFloat( max_y, g.size_inv );
+		for( int cy = CellFromFloat( min_y, g.size_inv ); cy <= cy1; cy++ )
+		{
+			const float y0 = CellToFloat( cy, g.size ) - 0.5f * g.size - margin;
+			const float y1 = CellToFloat( cy, g.size ) + 0.5f * g.size + margin;
+			
+			float before[4], after[4];
+			RowChord( y0, y1, old_x, old_y, r2, before[0], before[1], before[2], before[3] );
+			RowChord( y0, y1, x, y, r2, after[0], after[1], after[2], after[3] );
+			
+			// cells completely inside both circles keep their members
+			const float keep_min = fmaxf( before[2], after[2] );
+			const float keep_max = fminf( before[3], after[3] );
+			
+			// the cells crossed by either circle, as one range if they overlap
+			int range[2][2], ranges = 0;
+			if( before[0] <= before[1] ) {
+				range[ ranges ][0] = CellFromFloat( before[0], g.size_inv );
+				range[ ranges ][1] = CellFromFloat( before[1], g.size_inv );
+				ranges++;
+			}
+			if( after[0] <= after[1] ) {
+				range[ ranges ][0] = CellFromFloat( after[0], g.size_inv );
+				range[ ranges ][1] = CellFromFloat( after[1], g.size_inv );
+				if( ranges && range[1][0] <= range[0][1] + 1 && range[0][0] <= range[1][1] + 1 ) {
+					range[0][0] = ( range[0][0] < range[1][0] ? range[0][0] : range[1][0] );
+					range[0][1] = ( range[0][1] > range[1][1] ? range[0][1] : range[1][1] );
+				} else {
+					ranges++;
+				}
+			}
+			
+			for( int k = 0; k < ranges; k++ )
+			{
+				for( int cx = range[k][0]; cx <= range[k][1]; cx++ )
+				{
+					const float x0 = CellToFloat( cx, g.size ) - 0.5f * g.size - margin;
+					const float x1 = CellToFloat( cx, g.size ) + 0.5f * g.size + margin;
+					if( x0 >= keep_min && x1 <= keep_max ) {
+						// skip the kept range up to its last two cells, whose bounds are tested as usual
+						const int last = (int) CellFromFloat( keep_max, g.size_inv ) - 2;
+						if( last > cx ) cx = last;
+						continue;
+					}
+					
+					const Cell *cell = CellFind( g, CellHash( cx, cy ) );
+					if( !cell || !( cell->types & r.type_mask ) ) continue;
+					for( unsigned int i = cell->list; i; i = pool.next[i] )
+						WatchTest( watch, i );
+				}
+			}
 		}
+	}
+	
+	// entities with pending moves are not in the cell of their notified position; outside both circles they can not change
+	for( unsigned int i = 0; i < pending_count; i++ )
+	{
+		const unsigned int ent = pending[i];
+		if( ent && pool.x[ent] >= min_x && pool.x[ent] <= max_x && pool.y[ent] >= min_y && pool.y[ent] <= max_y ) WatchTest( watch, ent );
+	}
+}
+
+
+const world::WatchEvent * world::WatchEvents( const int watch, int &count, bool &overflow )
+{
+	assert( watch >= 0 && watch < world::MAX_WATCHES && ( watch_active & ( 1u << watch ) ) );
+	count    = watches[ watch ].count;
+	overflow = watches[ watch ].overflow;
+	return watches[ watch ].events;
+}
+
+
+void world::WatchClear( const int watch )
+{
+	assert( watch >= 0 && watch < world::MAX_WATCHES && ( watch_active & ( 1u << watch ) ) );
+	watches[ watch ].count    = 0;
+	watches[ watch ].overflow = false;
+}
+
+
+
+void world::GetStats( world::Stats &out )
+{
+	out = stats;
+	out.queries           = stats_queries.load( std::memory_order_relaxed );
+	out.cells_visited     = stats_cells_visited.load( std::memory_order_relaxed );
+	out.entities_returned = stats_entities_returned.load( std::memory_order_relaxed );
+	out.lookups           = stats_lookups.load( std::memory_order_relaxed );
+	out.lookup_time = stats_lookup_ticks.load( std::memory_order_relaxed ) * stats_tick_time;
+	out.num_levels  = num_levels;
+	
+	for( int l = 0; l < num_levels; l++ )
+	{
+		const Grid &g = grids[l];
+		world::LevelStats &level = out.levels[l];
+		level.cell_size    = g.size;
+		level.cells        = 0;
+		level.entities     = g.entities;
+		level.max_per_cell = 0;
 		
-		if( this->count1++ >= 1 ) {
-			this->count1 = -1;
-			this->count0++;
+		const unsigned int dense_size = ( g.dense ? g.dense_size_x * g.dense_size_y : 0 );
+		for( unsigned int i = 0; i < g.table_size + dense_size; i++ )
+		{
+			const Cell &cell = ( i < g.table_size ? g.table[i] : g.dense[ i - g.table_size ] );
+			if( !cell.list ) continue;
+			
+			unsigned int count = 0;
+			for( unsigned int ent = cell.list; ent; ent = pool.next[ent] ) count++;
+			if( count > level.max_per_cell ) level.max_per_cell = count;
+			level.cells++;
 		}
+		level.mean_per_cell = ( level.cells ? (float) level.entities / level.cells : 0.0f );
 	}
+}
 
-	return this->ent;
+
+void world::StatsReset( void )
+{
+	const unsigned int frame = stats.frame;
+	memset( &stats, 0, sizeof(stats) );
+	stats.frame = frame;
+	stats_queries.store( 0, std::memory_order_relaxed );
+	stats_cells_visited.store( 0, std::memory_order_relaxed );
+	stats_entities_returned.store( 0, std::memory_order_relaxed );
+	stats_lookups.store( 0, std::memory_order_relaxed );
+	stats_lookup_ticks.store( 0, std::memory_order_relaxed );
 }
-*/
 
+
+bool world::StatsOpen( const char *path, const bool timing )
+{
+	world::StatsClose();
+	
+	stats_file = fopen( path, "w" );
+	if( !stats_file ) return false;
+	
+	fprintf( stats_file, "frame,migrations,queries,cells_visited,entities_returned,cells_per_query,entities_per_query,lookups,lookup_ns" );
+	for( int l = 0; l < num_levels; l++ )
+		fprintf( stats_file, ",level%d_cell_size,level%d_cells,level%d_entities,level%d_max_per_cell,level%d_mean_per_cell", l, l, l, l, l );
+	fprintf( stats_file, "\n" );
+	
+	if( timing )	// calibrate the clock against the monotonic clock
+	{
+		struct timespec t0, t1;
+		clock_gettime( CLOCK_MONOTONIC, &t0 );
+		const unsigned long long c0 = StatsClock();
+		do {
+			clock_gettime( CLOCK_MONOTONIC, &t1 );
+		} while( ( t1.tv_sec - t0.tv_sec ) * 1e9 + ( t1.tv_nsec - t0.tv_nsec ) < 10e6 );
+		const unsigned long long c1 = StatsClock();
+		stats_tick_time = ( ( t1.tv_sec - t0.tv_sec ) + ( t1.tv_nsec - t0.tv_nsec ) * 1e-9 ) / (double) ( c1 - c0 );
+	}
+	
+	world::StatsReset();
+	stats_enabled = true;
+	return true;
+}
+
+
+void world::StatsDump( void )
+{
+	if( !stats_file ) return;
+	
+	world::Stats s;
+	world::GetStats( s );
+	
+	fprintf( stats_file, "%u,%u,%u,%u,%u,%.2f,%.2f,%u,%.0f", s.frame, s.migrations, s.queries, s.cells_visited, s.entities_returned,
+		( s.queries ? (float) s.cells_visited / s.queries : 0.0f ), ( s.queries ? (float) s.entities_returned / s.queries : 0.0f ),
+		s.lookups, s.lookup_time * 1e9 );
+	for( int l = 0; l < s.num_levels; l++ )
+		fprintf( stats_file, ",%g,%u,%u,%u,%.2f", s.levels[l].cell_size, s.levels[l].cells, s.levels[l].entities, s.levels[l].max_per_cell, s.levels[l].mean_per_cell );
+	fprintf( stats_file, "\n" );
+	
+	stats.frame++;
+	world::StatsReset();
+}
+
+
+void world::StatsClose( void )
+{
+	if( stats_file ) fclose( stats_file );
+	stats_file = NULL;
+	stats_enabled = false;
+	stats_tick_time = 0.0;
+}
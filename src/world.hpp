@@ -20,7 +20,10 @@
 ///
 /// El mundo se divide en celdas regulares (cuadrícula) de tamaño world::CELL_SIZE.
 /// Las entidades se insertan/extraen automaticamente en estas celdas según su posición, de modo que podemos recoger todas las entidades entorno a un punto o AABB.
-/// \note El tamaño de celda world::CELL_SIZE debe ser ajustado en función del tamaño/velocidad/densidad de las entidades para obetener un buen rendimiento.
+/// \note Opcionalmente se pueden utilizar varias cuadriculas o niveles con distintos tamaños de celda (ver world::Config), de modo que las entidades
+///       pequeñas (peatones) y grandes (autobuses) se guardan en celdas adecuadas a su tamaño (ver Entity::SetExtent()).
+/// \note Mientras una entidad está en el mundo se identifica con un world::Handle generacional (ver Entity::GetHandle()), que deja de ser válido
+///       al extraerla, de modo que las referencias guardadas se pueden comprobar con world::Resolve() en lugar de acceder a entidades destruidas.
 ///
 /// Ejemplo de uso:
 /// \code{.cpp}
@@ -118,9 +121,258 @@ namespace world
 {
 
 	
-	static const float CELL_SIZE     = 8.0f;				///< Tamaño de las celdas del mundo.
-	static const float CELL_SIZE_INV = 1.0f / CELL_SIZE;	///< Inversa del tamaño de las celdas del mundo.
+	static const float CELL_SIZE     = 8.0f;				///< Tamaño por defecto de las celdas del mundo.
+	static const float CELL_SIZE_INV = 1.0f / CELL_SIZE;	///< Inversa del tamaño por defecto de las celdas del mundo.
+	static const int   MAX_LEVELS    = 4;					///< Número máximo de niveles de la cuadricula jerárquica.
 	
+	static const unsigned int ALL_TYPES = 0xFFFFFFFFu;	///< Máscara de tipos que acepta cualquier entidad. Ver world::TypeMask().
+
+	/// Máscara de bits de un tipo de entidad, para filtrar búsquedas por tipo.
+	/// Los tipos se agrupan módulo 32, por lo que tipos distintos pueden compartir el mismo bit.
+	/// \param [in] type  Tipo de entidad (ver Entity::GetType()).
+	/// \return           Máscara con el bit del tipo.
+	inline unsigned int TypeMask( const unsigned int type ) { return 1u << ( type & 31 ); }
+	
+	/// Parámetros de configuración del mundo.
+	/// La cuadricula puede tener varios niveles con tamaños de celda crecientes, por ejemplo 2, 8 y 32 metros. \n
+	/// Cada entidad se guarda en el nivel más pequeño cuyas celdas son al menos tan grandes como su diámetro (ver Entity::SetExtent()),
+	/// y las búsquedas solamente recorren los niveles que contienen entidades. \n
+	/// Opcionalmente se puede indicar un área rectangular conocida (por ejemplo los límites de la ciudad) en la que las celdas se guardan
+	/// en un array denso indexado directamente por coordenada de celda, evitando cualquier búsqueda. \n
+	/// Las celdas fuera de este área (o todas si el área está vacía) se guardan en una tabla hash con direccionamiento abierto.
+	struct Config {
+		Config() : num_levels(1), dense_min_x(0), dense_min_y(0), dense_max_x(0), dense_max_y(0), queue_size(4096) {
+			cell_size[0] = CELL_SIZE;
+			for( int i = 1; i < MAX_LEVELS; i++ ) cell_size[i] = 0.0f;
+		}
+		int   num_levels;					///< Número de niveles, entre 1 y world::MAX_LEVELS.
+		float cell_size[MAX_LEVELS];		///< Tamaño de las celdas de cada nivel, de menor a mayor. Se puede ajustar a las densidades reales con world::StatsOpen().
+		float dense_min_x, dense_min_y;		///< Esquina inferior izquierda del área densa.
+		float dense_max_x, dense_max_y;		///< Esquina superior derecha del área densa. Si es igual a la inferior no se utiliza el modo denso.
+		unsigned int queue_size;			///< Capacidad de la cola temporal de entidades (ver world::QueuePushBack()). Se redondea a potencia de dos.
+	};
+
+	class Entity;
+
+	/// Identificador generacional de una entidad en el mundo: índice de su entrada en el \a pool (bits bajos) y generación de la entrada (bits altos).
+	/// El valor 0 no corresponde a ninguna entidad.
+	typedef unsigned int Handle;
+
+	static const unsigned int HANDLE_INDEX_BITS = 20;	///< Bits del índice en world::Handle. Limita el número de entidades simultáneas en el mundo.
+
+	/// Reserva e inicializa recursos.
+	/// \param [in] config  Parámetros de configuración del mundo.
+	/// \return             Falso si la configuración no es válida o no hay memoria suficiente.
+	bool Initialize( const Config &config = Config() );
+
+	/// Libera recursos.
+	void Finalize( void );
+
+	/// Añade una entidad a la cola temporal de entidades.
+	/// La cola es de capacidad fija y sin bloqueos, por lo que se puede llamar desde varios hilos a la vez (por ejemplo al actualizar los agentes en paralelo). \n
+	/// Las entidades en la cola temporal son extraidas del mundo en el siguiente world::CommitUpdates(), igual que los cambios diferidos de Entity::WorldMove(),
+	/// pero desaparecen inmediatamente de las búsquedas y de las copias publicadas. Las regiones vigiladas reciben su evento de salida como muy tarde en ese world::CommitUpdates(). \n
+	/// Mientras están en la cola no es válido realizar llamadas a Entity::WorldUpdate() y Entity::WorldDelete(),
+	/// ni añadir entidades nuevas al mundo desde otros hilos.
+	/// \param [in] ent  Entidad a añadir a la cola.
+	/// \return          Falso si la cola está llena (ver Config::queue_size). En ese caso la entidad no se añade.
+	bool QueuePushBack( world::Entity *ent );
+	
+	/// Extrae la primera entidad de la cola temporal.
+	/// Se puede llamar desde varios hilos a la vez, también mientras otros hilos añaden entidades. El orden es FIFO.
+	/// \return   Entidad extraida de la cola o NULL si está vacía.
+	/// \note     Si la entidad se añadió después del último world::CommitUpdates() sigue insertada en su celda anterior, oculta para las búsquedas,
+	///           hasta la siguiente llamada a Entity::WorldUpdate(), Entity::WorldMove() o Entity::WorldDelete().
+	Entity * QueuePopFront( void );
+
+	/// Aplica todos los cambios de posición registrados mediante Entity::WorldMove().
+	/// Cuando hay más entidades que cambian de celda que celdas ocupadas en las tablas hash (multitudes), se ordenan (\a radix \a sort)
+	/// por su índice de celda destino y se reenlazan por grupos, de modo que cada celda afectada se busca una sola vez.
+	/// Si no, se reenlazan en orden, ya que la ordenación no compensa. \n
+	/// El trabajo por entidad es el mismo que el de Entity::WorldUpdate(), por lo que el coste total es algo mayor (un 10-20% con entidades dispersas);
+	/// la ventaja de aplazar los cambios es que las búsquedas ven el mundo del frame anterior completo mientras se actualizan las entidades. \n
+	/// Normalmente se llama una vez por frame, después de actualizar todas las entidades. \n
+	/// También extrae del mundo las entidades añadidas a la cola temporal mediante world::QueuePushBack().
+	/// \warning No llamar mientras se está iterando con world::NearbyIterator, ni mientras otros hilos utilizan la cola temporal.
+	void CommitUpdates( void );
+
+	/// Publica una copia de la cuadricula actual (ver world::Snapshot).
+	/// Se utilizan tres copias (\a triple \a buffering): la nueva se construye sobre una copia que no sea la última publicada ni esté en uso,
+	/// de modo que un lector que retiene una copia antigua no detiene la publicación. Nunca espera a los lectores. \n
+	/// Normalmente se llama una vez por frame al final de sim::Update(), después de world::CommitUpdates().
+	/// \return  Falso si los lectores retienen las otras dos copias: no se publica y world::SnapshotAcquire() sigue devolviendo la última publicada.
+	bool Publish( void );
+
+	/// Busca las \a k entidades más cercanas a un punto.
+	/// Se recorren anillos de celdas alrededor del punto hasta que la distancia a la \a k-ésima entidad encontrada es menor que la de cualquier celda sin visitar. \n
+	/// Las distancias se calculan con la última posición notificada de cada entidad. \n
+	/// \param [in]  x           Coordenada X del punto.
+	/// \param [in]  y           Coordenada Y del punto.
+	/// \param [in]  k           Número máximo de entidades a devolver.
+	/// \param [in]  type_mask   Tipos de entidad aceptados (ver world::TypeMask()), o world::ALL_TYPES.
+	/// \param [out] out         Array de al menos \a k entidades, ordenadas de menor a mayor distancia.
+	/// \param [out] dist        Array opcional de al menos \a k distancias a cada entidad de \a out, o NULL.
+	/// \param [in]  max_radius  Distancia máxima de búsqueda.
+	/// \return                  Número de entidades encontradas, como máximo \a k.
+	/// \warning Las entidades con cambios pendientes de world::CommitUpdates() se buscan en su celda anterior.
+	int NearestK( const float x, const float y, const int k, const unsigned int type_mask, Entity *out[], float *dist = 0, const float max_radius = 256.0f );
+
+	/// Obtiene la entidad de un identificador.
+	/// \param [in] handle  Identificador obtenido con Entity::GetHandle().
+	/// \return             Entidad o NULL si el identificador ha caducado (la entidad se extrajo del mundo) o no es válido.
+	Entity * Resolve( const Handle handle );
+
+	/// Obtiene la última posición notificada de una entidad.
+	/// \param [in]  handle  Identificador obtenido con Entity::GetHandle().
+	/// \param [out] x       Posición X.
+	/// \param [out] y       Posición Y.
+	/// \return              Falso si el identificador ha caducado o no es válido.
+	bool GetPosition( const Handle handle, float &x, float &y );
+
+	/// Busca las entidades cuyo centro está a menos de \a radius de un punto.
+	/// A diferencia de world::NearbyIterator, que devuelve todas las entidades de las celdas que cubren el área, el resultado es exacto. \n
+	/// Las celdas que quedan fuera del círculo no se visitan, y en las que quedan completamente dentro se devuelven todas las entidades sin calcular la distancia,
+	/// salvo las que tienen cambios pendientes de world::CommitUpdates().
+	/// \param [in]  x          Coordenada X del punto.
+	/// \param [in]  y          Coordenada Y del punto.
+	/// \param [in]  radius     Radio de búsqueda.
+	/// \param [in]  type_mask  Tipos de entidad aceptados (ver world::TypeMask()), o world::ALL_TYPES.
+	/// \param [out] out        Array de al menos \a max entidades, sin ningún orden.
+	/// \param [out] dist       Array opcional de al menos \a max distancias a cada entidad de \a out, o NULL.
+	/// \param [in]  max        Capacidad de \a out y \a dist.
+	/// \return                 Número de entidades encontradas, como máximo \a max.
+	/// \warning Las entidades con cambios pendientes de world::CommitUpdates() se buscan en su celda anterior.
+	int NearbyQuery( const float x, const float y, const float radius, const unsigned int type_mask, Entity *out[], float *dist, const int max );
+
+	/// Busca las entidades cuyo centro está dentro de un AABB.
+	/// Igual que world::NearbyQuery() pero con un área rectangular.
+	/// \param [in]  box_min_x  Coordenada X mínima del AABB.
+	/// \param [in]  box_min_y  Coordenada Y mínima del AABB.
+	/// \param [in]  box_max_x  Coordenada X máxima del AABB.
+	/// \param [in]  box_max_y  Coordenada Y máxima del AABB.
+	/// \param [in]  type_mask  Tipos de entidad aceptados (ver world::TypeMask()), o world::ALL_TYPES.
+	/// \param [out] out        Array de al menos \a max entidades, sin ningún orden.
+	/// \param [in]  max        Capacidad de \a out.
+	/// \return                 Número de entidades encontradas, como máximo \a max.
+	int NearbyQueryBox( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask, Entity *out[], const int max );
+
+	/// Par de entidades cercanas devuelto por world::ForEachPair().
+	struct Pair {
+		Entity	*a;		///< Primera entidad.
+		Entity	*b;		///< Segunda entidad.
+		float	dist;	///< Distancia entre sus centros.
+	};
+
+	/// Función que recibe los pares de world::ForEachPair() por lotes.
+	/// \param [in] pairs  Pares del lote.
+	/// \param [in] count  Número de pares del lote.
+	/// \param [in] user   Puntero indicado en world::ForEachPair().
+	typedef void (*PairCallback)( const Pair pairs[], const int count, void *user );
+
+	/// Enumera una sola vez cada par de entidades cuyos centros están a menos de \a radius.
+	/// Cada celda se compara consigo misma y con la mitad de sus vecinas (las filas superiores y las celdas a su derecha), de modo que ningún par se visita dos veces,
+	/// y con las celdas que solapan de los niveles de mayor tamaño. \n
+	/// Es mucho más barato que lanzar un world::NearbyIterator por cada entidad, que visita cada par dos veces y recorre cada celda varias veces.
+	/// \param [in] radius     Distancia máxima entre los centros.
+	/// \param [in] type_mask  Tipos de entidad aceptados (ver world::TypeMask()), o world::ALL_TYPES. Ambas entidades del par deben ser de estos tipos.
+	/// \param [in] callback   Función que recibe los pares por lotes.
+	/// \param [in] user       Puntero que se pasa a \a callback.
+	/// \warning No se pueden insertar, mover ni eliminar entidades desde \a callback.
+	///          Las entidades con cambios pendientes de world::CommitUpdates() se comparan en su celda anterior.
+	void ForEachPair( const float radius, const unsigned int type_mask, PairCallback callback, void *user );
+
+	static const int MAX_WATCHES = 32;	///< Número máximo de regiones vigiladas simultáneamente (ver world::Watch()).
+
+	/// Entrada o salida de una entidad en una región vigilada (ver world::Watch()).
+	struct WatchEvent {
+		Entity			*ent;		///< Entidad. En las salidas provocadas por Entity::WorldDelete() puede estar ya destruida: utilizar solo como identificador.
+		Handle			handle;		///< Identificador de la entidad. En las salidas provocadas por Entity::WorldDelete() ya ha caducado.
+		bool			enter;		///< Verdadero si la entidad ha entrado en la región, falso si ha salido.
+	};
+
+	/// Vigila una región circular, cuyos cambios de pertenencia se calculan de forma incremental.
+	/// Al crear la región se genera una entrada por cada entidad que ya está dentro. A partir de ahí, Entity::WorldUpdate(),
+	/// Entity::WorldMove() y Entity::WorldDelete() comprueban la posición notificada y añaden las entradas y salidas al buffer de la región. \n
+	/// Así la región de interés de una entidad (p.ej. sim::VEH_ENVIRONMENT_RADIUS alrededor del autobús) llega como diferencias en cada paso,
+	/// en lugar de repetir una búsqueda completa.
+	/// \param [in] x          Coordenada X del centro de la región.
+	/// \param [in] y          Coordenada Y del centro de la región.
+	/// \param [in] radius     Radio de la región. Se comprueba el centro de las entidades.
+	/// \param [in] type_mask  Tipos de entidad vigilados (ver world::TypeMask()).
+	/// \param [in] capacity   Número de eventos que se pueden acumular entre dos llamadas a world::WatchClear().
+	/// \return                Identificador de la región o -1 si ya hay world::MAX_WATCHES regiones.
+	int Watch( const float x, const float y, const float radius, const unsigned int type_mask, const int capacity = 1024 );
+
+	/// Deja de vigilar una región y libera su buffer de eventos.
+	/// No recorre las entidades: sus bits de la región se borran cuando world::Watch() necesita reutilizar el identificador.
+	/// \param [in] watch  Identificador devuelto por world::Watch().
+	void Unwatch( const int watch );
+
+	/// Mueve una región vigilada, generando los eventos de las entidades que quedan dentro o fuera.
+	/// Solo se recorren las celdas cuya cobertura cambia: las que cruza el borde de la región en su posición anterior o nueva,
+	/// o que quedan completamente dentro de solo una de ellas, y las entidades con movimientos pendientes cercanas.
+	/// \param [in] watch  Identificador devuelto por world::Watch().
+	/// \param [in] x      Nueva coordenada X del centro.
+	/// \param [in] y      Nueva coordenada Y del centro.
+	void WatchMove( const int watch, const float x, const float y );
+
+	/// Obtiene los eventos acumulados de una región desde el último world::WatchClear().
+	/// \param [in]  watch     Identificador devuelto por world::Watch().
+	/// \param [out] count     Número de eventos.
+	/// \param [out] overflow  Verdadero si se han descartado eventos por falta de capacidad. En ese caso hay que volver a crear la región para conocer su contenido.
+	/// \return                Eventos en el orden en que se produjeron.
+	const WatchEvent * WatchEvents( const int watch, int &count, bool &overflow );
+
+	/// Vacía el buffer de eventos de una región.
+	/// \param [in] watch  Identificador devuelto por world::Watch().
+	void WatchClear( const int watch );
+
+	/// Ocupación de un nivel de la cuadricula (ver world::Stats).
+	struct LevelStats {
+		float			cell_size;		///< Tamaño de las celdas.
+		unsigned int	cells;			///< Número de celdas ocupadas.
+		unsigned int	entities;		///< Número de entidades en las celdas.
+		unsigned int	max_per_cell;	///< Máximo de entidades en una celda.
+		float			mean_per_cell;	///< Media de entidades por celda ocupada.
+	};
+
+	/// Estadísticas de la cuadricula, para ajustar los tamaños de celda (ver world::Config) a las densidades reales.
+	/// Los contadores se acumulan desde el último world::StatsReset() o world::StatsDump(); la ocupación se calcula al consultarlas. \n
+	/// Los de las búsquedas (queries, cells_visited, entities_returned y lookups) sólo cuentan entre world::StatsOpen() y world::StatsClose(),
+	/// y admiten búsquedas simultáneas desde varios hilos.
+	struct Stats {
+		unsigned int	frame;				///< Número de filas escritas por world::StatsDump().
+		unsigned int	migrations;			///< Cambios de celda (incluidas las inserciones).
+		unsigned int	queries;			///< Búsquedas con world::NearbyIterator, incluidas las de world::NearbyQuery() y world::NearbyQueryBox().
+		unsigned int	cells_visited;		///< Celdas visitadas por estas búsquedas.
+		unsigned int	entities_returned;	///< Entidades devueltas por estas búsquedas.
+		unsigned int	lookups;			///< Búsquedas de celdas en la cuadricula (tabla hash o área densa).
+		double			lookup_time;		///< Tiempo dedicado a buscar celdas en segundos, o 0 si no se mide (ver world::StatsOpen()).
+		int				num_levels;			///< Número de niveles en Stats::levels.
+		LevelStats		levels[ MAX_LEVELS ];	///< Ocupación de cada nivel.
+	};
+
+	/// Obtiene las estadísticas actuales. Recorre todas las celdas ocupadas.
+	/// \param [out] stats  Estadísticas.
+	void GetStats( Stats &stats );
+
+	/// Pone a cero los contadores de world::Stats.
+	void StatsReset( void );
+
+	/// Abre un fichero CSV para volcar las estadísticas con world::StatsDump() y escribe la cabecera.
+	/// Debe llamarse después de world::Initialize(); world::Finalize() cierra el fichero.
+	/// \param [in] path    Ruta del fichero.
+	/// \param [in] timing  Medir el tiempo de cada búsqueda de celda. El propio reloj añade un coste apreciable a cada búsqueda.
+	/// \return             Falso si no se puede crear el fichero.
+	bool StatsOpen( const char *path, const bool timing = false );
+
+	/// Escribe una fila con las estadísticas del frame en el fichero CSV, si está abierto, y pone a cero los contadores.
+	/// Se llama una vez por frame, tras world::CommitUpdates() y las búsquedas del frame.
+	void StatsDump( void );
+
+	/// Cierra el fichero CSV y desactiva la medida de tiempos.
+	void StatsClose( void );
+
 	/// Clase base de las entidades dinámicas del mundo.
 	/// Cada tipo de entidad tiene un identificador \a type que podemos utilizar para hacer \a downcasting. \n
 	/// Cada vez que la entidad cambia su posición hay que notificarlo mediante Entity::WorldUpdate(). \n
@@ -132,44 +384,65 @@ namespace world
 			/// Constructor de la entidad base.
 			/// Las entidades no son insertadas en el mundo hasta que no se llame a Entity::WorldUpdate().
 			/// \param [in] type  Tipo de entidad que nos permite realizar \a downcasting.
-			Entity( unsigned int type ) : type(type), cell_x(0), cell_y(0), next(0) { }
+			Entity( unsigned int type ) : type(type), handle(0), extent(0) { }
 			
 			/// Destructor de la entidad base.
 			/// Al destruirse una entidad se extrae automaticamente del mundo.
-			virtual ~Entity() { if( cell_x | cell_y ) WorldDelete(); }
+			virtual ~Entity() { if( handle ) WorldDelete(); }
 			
 			/// Obtiene el tipo de la entidad base.
 			/// \return  Tipo de entidad.
 			inline unsigned int GetType( void ) const { return this->type; }
 
+			/// Obtiene el identificador de la entidad en el mundo.
+			/// Se asigna en la primera llamada a Entity::WorldUpdate() o Entity::WorldMove() y caduca al llamar a Entity::WorldDelete().
+			/// \return  Identificador o 0 si la entidad no está en el mundo.
+			inline Handle GetHandle( void ) const { return this->handle; }
+
+			/// Indica el tamaño de la entidad para elegir el nivel de la cuadricula donde se guarda (ver world::Config).
+			/// El cambio de nivel se aplica en la próxima llamada a Entity::WorldUpdate() o Entity::WorldMove(). \n
+			/// Las búsquedas amplían su alcance en cada nivel según el radio de sus entidades, por lo que encuentran las entidades
+			/// cuyo radio solapa el área de búsqueda aunque su centro esté fuera.
+			/// \param [in] radius  Radio de la entidad. Por defecto 0.
+			inline void SetExtent( const float radius ) { this->extent = radius; }
+			
+			/// Obtiene el radio de la entidad indicado mediante Entity::SetExtent().
+			inline float GetExtent( void ) const { return this->extent; }
+
 			/// Notificar que la entidad ha cambiado de posición.
 			/// Esta función hay que llamarla cada vez que la entidad cambia de posición para mantener las celdas actualizadas.
 			/// \param [in] x  Posición X actual de la entidad.
 			/// \param [in] y  Posición Y actual de la entidad.
-			void WorldUpdate( const float x, const float y );
+			/// \return        Falso si la entidad no estaba en el mundo y no cabe: se han agotado los índices de world::Handle (world::HANDLE_INDEX_BITS) o la memoria.
+			bool WorldUpdate( const float x, const float y );
+
+			/// Registra un cambio de posición de la entidad sin modificar las celdas.
+			/// El cambio de celda se aplica más tarde, junto al resto de entidades, en world::CommitUpdates(). \n
+			/// A diferencia de Entity::WorldUpdate(), es válido llamarla mientras se está iterando con world::NearbyIterator.
+			/// \param [in] x  Posición X actual de la entidad.
+			/// \param [in] y  Posición Y actual de la entidad.
+			/// \return        Falso si la entidad no estaba en el mundo y no cabe, como en Entity::WorldUpdate().
+			bool WorldMove( const float x, const float y );
 			
 			/// Extrae la entidad del mundo.
+			/// El coste es constante, independiente del número de entidades en la celda. \n
 			/// Despues de llamar a Entity::WorldDelete() el mundo deja de tener referencias a la entidad, \n
 			/// por tanto no se encontrará mediante world::NearbyIterator. \n
 			/// Es completamente valido volver a insertar la entidad mediante Entity::WorldUpdate(). \n
+			/// Cualquier cambio pendiente registrado mediante Entity::WorldMove() se descarta.
 			void WorldDelete( void );
 
-			/// Indica si la entidad está insertada en el mundo.
-			inline bool WorldInserted( void ) const { return (bool) ( cell_x | cell_y ); }
+			/// Indica si la entidad está insertada en alguna celda del mundo.
+			bool WorldInserted( void ) const;
 			
 		private:
 		//public:
 
-			friend  bool world::Initialize( void );
 			friend  void world::Finalize( void );
-			friend  void world::QueuePushBack( world::Entity *ent );
-			friend  world::Entity * world::QueuePopFront( void );
-			friend  class NearbyIterator;
 	
 			const unsigned int  type;
-			unsigned short 		cell_x;
-			unsigned short 		cell_y;
-			Entity	       		*next;
+			Handle				handle;		///< Identificador de la entidad en el mundo o 0. La posición, la celda y los enlaces de la entidad se guardan en el \a pool.
+			float				extent;		///< Radio de la entidad. Ver Entity::SetExtent().
 	};
 	
 	
@@ -184,36 +457,150 @@ namespace world
 			/// \param [in] pos_x   Coordenada X de la posición/centro.
 			/// \param [in] pos_y   Coordenada Y de la posición/centro.
 			/// \param [in] radius  Radio de búsqueda.
-			NearbyIterator( const float pos_x, const float pos_y, const float radius );
+			/// \param [in] type_mask  Tipos de entidad a devolver (ver world::TypeMask()). Las celdas sin ninguno de estos tipos no se recorren.
+			NearbyIterator( const float pos_x, const float pos_y, const float radius, const unsigned int type_mask = ALL_TYPES );
 
 			/// Constructor del iterador a partir de un AABB.
 			/// \param [in] box_min_x   Coordenada X del punto inferior izquierda.
 			/// \param [in] box_min_y   Coordenada Y del punto inferior izquierda.
 			/// \param [in] box_max_x   Coordenada X del punto superior derecha.
 			/// \param [in] box_max_y   Coordenada Y del punto superior derecha.
-			NearbyIterator( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y );
+			/// \param [in] type_mask   Tipos de entidad a devolver (ver world::TypeMask()).
+			NearbyIterator( const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask = ALL_TYPES );
 			
 			/// Reinicia el iterador.
 			void Reset( void );
 				
 			/// Devuelve la siguiente entidad cercana o NULL para finalizar.
-			/// El orden de las entidades no está definido. \n
+			/// El orden de las entidades no está definido. Solamente se devuelven entidades de los tipos indicados en el constructor. \n
 			/// El radio o alcance de la búsqueda puede ser mayor al indicado en el constructor pero nunca menor. \n
 			/// \return  Siguiente entidad encontrada o NULL.
 			/// \warning Nunca eliminar entidades o realizar llamadas a Entity::WorldUpdate() o Entity::WorldDelete()
 			///          mientras se está iterando sobre ellas.
 			Entity * Next( void );
+
+			/// Número de celdas visitadas desde el último Reset().
+			inline unsigned int GetVisitedCells( void ) const { return this->cells; }
 		
 		private:
+
+			/// Pasa al siguiente nivel con entidades y calcula su rango de celdas.
+			/// \return  Falso si no quedan niveles.
+			bool BeginLevel( void );
+
+			/// Pasa a la siguiente celda, de este nivel o de los siguientes, y deja su lista en NearbyIterator::ent.
+			/// \return  Falso si no quedan celdas.
+			bool NextCell( void );
 		
+			float          box_min_x, box_min_y;
+			float          box_max_x, box_max_y;
+			int            level;
 			unsigned short cell_min_x, cell_min_y;
 			unsigned short cell_max_x, cell_max_y;
 			unsigned short cell_cur_x, cell_cur_y;
-			Entity *ent;
+			unsigned int   type_mask;
+			unsigned int   cells;
+			unsigned int   ent;		///< Entrada del \a pool de la entidad actual o 0.
+	};
+
+
+	/// Entidad dentro de una copia de la cuadricula (world::Snapshot).
+	struct SnapshotEntity {
+		Entity			*ent;		///< Entidad original. Solo como identificador, no acceder a ella desde otros hilos.
+		Handle			handle;		///< Identificador de la entidad, que se puede guardar y comprobar más tarde con world::Resolve() desde el hilo principal.
+		unsigned int	type;		///< Tipo de la entidad (ver Entity::GetType()).
+		float			x, y;		///< Posición de la entidad en el momento de la publicación.
+	};
+
+	/// Celda dentro de una copia de la cuadricula (world::Snapshot).
+	struct SnapshotCell {
+		unsigned int	code;		///< Código Morton de la celda: bits de las coordenadas de celda X (pares) e Y (impares) intercalados.
+		unsigned int	begin;		///< Primera entidad de la celda en Snapshot::entities. La última es la anterior a la siguiente celda.
+		unsigned int	types;		///< Máscara de los tipos de entidad presentes en la celda (ver world::TypeMask()).
+	};
+
+	/// Nivel de la cuadricula dentro de una copia (world::Snapshot).
+	struct SnapshotLevel {
+		float					cell_size;		///< Tamaño de las celdas del nivel.
+		float					extent;			///< Radio máximo de las entidades del nivel.
+		unsigned int			num_cells;		///< Número de celdas ocupadas.
+		const SnapshotCell		*cells;			///< Celdas ocupadas más una celda final cuyo SnapshotCell::begin indica el final de las entidades del nivel.
 	};
 
-/* //####TODO: NOT TESTED
-	/// Nos permite iterar sobre las entidades del mundo entorno a una recta y un radio.
+	/// Copia inmutable de la cuadricula publicada mediante world::Publish().
+	/// Las celdas de cada nivel están ordenadas por su código Morton (curva Z), de modo que las celdas cercanas, y sus entidades, quedan cerca en memoria. \n
+	/// Permite realizar búsquedas desde otros hilos (visualización, sensores, salida de datos) mientras se modifica la cuadricula real.
+	struct Snapshot {
+		unsigned int			frame;					///< Número de publicación, empezando por 1.
+		int						num_levels;				///< Número de niveles.
+		SnapshotLevel			levels[MAX_LEVELS];		///< Niveles de la cuadricula.
+		unsigned int			num_entities;			///< Número de entidades.
+		const SnapshotEntity	*entities;				///< Entidades agrupadas por celdas.
+	};
+
+	/// Obtiene la última copia publicada para su lectura.
+	/// Puede llamarse desde cualquier hilo. La copia no se modificará hasta liberarla mediante world::SnapshotRelease().
+	/// \return  Última copia publicada o NULL si aún no se ha publicado ninguna.
+	/// \warning Mientras los lectores retengan dos copias además de la última publicada, world::Publish() no publica nuevas.
+	const Snapshot * SnapshotAcquire( void );
+
+	/// Libera una copia obtenida mediante world::SnapshotAcquire().
+	/// \param [in] snapshot  Copia a liberar. Puede ser NULL.
+	void SnapshotRelease( const Snapshot *snapshot );
+
+	/// Nos permite iterar sobre las entidades de una copia de la cuadricula alrededor de un punto o AABB.
+	/// Equivalente a world::NearbyIterator pero de solo lectura, por lo que puede utilizarse desde cualquier hilo. \n
+	/// Recorre el rango de códigos Morton del área de forma secuencial y, al salir del área, salta al siguiente código dentro de ella (BIGMIN) con una búsqueda binaria.
+	class SnapshotIterator
+	{
+		public:
+
+			/// Constructor del iterador a partir de un punto y un radio.
+			/// \param [in] snapshot  Copia de la cuadricula obtenida mediante world::SnapshotAcquire().
+			/// \param [in] pos_x     Coordenada X de la posición/centro.
+			/// \param [in] pos_y     Coordenada Y de la posición/centro.
+			/// \param [in] radius    Radio de búsqueda.
+			/// \param [in] type_mask Tipos de entidad a devolver (ver world::TypeMask()).
+			SnapshotIterator( const Snapshot *snapshot, const float pos_x, const float pos_y, const float radius, const unsigned int type_mask = ALL_TYPES );
+
+			/// Constructor del iterador a partir de un AABB.
+			/// \param [in] snapshot   Copia de la cuadricula obtenida mediante world::SnapshotAcquire().
+			/// \param [in] box_min_x  Coordenada X del punto inferior izquierda.
+			/// \param [in] box_min_y  Coordenada Y del punto inferior izquierda.
+			/// \param [in] box_max_x  Coordenada X del punto superior derecha.
+			/// \param [in] box_max_y  Coordenada Y del punto superior derecha.
+			/// \param [in] type_mask  Tipos de entidad a devolver (ver world::TypeMask()).
+			SnapshotIterator( const Snapshot *snapshot, const float box_min_x, const float box_min_y, const float box_max_x, const float box_max_y, const unsigned int type_mask = ALL_TYPES );
+
+			/// Reinicia el iterador.
+			void Reset( void );
+
+			/// Devuelve la siguiente entidad cercana o NULL para finalizar.
+			/// Igual que en world::NearbyIterator, el alcance de la búsqueda puede ser mayor al indicado pero nunca menor.
+			/// \return  Siguiente entidad encontrada o NULL.
+			const SnapshotEntity * Next( void );
+
+		private:
+
+			/// Pasa al siguiente nivel con entidades y calcula su rango de celdas.
+			/// \return  Falso si no quedan niveles.
+			bool BeginLevel( void );
+
+			const Snapshot *snapshot;
+			unsigned int   type_mask;
+			float          box_min_x, box_min_y;
+			float          box_max_x, box_max_y;
+			int            level;
+			unsigned int   code_min;		///< Código Morton de la esquina inferior izquierda del área en el nivel actual.
+			unsigned int   code_max;		///< Código Morton de la esquina superior derecha del área en el nivel actual.
+			unsigned int   cell;			///< Siguiente celda en SnapshotLevel::cells.
+			unsigned int   ent, ent_end;	///< Rango de entidades pendientes de la celda actual.
+	};
+
+	/// Nos permite iterar sobre las entidades del mundo entorno a un segmento (pasillo) de anchura 2*radius.
+	/// Útil para comprobar únicamente la trayectoria por delante de un vehículo, en lugar de todo un cuadrado alrededor suyo. \n
+	/// Las celdas se recorren columna a columna sobre el eje principal del rayo (al estilo del algoritmo DDA de Amanatides-Woo),
+	/// visitando en cada columna solamente las celdas cubiertas por el segmento ensanchado por el radio, y nunca dos veces la misma celda. \n
 	/// Ver ::world para un ejemplo de uso.
 	class NearbyRayIterator
 	{
@@ -222,23 +609,15 @@ namespace world
 			/// Constructor del iterador a partir de un rayo, radio y distancia.
 			/// \param [in] px			Coordenada X del origen del rayo.
 			/// \param [in] py			Coordenada Y del origen del rayo.
-			/// \param [in] dx			Coordenada X de la dirección del rayo.
-			/// \param [in] dy			Coordenada Y de la dirección del rayo.
+			/// \param [in] dx			Coordenada X de la dirección del rayo. No es necesario que esté normalizada.
+			/// \param [in] dy			Coordenada Y de la dirección del rayo. No es necesario que esté normalizada.
 			/// \param [in] radius		Radio/anchura del rayo.
 			/// \param [in] distance	Distancia/longitud del rayo.
-			NearbyRayIterator( const float px, const float py, const float dx, const float dy, const float radius, const float distance )
-				: px(px), py(py), radius(radius), count0(0), count1(-1), ent(0),
-				  mx   ( ( dx >= dy ? 1.00f : dx/dy ) * world::CELL_SIZE ),
-				  my   ( ( dx >= dy ? dy/dx : 1.00f ) * world::CELL_SIZE ),
-				  total( ( dx >= dy ? dx : dy ) * (distance+radius) * world::CELL_SIZE_INV )
-				{ }
+			/// \param [in] type_mask	Tipos de entidad a devolver (ver world::TypeMask()).
+			NearbyRayIterator( const float px, const float py, const float dx, const float dy, const float radius, const float distance, const unsigned int type_mask = ALL_TYPES );
 				
 			/// Reinicia el iterador.
-			void Reset( void ) {
-				this->count0 =  0;
-				this->count1 = -1;
-				this->ent = NULL;
-			}
+			void Reset( void );
 
 			/// Devuelve la siguiente entidad cercana o NULL para finalizar.
 			/// El orden de las entidades no está definido. \n
@@ -247,34 +626,121 @@ namespace world
 			/// \warning Nunca eliminar entidades o realizar llamadas a Entity::WorldUpdate() o Entity::WorldDelete()
 			///          mientras se está iterando sobre ellas.
 			Entity * Next( void );
+
+			/// Número de celdas visitadas desde el último Reset().
+			inline unsigned int GetVisitedCells( void ) const { return this->cells; }
 		
 		private:
 
-			const float px, py;
-			const float radius;
-			int         count0;
-			int         count1;
-			Entity      *ent;
-			const float mx, my;
-			const int   total;
+			/// Pasa al siguiente nivel con entidades y calcula su rango de columnas.
+			/// \return  Falso si no quedan niveles.
+			bool BeginLevel( void );
+
+			/// Calcula el rango de celdas del eje secundario en la columna actual.
+			void BeginColumn( void );
+
+			bool           swap;				///< El eje principal es Y en lugar de X.
+			float          u0, v0;				///< Origen del segmento en coordenadas (principal, secundaria), con u0 <= u1.
+			float          u1;					///< Final del segmento en el eje principal.
+			float          slope;				///< Pendiente del segmento dv/du, entre -1 y 1.
+			float          radius;				///< Radio del pasillo.
+			float          level_radius;		///< Radio del pasillo ampliado con el radio de las entidades del nivel actual.
+			float          width;				///< Semi-anchura del pasillo medida sobre el eje secundario.
+			int            level;				///< Nivel actual.
+			unsigned short col_min, col_max;	///< Rango de columnas (eje principal).
+			unsigned short col_cur;				///< Columna actual.
+			unsigned short row_cur, row_max;	///< Fila actual y última fila de la columna actual (eje secundario).
+			unsigned int   type_mask;			///< Tipos de entidad a devolver.
+			unsigned int   cells;				///< Número de celdas visitadas.
+			unsigned int   ent;					///< Entrada del \a pool de la entidad actual o 0.
 	};
-*/
 
-	/// Reserva e inicializa recursos.
-	bool Initialize( void );
 
-	/// Libera recursos.
-	void Finalize( void );
+	/// Lista de vecinos de una entidad guardada entre pasos de simulación (lista de Verlet).
+	/// La lista contiene las entidades a menos de \a radius + \a skin de la entidad en el momento de construirla,
+	/// y solo se reconstruye cuando la entidad se ha movido más de \a skin / 2 desde entonces. \n
+	/// Mientras las demás entidades tampoco se muevan más de \a skin / 2 entre reconstrucciones, la lista contiene todos los vecinos a menos de \a radius.
+	/// Un \a skin mayor reduce las reconstrucciones a cambio de listas más largas.
+	/// \note Las entidades se guardan por su world::Handle, de modo que las que salen del mundo se descartan al recorrer la lista.
+	class NeighbourList
+	{
+		public:
 
+			/// Constructor de una lista vacía.
+			/// \param [in] radius     Radio de interacción.
+			/// \param [in] skin       Margen añadido al radio al construir la lista.
+			/// \param [in] type_mask  Tipos de entidad a guardar (ver world::TypeMask()).
+			NeighbourList( const float radius, const float skin, const unsigned int type_mask = ALL_TYPES );
+
+			/// Destructor de la lista.
+			~NeighbourList();
+
+			/// Actualiza la lista de vecinos de una entidad, reconstruyéndola con una búsqueda en la cuadricula solo si es necesario.
+			/// Se utiliza la última posición notificada de la entidad (Entity::WorldUpdate() o Entity::WorldMove()). \n
+			/// La lista se reconstruye si la entidad se ha movido más de \a skin / 2, si es otra entidad o si se llama a NeighbourList::Invalidate().
+			/// \param [in] ent  Entidad propietaria de la lista, que no se incluye en ella.
+			/// \return          Verdadero si la lista se ha reconstruido.
+			/// \warning Las entidades con cambios pendientes de world::CommitUpdates() se buscan en su celda anterior.
+			bool Update( const Entity &ent );
+
+			/// Fuerza la reconstrucción de la lista en la próxima llamada a NeighbourList::Update().
+			inline void Invalidate( void ) { this->owner = 0; }
+
+			/// Número de entidades guardadas en la lista, incluidas las que hayan salido del mundo desde su construcción.
+			inline unsigned int GetCount( void ) const { return this->count; }
+
+			/// Número de llamadas a NeighbourList::Update() que han reutilizado la lista.
+			inline unsigned int GetHits( void ) const { return this->hits; }
+
+			/// Número de llamadas a NeighbourList::Update() que han reconstruido la lista.
+			inline unsigned int GetMisses( void ) const { return this->misses; }
+
+		private:
+
+			NeighbourList( const NeighbourList& ) = delete;
+			NeighbourList& operator=( const NeighbourList& ) = delete;
+
+			friend class NeighbourIterator;
+
+			float          radius;			///< Radio de interacción.
+			float          skin;			///< Margen añadido al radio.
+			unsigned int   type_mask;		///< Tipos de entidad a guardar.
+			Handle         owner;			///< Entidad para la que se construyó la lista o 0 si hay que reconstruirla.
+			float          build_x;			///< Posición X de la entidad al construir la lista.
+			float          build_y;			///< Posición Y de la entidad al construir la lista.
+			Handle         *list;			///< Vecinos.
+			unsigned int   count;			///< Número de vecinos en NeighbourList::list.
+			unsigned int   size;			///< Capacidad de NeighbourList::list.
+			unsigned int   hits;			///< Actualizaciones sin reconstrucción.
+			unsigned int   misses;			///< Actualizaciones con reconstrucción.
+	};
+
+
+	/// Iterador sobre una lista de vecinos (world::NeighbourList), con el mismo uso que world::NearbyIterator.
+	class NeighbourIterator
+	{
+		public:
+
+			/// Constructor del iterador.
+			/// \param [in] list  Lista actualizada con NeighbourList::Update().
+			NeighbourIterator( const NeighbourList &list ) : list(list), i(0) { }
+
+			/// Reinicia el iterador.
+			inline void Reset( void ) { this->i = 0; }
+
+			/// Devuelve el siguiente vecino o NULL para finalizar.
+			/// El radio de la lista puede ser mayor al de interacción (ver world::NeighbourList) pero nunca menor. \n
+			/// Las entidades que han salido del mundo desde la construcción de la lista se descartan.
+			/// \return  Siguiente entidad o NULL.
+			/// \warning Nunca eliminar entidades o realizar llamadas a Entity::WorldDelete() mientras se está iterando sobre ellas.
+			Entity * Next( void );
+
+		private:
+
+			const NeighbourList &list;
+			unsigned int        i;		///< Siguiente posición de NeighbourList::list.
+	};
 
-	/// Añade una entidad a la cola temporal de entidades.
-	/// Las entidades en la cola temporal son extraidas del mundo, no es válido realizar llamadas a world::WorldUpdate y world::WorldDelete.
-	/// \pram ent   Entidad a añadir a la pila.
-	void QueuePushBack( world::Entity *ent );
-	
-	/// Extrae la primera entidad de la cola temporal.
-	/// \return   Entidad extraida de la cola.
-	Entity * QueuePopFront( void );
 }
 
 